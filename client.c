@@ -18,29 +18,102 @@
 
 #include "debug.h"
 #include "client.h"
-#include "uthash.h"
 #include "control.h"
 #include "config.h"
-#include "uthash.h"
 #include "zip.h"
 #include "common.h"
 #include "proxy.h"
 #include "utils.h"
 #include "tcpmux.h"
+#include "worker.h"
+#include "local_pool.h"
 
-static struct proxy_client 	*all_pc = NULL;
+/**
+ * @brief Write callback freeing a bufferevent once its output is sent
+ *
+ * @param bev Bufferevent that drained its output
+ * @param ctx Unused
+ */
+static void close_on_flushed_cb(struct bufferevent *bev, void *ctx) {
+	bufferevent_free(bev);
+}
+
+/**
+ * @brief Event callback freeing a bufferevent that failed while flushing
+ *
+ * @param bev Bufferevent that triggered the callback
+ * @param what Type of event that occurred
+ * @param ctx Unused
+ */
+static void close_on_flush_error_cb(struct bufferevent *bev, short what, void *ctx) {
+	bufferevent_free(bev);
+}
+
+/**
+ * @brief Closes a bufferevent after the data queued on it is sent
+ *
+ * The bufferevent no longer belongs to any proxy client afterwards.
+ *
+ * @param bev Bufferevent to close
+ */
+static void close_after_flush(struct bufferevent *bev) {
+	if (evbuffer_get_length(bufferevent_get_output(bev)) == 0) {
+		bufferevent_free(bev);
+		return;
+	}
+
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+	bufferevent_setcb(bev, NULL, close_on_flushed_cb, close_on_flush_error_cb, NULL);
+	bufferevent_enable(bev, EV_WRITE);
+}
 
 /**
  * @brief Event callback for worker connection events
+ *
+ * The server closed a direct work connection: the local side gets what is
+ * still queued for it and the proxy client goes away.
  * 
  * @param bev Bufferevent that triggered the callback
  * @param what Type of event that occurred
- * @param ctx Context pointer (unused)
+ * @param ctx Context pointer (proxy client)
  */
 static void xfrp_worker_event_cb(struct bufferevent *bev, short what, void *ctx) {
+	struct proxy_client *client = ctx;
+
 	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
 		debug(LOG_DEBUG, "Working connection closed");
 		bufferevent_free(bev);
+		if (!client) {
+			return;
+		}
+
+		client->ctl_bev = NULL;
+		if (client->local_proxy_bev) {
+			close_after_flush(client->local_proxy_bev);
+			client->local_proxy_bev = NULL;
+		}
+		del_proxy_client_by_stream_id(client->stream_id);
+	}
+}
+
+/**
+ * @brief Write callback of a direct work connection
+ *
+ * Called once the output drained to TX_LOW_WATERMARK; lets the local
+ * connection read again if the backlog had paused it.
+ *
+ * @param bev Bufferevent of the work connection
+ * @param ctx Context pointer (proxy client)
+ */
+static void xfrp_worker_write_cb(struct bufferevent *bev, void *ctx) {
+	struct proxy_client *client = ctx;
+
+	if (client && client->local_proxy_bev &&
+		!(bufferevent_get_enabled(client->local_proxy_bev) & EV_READ)) {
+		bufferevent_enable(client->local_proxy_bev, EV_READ);
+	} else if (client && client->udp) {
+		udp_tunnel_resume(client);
 	}
 }
 
@@ -82,6 +155,18 @@ static void handle_proxy_disconnect(struct proxy_client *client,
 	debug(LOG_DEBUG, "Proxy close connection %s - stream_id %d: %s",
 		  error_msg, client->stream_id, strerror(errno));
 
+	// A direct work connection ends with its local connection
+	if (!get_common_config()->tcp_mux) {
+		bufferevent_free(bev);
+		client->local_proxy_bev = NULL;
+		if (client->ctl_bev) {
+			close_after_flush(client->ctl_bev);
+			client->ctl_bev = NULL;
+		}
+		del_proxy_client_by_stream_id(client->stream_id);
+		return;
+	}
+
 	if (tmux_stream_close(client->ctl_bev, &client->stream)) {
 		bufferevent_free(bev);
 		client->local_proxy_bev = NULL;
@@ -175,7 +260,8 @@ static void setup_proxy_callbacks(struct proxy_client *client,
 		*proxy_c2s_recv = ftp_proxy_c2s_cb;
 		*proxy_s2c_recv = ftp_proxy_s2c_cb;
 	} else if (is_udp_proxy(ps)) {
-		*proxy_c2s_recv = udp_proxy_c2s_cb;
+		// Datagrams of the local service are read by the udp tunnel itself
+		*proxy_c2s_recv = NULL;
 		*proxy_s2c_recv = udp_proxy_s2c_cb;
 	} else {
 		*proxy_c2s_recv = tcp_proxy_c2s_cb;
@@ -183,6 +269,71 @@ static void setup_proxy_callbacks(struct proxy_client *client,
 	}
 }
 
+/**
+ * @brief Creates the compression streams of a proxy with use_compression
+ *
+ * frps wraps the work connection of such a proxy in snappy framing; only
+ * plain TCP proxies go through it here.
+ *
+ * @param client Pointer to the proxy client structure
+ * @return int 0 on success, -1 on allocation failure
+ */
+static int setup_compression(struct proxy_client *client)
+{
+	struct proxy_service *ps = client->ps;
+
+	if (!ps->use_compression || is_ftp_proxy(ps) || is_udp_proxy(ps)) {
+		return 0;
+	}
+
+	client->zip_in = zip_stream_new(0, NULL);
+	client->zip_out = zip_stream_new(ps->compression_min_gain, &ps->zip_stats);
+	if (!client->zip_in || !client->zip_out) {
+		debug(LOG_ERR, "Failed to create compression streams of proxy %s", ps->proxy_name);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Logs the compression counters of proxies that sent data lately
+ *
+ * Shows per proxy how much the compressor saved, how fast it ran and how
+ * often sampling switched a stream to raw chunks. Called on every
+ * heartbeat from the main thread, while workers keep updating the counters.
+ */
+void log_compression_stats(void)
+{
+	struct proxy_service *ps, *tmp;
+	struct proxy_service *all_ps = get_all_proxy_services();
+
+	HASH_ITER(hh, all_ps, ps, tmp) {
+		if (!ps->use_compression) {
+			continue;
+		}
+
+		struct zip_stats *st = &ps->zip_stats;
+		uint64_t in = __atomic_load_n(&st->bytes_in, __ATOMIC_RELAXED);
+		uint64_t out = __atomic_load_n(&st->bytes_out, __ATOMIC_RELAXED);
+		uint64_t raw = __atomic_load_n(&st->bytes_raw, __ATOMIC_RELAXED);
+		uint64_t ns = __atomic_load_n(&st->compress_ns, __ATOMIC_RELAXED);
+		uint32_t samples = __atomic_load_n(&st->samples, __ATOMIC_RELAXED);
+		uint32_t bypasses = __atomic_load_n(&st->bypasses, __ATOMIC_RELAXED);
+
+		if (in + raw == ps->zip_logged) {
+			continue;
+		}
+		ps->zip_logged = in + raw;
+
+		debug(LOG_INFO, "Proxy [%s] compression: %llu -> %llu bytes (%d%% saved) at %llu MB/s, "
+			  "%llu bytes sent raw, %u of %u samples bypassed",
+			  ps->proxy_name, (unsigned long long)in, (unsigned long long)out,
+			  in ? (int)(100 - out * 100 / in) : 0,
+			  (unsigned long long)(ns ? in * 1000 / ns : 0),
+			  (unsigned long long)raw, bypasses, samples);
+	}
+}
+
 /**
  * @brief Sets up a local connection for the proxy client
  * 
@@ -195,17 +346,22 @@ static void setup_proxy_callbacks(struct proxy_client *client,
 static int setup_local_connection(struct proxy_client *client) 
 {
 	struct proxy_service *ps = client->ps;
+	int connected;
 	
 	if (is_udp_proxy(ps)) {
-		client->local_proxy_bev = connect_udp_server(client->base);
+		connected = udp_tunnel_open(client) == 0;
 	} else if (!is_socks5_proxy(ps)) {
-		client->local_proxy_bev = connect_server(client->base, ps->local_ip, ps->local_port);
+		client->local_proxy_bev = local_pool_take(ps, client->base);
+		if (!client->local_proxy_bev) {
+			client->local_proxy_bev = connect_server(client->base, ps->local_ip, ps->local_port);
+		}
+		connected = client->local_proxy_bev != NULL;
 	} else {
 		debug(LOG_DEBUG, "socks5 proxy client can't connect to remote server here ...");
 		return 0;
 	}
 
-	if (!client->local_proxy_bev) {
+	if (!connected) {
 		debug(LOG_ERR, "frpc tunnel connect local proxy port [%d] failed!", ps->local_port);
 		del_proxy_client_by_stream_id(client->stream_id);
 		return -1;
@@ -231,7 +387,7 @@ void start_xfrp_tunnel(struct proxy_client *client)
 		return;
 	}
 
-	if (setup_local_connection(client) <= 0) {
+	if (setup_compression(client) < 0 || setup_local_connection(client) <= 0) {
 		return;
 	}
 
@@ -245,15 +401,31 @@ void start_xfrp_tunnel(struct proxy_client *client)
 	bufferevent_data_cb proxy_s2c_recv, proxy_c2s_recv;
 	setup_proxy_callbacks(client, &proxy_c2s_recv, &proxy_s2c_recv);
 
+	// Queue what came with StartWorkConn ahead of anything read later, mux
+	// frames are forwarded to the local connection before it is connected
+	send_client_data_tail(client);
+
 	if (!c_conf->tcp_mux) {
-		bufferevent_setcb(client->ctl_bev, proxy_s2c_recv, NULL, 
+		bufferevent_setcb(client->ctl_bev, proxy_s2c_recv, xfrp_worker_write_cb,
 						 xfrp_worker_event_cb, client);
+		bufferevent_setwatermark(client->ctl_bev, EV_WRITE, TX_LOW_WATERMARK, 0);
 		bufferevent_enable(client->ctl_bev, EV_READ|EV_WRITE);
 	}
 
-	bufferevent_setcb(client->local_proxy_bev, proxy_c2s_recv, NULL,
+	// UDP sessions read their local sockets as peers show up
+	if (client->udp) {
+		return;
+	}
+
+	bufferevent_setcb(client->local_proxy_bev, proxy_c2s_recv,
+					 c_conf->tcp_mux ? tmux_stream_local_write_cb : NULL,
 					 xfrp_proxy_event_cb, client);
 	bufferevent_enable(client->local_proxy_bev, EV_READ|EV_WRITE);
+
+	// A pooled connection is connected already and may hold a greeting
+	if (evbuffer_get_length(bufferevent_get_input(client->local_proxy_bev)) > 0) {
+		bufferevent_trigger(client->local_proxy_bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+	}
 }
 
 /**
@@ -276,16 +448,45 @@ int send_client_data_tail(struct proxy_client *client)
 		return 0;
 	}
 
-	// Verify bufferevent is available
-	if (!client->local_proxy_bev) {
+	// Verify the local side is available
+	if (!client->local_proxy_bev && !client->udp) {
 		debug(LOG_ERR, "Invalid local proxy bufferevent");
 		return -1;
 	}
 
-	// Write data to buffer
-	int bytes_written = bufferevent_write(client->local_proxy_bev, 
+	// Write data to buffer, inflating it first on a compressed stream
+	int bytes_written;
+	if (client->udp) {
+		// Datagrams arrive as messages, not as a byte stream
+		struct evbuffer *tail = evbuffer_new();
+		bytes_written = -1;
+		if (tail && evbuffer_add(tail, client->data_tail, client->data_tail_size) == 0) {
+			bytes_written = handle_udp_work_data(client, tail);
+		}
+		if (tail) {
+			evbuffer_free(tail);
+		}
+	} else if (client->zip_in) {
+		struct evbuffer *tail = evbuffer_new();
+		bytes_written = -1;
+		if (tail && evbuffer_add(tail, client->data_tail, client->data_tail_size) == 0) {
+			bytes_written = zip_decompress(client->zip_in, tail,
+										   bufferevent_get_output(client->local_proxy_bev));
+		}
+		if (tail) {
+			evbuffer_free(tail);
+		}
+		if (bytes_written < 0) {
+			// Runs the disconnect path once the caller is done with client
+			debug(LOG_ERR, "Corrupt compressed data from frps on stream %d", client->stream_id);
+			bufferevent_trigger_event(client->local_proxy_bev, BEV_EVENT_ERROR,
+									  BEV_TRIG_DEFER_CALLBACKS);
+		}
+	} else {
+		bytes_written = bufferevent_write(client->local_proxy_bev, 
 										client->data_tail, 
 										client->data_tail_size);
+	}
 
 	// Free the data tail buffer
 	free(client->data_tail);
@@ -316,6 +517,19 @@ free_proxy_client(struct proxy_client *client)
 		client->local_proxy_bev = NULL;
 	}
 
+	// Mux streams share the session connection, direct ones own theirs
+	if (client->ctl_bev && !get_common_config()->tcp_mux) {
+		bufferevent_free(client->ctl_bev);
+		client->ctl_bev = NULL;
+	}
+
+	release_tmux_stream(&client->stream);
+	worker_release(client->worker);
+	zip_stream_free(client->zip_in);
+	zip_stream_free(client->zip_out);
+	free_udp_tunnel(client->udp);
+	SAFE_FREE(client->run_id);
+
 	// Free any data tail if it exists
 	if (client->data_tail) {
 		free(client->data_tail);
@@ -326,39 +540,11 @@ free_proxy_client(struct proxy_client *client)
 	free(client);
 }
 
-/**
- * @brief Removes a proxy client from the global hash table and frees its resources
- * 
- * @param client Pointer to proxy client to be deleted
- * @return 0 on success, -1 on failure
- */
-static int
-del_proxy_client(struct proxy_client *client)
-{
-	if (!client) {
-		debug(LOG_INFO, "Cannot delete NULL proxy client");
-		return -1;
-	}
-	
-	if (!all_pc) {
-		debug(LOG_INFO, "Global proxy client table is NULL");
-		return -1;
-	}
-
-	debug(LOG_DEBUG, "Deleting proxy client with stream ID: %d", client->stream_id);
-	
-	HASH_DEL(all_pc, client);
-	free_proxy_client(client);
-	
-	return 0;
-}
-
 /**
  * @brief Deletes a proxy client and its associated stream based on the stream ID
  *
- * This function performs cleanup by removing both the stream and its associated
- * proxy client from the system. It first validates the stream ID, then removes
- * the stream, and finally removes the proxy client if one exists.
+ * The client is looked up in the stream table of the calling thread, taken
+ * out of it together with its stream and then freed.
  *
  * @param sid The stream ID to identify which proxy client and stream to remove
  *
@@ -371,18 +557,46 @@ void del_proxy_client_by_stream_id(uint32_t sid) {
 		return;
 	}
 
-	// Delete the stream first
+	// The owner is gone from the table once the stream is deleted
+	struct proxy_client *pc = get_proxy_client(sid);
 	del_stream(sid);
 
-	// Find and delete the proxy client
-	struct proxy_client *pc = get_proxy_client(sid);
 	if (pc) {
-		del_proxy_client(pc);
+		debug(LOG_DEBUG, "Deleting proxy client with stream ID: %d", sid);
+		free_proxy_client(pc);
 	} else {
 		debug(LOG_DEBUG, "No proxy client found to delete for stream ID: %d", sid);
 	}
 }
 
+/**
+ * @brief Stream table visitor deleting the clients of one mux session
+ *
+ * @param owner The proxy client of a stream
+ * @param arg   The mux session that went away
+ */
+static void del_session_client(void *owner, void *arg)
+{
+	struct proxy_client *pc = owner;
+
+	if (pc->stream.session == arg) {
+		del_proxy_client_by_stream_id(pc->stream_id);
+	}
+}
+
+/**
+ * @brief Deletes all proxy clients whose streams run on a mux session
+ *
+ * Used when the session connection is lost; its streams cannot continue on
+ * another session.
+ *
+ * @param session The mux session that went away
+ */
+void del_proxy_clients_by_session(struct tmux_session *session)
+{
+	foreach_stream_owner(del_session_client, session);
+}
+
 /**
  * @brief Retrieves a proxy client by its stream ID
  * @param sid Stream ID to search for
@@ -390,14 +604,12 @@ void del_proxy_client_by_stream_id(uint32_t sid) {
  */
 struct proxy_client *get_proxy_client(uint32_t sid)
 {
-	struct proxy_client *pc = NULL;
-	
 	if (sid == 0) {
 		debug(LOG_DEBUG, "Invalid stream ID: 0");
 		return NULL;
 	}
 	
-	HASH_FIND_INT(all_pc, &sid, pc);
+	struct proxy_client *pc = get_stream_owner(sid);
 	
 	if (!pc) {
 		debug(LOG_DEBUG, "No proxy client found for stream ID: %d", sid);
@@ -428,14 +640,28 @@ struct proxy_client *new_proxy_client()
 	// Initialize stream
 	init_tmux_stream(&client->stream, client->stream_id, INIT);
 
-	// Add to hash table
-	HASH_ADD_INT(all_pc, stream_id, client);
+	// Make the client reachable through its stream ID
+	set_stream_owner(&client->stream, client);
 	debug(LOG_DEBUG, "Created new proxy client with stream ID: %d", client->stream_id);
 	
 	return client;
 }
 
 
+/**
+ * @brief Stream table visitor freeing a proxy client
+ *
+ * @param owner The proxy client of a stream
+ * @param arg   Unused
+ */
+static void free_owned_client(void *owner, void *arg)
+{
+	struct proxy_client *pc = owner;
+
+	del_stream(pc->stream_id);
+	free_proxy_client(pc);
+}
+
 /**
  * @brief Clears and releases all proxy client resources
  * 
@@ -444,28 +670,11 @@ struct proxy_client *new_proxy_client()
  */
 void clear_all_proxy_client()
 {
-	// Clear stream state first
-	clear_stream();
+	// Free every client, each one leaves the stream table with its stream
+	foreach_stream_owner(free_owned_client, NULL);
 
-	// Early return if no proxy clients exist
-	if (!all_pc) {
-		debug(LOG_DEBUG, "No proxy clients to clear");
-		return;
-	}
-
-	struct proxy_client *current = NULL;
-	struct proxy_client *temp = NULL;
-
-	// Iterate through all proxy clients and free them
-	HASH_ITER(hh, all_pc, current, temp) {
-		if (current) {
-			HASH_DEL(all_pc, current);
-			free_proxy_client(current);
-		}
-	}
-
-	// Ensure the hash table pointer is nulled
-	all_pc = NULL;
+	// Drop streams that never got a client
+	clear_stream();
 
 	debug(LOG_DEBUG, "All proxy clients cleared successfully");
 }
@@ -8,14 +8,18 @@
 #define XFRPC_CLIENT_H
 
 #include <stdint.h>
+#include <netinet/in.h>
 #include "uthash.h"
 #include "common.h"
 #include "tcpmux.h"
+#include "zip.h"
 
 /* Constants */
 #define SOCKS5_ADDRES_LEN 20
 
 /* Data Structures */
+struct udp_tunnel;
+
 struct socks5_addr {
 	uint8_t     addr[SOCKS5_ADDRES_LEN];
 	uint16_t    port;
@@ -35,6 +39,8 @@ struct proxy_client {
 	struct event_base    *base;
 	struct bufferevent   *ctl_bev;      /* xfrpc proxy <---> frps */
 	struct bufferevent   *local_proxy_bev; /* xfrpc proxy <---> local service */
+	struct xfrp_worker   *worker;       /* loop owning a direct work connection */
+	char                 *run_id;       /* copy taken on the main thread for NewWorkConn */
 	
 	/* Configuration */
 	struct base_conf     *bconf;
@@ -45,6 +51,9 @@ struct proxy_client {
 	uint32_t            stream_id;
 	unsigned char       *data_tail;      /* storage untreated data */
 	size_t              data_tail_size;
+	struct zip_stream   *zip_in;        /* use_compression: frps -> local */
+	struct zip_stream   *zip_out;       /* use_compression: local -> frps */
+	struct udp_tunnel   *udp;           /* datagram state of a udp proxy */
 	
 	/* State flags */
 	int                 connected;
@@ -53,9 +62,6 @@ struct proxy_client {
 	/* SOCKS5 specific */
 	struct socks5_addr  remote_addr;
 	enum socks5_state   state;
-
-	/* Hash handling */
-	UT_hash_handle      hh;
 };
 
 struct proxy_service {
@@ -64,12 +70,21 @@ struct proxy_service {
 	char    *proxy_type;
 	int     use_encryption;
 	int     use_compression;
+	int     compression_min_gain;      /* percent saved to keep compressing, 0 always */
+	struct zip_stats zip_stats;        /* compression counters of all streams */
+	uint64_t zip_logged;               /* bytes sent as of the last stats log */
 
 	/* Network configuration */
 	char    *local_ip;
 	int     remote_port;
 	int     remote_data_port;
 	int     local_port;
+	uint32_t tcp_mux_window;   /* stream receive window, 0 uses [common] */
+	uint32_t mux_weight;       /* share of a busy mux session, 0 means 1 */
+	struct sockaddr_in udp_addr;   /* resolved local_ip of a udp proxy */
+	int     udp_addr_ok;
+	int     local_pool_size;   /* local connections kept ready per loop, 0 disables */
+	int     local_pool_idle;   /* seconds a pooled connection may stay unused */
 
 	/* HTTP/HTTPS specific */
 	char    *custom_domains;
@@ -99,6 +114,7 @@ struct proxy_service {
 /* Function prototypes */
 void start_xfrp_tunnel(struct proxy_client *client);
 void del_proxy_client_by_stream_id(uint32_t sid);
+void del_proxy_clients_by_session(struct tmux_session *session);
 struct proxy_client *get_proxy_client(uint32_t sid);
 int send_client_data_tail(struct proxy_client *client);
 int is_ftp_proxy(const struct proxy_service *ps);
@@ -107,5 +123,6 @@ int is_udp_proxy(const struct proxy_service *ps);
 struct proxy_client *new_proxy_client(void);
 void clear_all_proxy_client(void);
 void xfrp_proxy_event_cb(struct bufferevent *bev, short what, void *ctx);
+void log_compression_stats(void);
 
 #endif // XFRPC_CLIENT_H
@@ -21,8 +21,10 @@
 #include "client.h"
 #include "debug.h"
 #include "msg.h"
+#include "crypto.h"
 #include "utils.h"
 #include "version.h"
+#include "local_pool.h"
 
 /**
  * @brief Array of valid proxy service types supported by the application
@@ -102,6 +104,35 @@ static const char *get_valid_type(const char *val)
 	return NULL;
 }
 
+/**
+ * @brief Parses a byte size with an optional K, M or G suffix
+ *
+ * @param val String value to parse, e.g. "262144", "512K" or "16M"
+ * @return uint32_t Parsed size in bytes, 0 if the value is invalid or too large
+ */
+static uint32_t parse_size(const char *val)
+{
+	char *end = NULL;
+	unsigned long long size = strtoull(val, &end, 10);
+
+	if (end == val) {
+		return 0;
+	}
+
+	switch (*end) {
+	case 'k': case 'K': size <<= 10; end++; break;
+	case 'm': case 'M': size <<= 20; end++; break;
+	case 'g': case 'G': size <<= 30; end++; break;
+	default: break;
+	}
+
+	if (*end != '\0' || size > UINT32_MAX) {
+		return 0;
+	}
+
+	return (uint32_t)size;
+}
+
 /**
  * @brief Dumps the common configuration settings to debug log
  * 
@@ -111,6 +142,7 @@ static const char *get_valid_type(const char *val)
  * - Authentication token
  * - Heartbeat interval
  * - Heartbeat timeout
+ * - TCP mux session and window settings when TCP mux is enabled
  *
  * @note Does nothing if c_conf is NULL
  */
@@ -121,12 +153,26 @@ static void dump_common_conf(void)
 		return;
 	}
 
-	debug(LOG_DEBUG, "Section[common]: {server_addr:%s, server_port:%d, auth_token:%s, interval:%d, timeout:%d}",
+	debug(LOG_DEBUG, "Section[common]: {server_addr:%s, server_port:%d, auth_token:%s, interval:%d, timeout:%d, pool_count:%d}",
 		c_conf->server_addr, 
 		c_conf->server_port, 
 		c_conf->auth_token, 
 		c_conf->heartbeat_interval, 
-		c_conf->heartbeat_timeout);
+		c_conf->heartbeat_timeout,
+		c_conf->pool_count);
+
+	if (c_conf->tcp_mux) {
+		debug(LOG_DEBUG, "TCP mux: {sessions:%d, window:%u, max:%u, budget:%u, autotune:%d}",
+			c_conf->tcp_mux_sessions,
+			c_conf->tcp_mux_window,
+			c_conf->tcp_mux_window_max,
+			c_conf->tcp_mux_window_budget,
+			c_conf->tcp_mux_autotune);
+	}
+
+	if (c_conf->worker_threads > 0) {
+		debug(LOG_DEBUG, "Worker threads: %d", c_conf->worker_threads);
+	}
 }
 
 /**
@@ -252,7 +298,10 @@ static struct proxy_service *new_proxy_service(const char *name)
 	ps->remote_port = 0;
 	ps->remote_data_port = 0;
 	ps->use_compression = 0;
+	ps->compression_min_gain = ZIP_MIN_GAIN;
 	ps->use_encryption = 0;
+	ps->local_pool_size = 0;
+	ps->local_pool_idle = LOCAL_POOL_IDLE;
 
 	// HTTP/HTTPS specific fields
 	ps->custom_domains = NULL;
@@ -312,7 +361,8 @@ new_ftp_data_proxy_service(struct proxy_service *ftp_ps)
  * @return int Returns 1 if validation passes, 0 if validation fails
  *
  * Validates proxy configuration based on service type:
- * - Common checks: proxy name and type must exist
+ * - Common checks: proxy name and type must exist, tcp_mux_window,
+ *   mux_weight and the local pool settings in range
  * - Socks5: requires remote port
  * - TCP/UDP: requires local port and IP
  * - HTTP/HTTPS: requires local port, IP, and either custom domains or subdomain
@@ -338,6 +388,41 @@ int validate_proxy(struct proxy_service *ps)
 		return 0;
 	}
 
+	if (ps->tcp_mux_window &&
+		(ps->tcp_mux_window < MAX_STREAM_WINDOW_SIZE || ps->tcp_mux_window > (1U << 30))) {
+		debug(LOG_ERR, "Proxy [%s] error: tcp_mux_window must be between %u and %u",
+			  ps->proxy_name, MAX_STREAM_WINDOW_SIZE, 1U << 30);
+		return 0;
+	}
+
+	if (ps->mux_weight > TMUX_MAX_WEIGHT) {
+		debug(LOG_ERR, "Proxy [%s] error: mux_weight must be between 1 and %d",
+			  ps->proxy_name, TMUX_MAX_WEIGHT);
+		return 0;
+	}
+
+	if (ps->compression_min_gain < 0 || ps->compression_min_gain > 100) {
+		debug(LOG_ERR, "Proxy [%s] error: compression_min_gain must be between 0 and 100",
+			  ps->proxy_name);
+		return 0;
+	}
+
+	if (ps->local_pool_size < 0 || ps->local_pool_size > MAX_LOCAL_POOL_SIZE ||
+		ps->local_pool_idle < 1 || ps->local_pool_idle > 3600) {
+		debug(LOG_ERR, "Proxy [%s] error: local_pool_size must be between 0 and %d, "
+			  "local_pool_idle between 1 and 3600", ps->proxy_name, MAX_LOCAL_POOL_SIZE);
+		return 0;
+	}
+
+	// Pooled connections are plain TCP connections opened ahead of use
+	if (ps->local_pool_size > 0 &&
+		(strcmp(ps->proxy_type, "udp") == 0 || strcmp(ps->proxy_type, "socks5") == 0 ||
+		 strcmp(ps->proxy_type, "ftp") == 0)) {
+		debug(LOG_ERR, "Proxy [%s] error: local_pool_size is not supported for %s proxies",
+			  ps->proxy_name, ps->proxy_type);
+		return 0;
+	}
+
 	// Type-specific validation
 	if (strcmp(ps->proxy_type, "socks5") == 0) {
 		if (ps->remote_port == 0) {
@@ -551,6 +636,11 @@ static int proxy_service_handler(void *user, const char *sect, const char *nm, c
 	else if (MATCH_NAME("remote_data_port")) ps->remote_data_port = atoi(value);
 	else if (MATCH_NAME("use_encryption")) ps->use_encryption = is_true(value);
 	else if (MATCH_NAME("use_compression")) ps->use_compression = is_true(value);
+	else if (MATCH_NAME("compression_min_gain")) ps->compression_min_gain = atoi(value);
+	else if (MATCH_NAME("tcp_mux_window")) ps->tcp_mux_window = parse_size(value);
+	else if (MATCH_NAME("mux_weight")) ps->mux_weight = atoi(value);
+	else if (MATCH_NAME("local_pool_size")) ps->local_pool_size = atoi(value);
+	else if (MATCH_NAME("local_pool_idle")) ps->local_pool_idle = atoi(value);
 	else if (MATCH_NAME("http_user")) SET_STRING_VALUE(http_user);
 	else if (MATCH_NAME("http_pwd")) SET_STRING_VALUE(http_pwd);
 	else if (MATCH_NAME("subdomain")) SET_STRING_VALUE(subdomain);
@@ -598,6 +688,14 @@ static int proxy_service_handler(void *user, const char *sect, const char *nm, c
  * - heartbeat_timeout: Timeout for heartbeat responses
  * - token: Authentication token
  * - tcp_mux: TCP multiplexing flag
+ * - pool_count: Work connections frps keeps established ahead of use
+ * - tcp_mux_window: Receive window of each mux stream in bytes
+ * - tcp_mux_window_max: Upper bound for auto-tuned windows
+ * - tcp_mux_window_budget: Window bytes beyond the default shared by all streams
+ * - tcp_mux_autotune: Window auto-tuning flag
+ * - tcp_mux_sessions: Number of mux connections to the server
+ * - worker_threads: Number of event loop threads for work connections
+ * - transport_cipher: Cipher of the control connection
  *
  * @note Uses assert() to verify memory allocations
  */
@@ -629,6 +727,30 @@ static int common_handler(void *user, const char *section, const char *name, con
 	else if (MATCH("common", "tcp_mux")) {
 		config->tcp_mux = !!atoi(value); // Convert to boolean
 	}
+	else if (MATCH("common", "pool_count")) {
+		config->pool_count = atoi(value);
+	}
+	else if (MATCH("common", "tcp_mux_window")) {
+		config->tcp_mux_window = parse_size(value);
+	}
+	else if (MATCH("common", "tcp_mux_window_max")) {
+		config->tcp_mux_window_max = parse_size(value);
+	}
+	else if (MATCH("common", "tcp_mux_window_budget")) {
+		config->tcp_mux_window_budget = parse_size(value);
+	}
+	else if (MATCH("common", "tcp_mux_autotune")) {
+		config->tcp_mux_autotune = is_true(value);
+	}
+	else if (MATCH("common", "tcp_mux_sessions")) {
+		config->tcp_mux_sessions = atoi(value);
+	}
+	else if (MATCH("common", "worker_threads")) {
+		config->worker_threads = atoi(value);
+	}
+	else if (MATCH("common", "transport_cipher")) {
+		config->transport_cipher = parse_transport_cipher(value);
+	}
 	
 	return 1;
 }
@@ -644,6 +766,12 @@ static int common_handler(void *user, const char *section, const char *name, con
  * - heartbeat_interval: 30 seconds
  * - heartbeat_timeout: 90 seconds
  * - tcp_mux: enabled (1)
+ * - pool_count: 1
+ * - tcp_mux_window: 256 KiB, tcp_mux_window_max: 16 MiB
+ * - tcp_mux_window_budget: 32 MiB, tcp_mux_autotune: disabled (0)
+ * - tcp_mux_sessions: 1
+ * - worker_threads: 0, work connections run on the main loop
+ * - transport_cipher: aes-128-cfb
  * - is_router: disabled (0)
  *
  * @note Exits program if memory allocation fails (via assert)
@@ -662,6 +790,14 @@ static void init_common_conf(struct common_conf *config) {
 	config->heartbeat_interval = 30;
 	config->heartbeat_timeout = 90;
 	config->tcp_mux = 1;
+	config->pool_count = 1;
+	config->tcp_mux_window = MAX_STREAM_WINDOW_SIZE;
+	config->tcp_mux_window_max = 16 * 1024 * 1024;
+	config->tcp_mux_window_budget = 32 * 1024 * 1024;
+	config->tcp_mux_autotune = 0;
+	config->tcp_mux_sessions = 1;
+	config->worker_threads = 0;
+	config->transport_cipher = CIPHER_AES_128_CFB;
 	config->is_router = 0;
 }
 
@@ -708,6 +844,92 @@ static void validate_heartbeat_config(void) {
 	}
 }
 
+/**
+ * @brief Validates TCP mux session and window configuration parameters
+ *
+ * Between 1 and MAX_TCP_MUX_SESSIONS mux connections are allowed. A yamux
+ * stream always starts with a 256 KiB window, so smaller windows cannot be
+ * advertised. Windows are capped at 1 GiB to keep the window arithmetic
+ * within 32 bits. Exits the program if validation fails.
+ */
+static void validate_tcp_mux_config(void) {
+	const uint32_t max_allowed = 1U << 30;
+
+	if (c_conf->tcp_mux_sessions < 1 || c_conf->tcp_mux_sessions > MAX_TCP_MUX_SESSIONS) {
+		debug(LOG_ERR, "Error: tcp_mux_sessions must be between 1 and %d",
+			  MAX_TCP_MUX_SESSIONS);
+		exit(0);
+	}
+
+	if (c_conf->tcp_mux_window < MAX_STREAM_WINDOW_SIZE ||
+		c_conf->tcp_mux_window > max_allowed) {
+		debug(LOG_ERR, "Error: tcp_mux_window must be between %u and %u",
+			  MAX_STREAM_WINDOW_SIZE, max_allowed);
+		exit(0);
+	}
+
+	if (c_conf->tcp_mux_window_max < c_conf->tcp_mux_window ||
+		c_conf->tcp_mux_window_max > max_allowed) {
+		debug(LOG_ERR, "Error: tcp_mux_window_max must be between tcp_mux_window and %u",
+			  max_allowed);
+		exit(0);
+	}
+}
+
+/**
+ * @brief Validates the worker thread configuration
+ *
+ * Worker loops only carry direct work connections; mux streams share their
+ * session connection and stay on the main loop, so the setting is ignored
+ * with tcp_mux. Exits the program if validation fails.
+ */
+static void validate_worker_config(void) {
+	if (c_conf->worker_threads < 0 || c_conf->worker_threads > MAX_WORKER_THREADS) {
+		debug(LOG_ERR, "Error: worker_threads must be between 0 and %d",
+			  MAX_WORKER_THREADS);
+		exit(0);
+	}
+
+	if (c_conf->worker_threads > 0 && c_conf->tcp_mux) {
+		debug(LOG_INFO, "worker_threads has no effect with tcp_mux enabled");
+		c_conf->worker_threads = 0;
+	}
+}
+
+/**
+ * @brief Validates the work connection pool size
+ *
+ * frps asks for pool_count work connections right after login and for a
+ * replacement whenever it hands one to a user connection, so that many
+ * are always established ahead of use. frps caps the pool with its own
+ * max_pool_count. Exits the program if validation fails.
+ */
+static void validate_pool_config(void) {
+	if (c_conf->pool_count < 0 || c_conf->pool_count > MAX_POOL_COUNT) {
+		debug(LOG_ERR, "Error: pool_count must be between 0 and %d", MAX_POOL_COUNT);
+		exit(0);
+	}
+}
+
+/**
+ * @brief Validates the transport cipher and resolves "auto"
+ *
+ * Exits the program if the cipher name is unknown.
+ */
+static void validate_transport_cipher(void) {
+	if (c_conf->transport_cipher < 0) {
+		debug(LOG_ERR, "Error: transport_cipher must be one of "
+			  "aes-128-cfb, aes-128-gcm, chacha20-poly1305, auto");
+		exit(0);
+	}
+
+	int cipher = resolve_transport_cipher(c_conf->transport_cipher);
+	if (c_conf->transport_cipher == CIPHER_AUTO) {
+		debug(LOG_INFO, "transport_cipher auto: offering %s", transport_cipher_name(cipher));
+	}
+	c_conf->transport_cipher = cipher;
+}
+
 /**
  * @brief Loads and parses the configuration file for the xfrpc client
  *
@@ -716,7 +938,7 @@ static void validate_heartbeat_config(void) {
  * This function:
  * 1. Initializes the common configuration structure
  * 2. Parses the common section of the config file
- * 3. Validates heartbeat settings
+ * 3. Validates heartbeat, TCP mux, worker thread and cipher settings
  * 4. Parses the proxy service sections
  * 5. Dumps the configuration for debugging
  *
@@ -740,6 +962,10 @@ void load_config(const char *confile) {
 
 	// Validate heartbeat settings
 	validate_heartbeat_config();
+	validate_tcp_mux_config();
+	validate_worker_config();
+	validate_pool_config();
+	validate_transport_cipher();
 
 	// Parse proxy services
 	ini_parse(confile, proxy_service_handler, NULL);
@@ -26,6 +26,15 @@
 #define XFRPC_PLUGIN_YOUTUBEDL_PORT          20002
 #define XFRPC_PLUGIN_YOUTUBEDL_REMOTE_PORT   20003
 
+// Upper bound of tcp_mux_sessions
+#define MAX_TCP_MUX_SESSIONS 16
+
+// Upper bound of worker_threads
+#define MAX_WORKER_THREADS 32
+
+// Upper bound of pool_count
+#define MAX_POOL_COUNT 32
+
 // FTP related definitions
 #define FTP_RMT_CTL_PROXY_SUFFIX  "_ftp_remote_ctl_proxy"
 
@@ -42,6 +51,20 @@ struct common_conf {
 	int     heartbeat_interval;    /* default 10 */
 	int     heartbeat_timeout;     /* default 30 */
 	int     tcp_mux;              /* default 0 */
+	int     pool_count;           /* work connections frps keeps ready, default 1 */
+
+	/* TCP mux receive window settings */
+	uint32_t tcp_mux_window;        /* per stream window, default 256K */
+	uint32_t tcp_mux_window_max;    /* auto-tuning ceiling, default 16M */
+	uint32_t tcp_mux_window_budget; /* window beyond 256K for all streams, default 32M */
+	int     tcp_mux_autotune;      /* grow windows from RTT and drain rate, default 0 */
+	int     tcp_mux_sessions;      /* mux connections to the server, default 1 */
+
+	/* Encryption settings */
+	int     transport_cipher;      /* enum frp_cipher offered at login, default aes-128-cfb */
+
+	/* Threading settings */
+	int     worker_threads;        /* event loops for work connections, default 0 */
 
 	/* Environment settings */
 	int     is_router;            /* indicates if running on router (OpenWrt/LEDE) */
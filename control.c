@@ -6,6 +6,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
@@ -18,6 +19,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdbool.h>
+#include <openssl/rand.h>
 
 #include "debug.h"
 #include "client.h"
@@ -31,18 +33,47 @@
 #include "login.h"
 #include "tcpmux.h"
 #include "proxy.h"
+#include "worker.h"
+#include "resolver.h"
+
+/* Where the control connection is in its lifecycle */
+enum ctl_state {
+	CTL_CONNECTING,		/* connecting to frps */
+	CTL_LOGIN,			/* connected, login sent */
+	CTL_ONLINE,			/* logged in */
+	CTL_BACKOFF,		/* waiting to reconnect */
+};
+
+/* NewProxy message of a proxy, marshalled once and sent on every login */
+struct proxy_registration {
+	char *msg;
+	int len;
+};
 
 static struct control *main_ctl;
 static bool xfrpc_status;
 static int is_login;
 static time_t pong_time;
-
-static void new_work_connection(struct bufferevent *bev, struct tmux_stream *stream);
+static struct evbuffer *ctl_msgs;	/* decrypted control data not dispatched yet */
+static enum ctl_state ctl_state;
+static int reconnect_attempts;		/* reconnects that failed since last online */
+static struct proxy_registration *registrations;
+static int registration_count;
+
+static void new_work_connection(struct bufferevent *bev, struct tmux_stream *stream,
+				const char *run_id);
 static void recv_cb(struct bufferevent *bev, void *ctx);
 static void clear_main_control(void);
 static void start_base_connect(void);
+static void schedule_reconnect(int err);
 static void keep_control_alive(void);
 static void client_start_event_cb(struct bufferevent *bev, short what, void *ctx);
+static void handle_control_work(const uint8_t *buf, int len, void *ctx);
+static void start_mux_sessions(void);
+static void stop_mux_sessions(void);
+static void keep_mux_sessions_alive(void);
+static struct tmux_session *pick_mux_session(void);
+static int marshal_proxy_service(struct proxy_service *ps, char **msg_out);
 
 /**
  * Check if xfrpc client is connected to server
@@ -118,6 +149,7 @@ static void handle_client_error(struct proxy_client *client, struct bufferevent
 
 	// Cleanup
 	bufferevent_free(bev);
+	client->ctl_bev = NULL;
 	del_proxy_client_by_stream_id(client->stream_id);
 }
 
@@ -128,7 +160,6 @@ static void handle_client_error(struct proxy_client *client, struct bufferevent
  * the work connection for a newly connected proxy client. It:
  * - Sets up read/write event callbacks for the bufferevent
  * - Initializes a new work connection with the given bufferevent
- * - Enables the proxy service status
  *
  * @param client Pointer to the proxy client structure
  * @param bev Pointer to the bufferevent structure for this connection
@@ -140,8 +171,7 @@ static void handle_client_connected(struct proxy_client *client, struct bufferev
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 
 	// Initialize work connection
-	new_work_connection(bev, &main_ctl->stream);
-	set_xfrpc_status(true);
+	new_work_connection(bev, &main_ctl->stream, client->run_id);
 
 	debug(LOG_INFO, "Proxy service started successfully");
 }
@@ -211,7 +241,7 @@ static int init_tcp_mux_client(struct proxy_client *client) {
 
 	debug(LOG_DEBUG, "New client through TCP mux: stream_id=%d", client->stream_id);
 	send_window_update(client->ctl_bev, &client->stream, 0);
-	new_work_connection(client->ctl_bev, &client->stream);
+	new_work_connection(client->ctl_bev, &client->stream, client->run_id);
 	return 0;
 }
 
@@ -251,14 +281,59 @@ static int init_direct_client(struct proxy_client *client,
 	return 0;
 }
 
+/**
+ * @brief Work connection handed from the main loop to a worker
+ */
+struct worker_connect {
+	struct xfrp_worker  *worker;    /* worker picked for the connection */
+	char                *run_id;    /* run_id as of the hand-off */
+};
+
+/**
+ * @brief Opens a direct work connection on a worker loop
+ *
+ * Runs on the worker thread, so the proxy client lands in the client table
+ * of that thread and all of its events stay on the worker. The run_id was
+ * copied on the main thread, a re-login may replace the login's one at any
+ * time.
+ *
+ * @param fd   Unused
+ * @param what Unused
+ * @param arg  The worker_connect prepared by new_client_connect()
+ */
+static void worker_client_connect(evutil_socket_t fd, short what, void *arg)
+{
+	struct worker_connect *wc = arg;
+	struct xfrp_worker *worker = wc->worker;
+	char *run_id = wc->run_id;
+	struct common_conf *c_conf = get_common_config();
+
+	free(wc);
+
+	struct proxy_client *client = new_proxy_client();
+	if (!client) {
+		debug(LOG_ERR, "Failed to create new proxy client");
+		worker_release(worker);
+		free(run_id);
+		return;
+	}
+
+	client->base = worker->base;
+	client->worker = worker;
+	client->run_id = run_id;
+	if (init_direct_client(client, c_conf->server_addr, c_conf->server_port) != 0) {
+		del_proxy_client_by_stream_id(client->stream_id);
+	}
+}
+
 /**
  * @brief Creates and initializes a new proxy client connection
  * 
  * This function handles the creation of a new proxy client and establishes
  * its connection. It performs the following steps:
- * 1. Creates a new proxy client instance
- * 2. Retrieves and validates common configuration
- * 3. Initializes the client's event base
+ * 1. Retrieves and validates common configuration
+ * 2. Hands direct connections to a worker thread when worker_threads is set
+ * 3. Otherwise creates a new proxy client on the main event base
  * 4. Sets up the connection based on TCP multiplexing configuration:
  *    - If TCP mux is enabled, initializes multiplexed client
  *    - If TCP mux is disabled, initializes direct client connection
@@ -270,6 +345,41 @@ static int init_direct_client(struct proxy_client *client,
  */
 static void new_client_connect()
 {
+	// Get and validate common config
+	struct common_conf *c_conf = get_common_config();
+	if (!c_conf) {
+		debug(LOG_ERR, "Failed to get common config");
+		return;
+	}
+
+	// Snapshot the run_id, the work connection may outlive this login
+	const char *run_id = get_run_id();
+	if (!run_id) {
+		debug(LOG_ERR, "Run ID not found - must be initialized during login");
+		return;
+	}
+
+	// Direct work connections can run on any loop, mux streams share the session
+	if (!c_conf->tcp_mux) {
+		struct xfrp_worker *worker = pick_worker();
+		if (worker) {
+			struct worker_connect *wc = calloc(1, sizeof(*wc));
+			if (wc) {
+				wc->worker = worker;
+				wc->run_id = strdup(run_id);
+			}
+			if (wc && wc->run_id &&
+				worker_dispatch(worker, worker_client_connect, wc) == 0) {
+				return;
+			}
+			if (wc) {
+				SAFE_FREE(wc->run_id);
+				free(wc);
+			}
+			worker_release(worker);
+		}
+	}
+
 	// Create new proxy client
 	struct proxy_client *client = new_proxy_client();
 	if (!client) {
@@ -277,11 +387,10 @@ static void new_client_connect()
 		return;
 	}
 
-	// Get and validate common config
-	struct common_conf *c_conf = get_common_config();
-	if (!c_conf) {
-		debug(LOG_ERR, "Failed to get common config");
-		free(client);
+	client->run_id = strdup(run_id);
+	if (!client->run_id) {
+		debug(LOG_ERR, "Failed to copy run ID");
+		del_proxy_client_by_stream_id(client->stream_id);
 		return;
 	}
 
@@ -289,69 +398,103 @@ static void new_client_connect()
 	client->base = main_ctl->connect_base;
 	if (!client->base) {
 		debug(LOG_ERR, "Invalid event base");
-		free(client);
+		del_proxy_client_by_stream_id(client->stream_id);
 		return;
 	}
 
 	// Handle connection based on mux configuration
 	if (c_conf->tcp_mux) {
-		client->ctl_bev = main_ctl->connect_bev;
+		struct tmux_session *session = pick_mux_session();
+		tmux_stream_attach(&client->stream, session);
+		client->ctl_bev = session->bev;
 		if (init_tcp_mux_client(client) != 0) {
-			free(client);
+			del_proxy_client_by_stream_id(client->stream_id);
 			return;
 		}
 	} else {
 		if (init_direct_client(client, c_conf->server_addr, c_conf->server_port) != 0) {
-			free(client);
+			del_proxy_client_by_stream_id(client->stream_id);
 			return;
 		}
 	}
 }
 
 /**
- * @brief Initializes and starts all configured proxy services
- *
- * This function retrieves all configured proxy services and initiates them by:
- * 1. Getting the list of all configured proxy services
- * 2. Iterating through each service
- * 3. Validating each service
- * 4. Skipping MSTSC type proxies
- * 5. Sending new proxy requests for valid services
+ * @brief Drops the cached NewProxy messages, they are rebuilt on next login
+ */
+static void drop_proxy_registrations(void)
+{
+	for (int i = 0; i < registration_count; i++) {
+		SAFE_FREE(registrations[i].msg);
+	}
+	SAFE_FREE(registrations);
+	registration_count = 0;
+}
+
+/**
+ * @brief Marshals the NewProxy messages of all configured proxy services
  *
- * If no proxy services are configured, the function logs a message and returns.
- * Invalid proxy services encountered during iteration are logged and skipped.
+ * MSTSC proxies are skipped, and so are proxies that fail to marshal.
  *
- * @note MSTSC proxy types are explicitly skipped during processing
+ * @return 0 on success, -1 on allocation failure
  */
-static void start_proxy_services() 
+static int build_proxy_registrations(void)
 {
-	// Get configured proxy services
 	struct proxy_service *all_ps = get_all_proxy_services();
-	if (!all_ps) {
-		debug(LOG_INFO, "No proxy services configured");
-		return;
-	}
 
-	debug(LOG_INFO, "Starting xfrp proxy services...");
+	registrations = calloc(HASH_COUNT(all_ps) + 1, sizeof(struct proxy_registration));
+	if (!registrations) {
+		debug(LOG_ERR, "Failed to allocate proxy registrations");
+		return -1;
+	}
 
-	// Iterate through all proxy services
 	struct proxy_service *ps = NULL, *tmp = NULL;
 	HASH_ITER(hh, all_ps, ps, tmp) {
-		// Validate proxy service
-		if (!ps) {
-			debug(LOG_ERR, "Invalid proxy service encountered");
-			continue;
-		}
-
 		// Skip MSTSC proxy type
 		if (ps->proxy_type && strcmp(ps->proxy_type, "mstsc") == 0) {
 			debug(LOG_DEBUG, "Skipping MSTSC service");
 			continue;
 		}
 
-		// Send new proxy request
-		debug(LOG_DEBUG, "Sending proxy service: %s", ps->proxy_name);
-		send_new_proxy(ps);
+		struct proxy_registration *reg = &registrations[registration_count];
+		reg->len = marshal_proxy_service(ps, &reg->msg);
+		if (reg->len < 0) {
+			SAFE_FREE(reg->msg);
+			continue;
+		}
+		debug(LOG_DEBUG, "Marshalled proxy service: %s", ps->proxy_name);
+		registration_count++;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Registers all configured proxy services with frps
+ *
+ * Called as soon as the login response arrives: the NewProxy messages,
+ * marshalled on the first login and cached since, are queued together
+ * with the IV of the control stream and leave in one write.
+ *
+ * If no proxy services are configured, the function logs a message and returns.
+ *
+ * @note MSTSC proxy types are explicitly skipped during processing
+ */
+static void start_proxy_services() 
+{
+	if (!get_all_proxy_services()) {
+		debug(LOG_INFO, "No proxy services configured");
+		return;
+	}
+
+	if (!registrations && build_proxy_registrations() != 0) {
+		return;
+	}
+
+	debug(LOG_INFO, "Starting xfrp proxy services...");
+	for (int i = 0; i < registration_count; i++) {
+		send_enc_msg_frp_server(NULL, TypeNewProxy, registrations[i].msg,
+								registrations[i].len, &main_ctl->stream);
 	}
 }
 
@@ -397,6 +540,7 @@ static void ping(void)
  *
  * @param bev The bufferevent structure for network communication
  * @param stream The tmux stream structure containing stream information
+ * @param run_id Copy of the login's run ID owned by the work connection
  *
  * @note This function performs cleanup of allocated resources before returning
  * @note The run ID must be initialized during login before calling this function
@@ -407,7 +551,8 @@ static void ping(void)
  * - Missing run ID
  * - Failed message marshalling
  */
-static void new_work_connection(struct bufferevent *bev, struct tmux_stream *stream)
+static void new_work_connection(struct bufferevent *bev, struct tmux_stream *stream,
+				const char *run_id)
 {
 	// Validate input parameters
 	if (!bev) {
@@ -415,37 +560,24 @@ static void new_work_connection(struct bufferevent *bev, struct tmux_stream *str
 		return;
 	}
 
-	// Create new work connection
-	struct work_conn *work_c = new_work_conn();
-	if (!work_c) {
-		debug(LOG_ERR, "Failed to create new work connection");
-		return;
-	}
-
-	// Get and validate run ID
-	work_c->run_id = get_run_id();
-	if (!work_c->run_id) {
+	// Validate run ID
+	struct work_conn work_c = { .run_id = (char *)run_id };
+	if (!work_c.run_id) {
 		debug(LOG_ERR, "Run ID not found - must be initialized during login");
-		SAFE_FREE(work_c);
 		return;
 	}
 
 	// Marshal work connection request
-	char *work_conn_msg = NULL;
-	int msg_len = new_work_conn_marshal(work_c, &work_conn_msg);
-	if (msg_len <= 0 || !work_conn_msg) {
+	char work_conn_msg[WORK_CONN_MSG_SIZE];
+	int msg_len = new_work_conn_marshal(&work_c, work_conn_msg, sizeof(work_conn_msg));
+	if (msg_len <= 0) {
 		debug(LOG_ERR, "Failed to marshal work connection request");
-		SAFE_FREE(work_c);
 		return;
 	}
 
 	// Send work connection request
 	debug(LOG_DEBUG, "Sending new work connection request: length=%d", msg_len);
 	send_msg_frp_server(bev, TypeNewWorkConn, work_conn_msg, msg_len, stream);
-
-	// Cleanup
-	SAFE_FREE(work_conn_msg);
-	SAFE_FREE(work_c);
 }
 
 /**
@@ -465,10 +597,10 @@ static void new_work_connection(struct bufferevent *bev, struct tmux_stream *str
  * The function will:
  * - Validate input parameters
  * - Create a new bufferevent socket
- * - For IP addresses: Connect directly using the IP
- * - For hostnames: Use DNS resolution if available
+ * - Start connecting through the resolver cache (see dns_connect())
  *
- * @note Requires main_ctl->dnsbase to be initialized for hostname resolution
+ * @note A hostname that still has to be resolved connects once its lookup
+ *       completes; a failed lookup is reported as BEV_EVENT_ERROR
  * @note The returned bufferevent must be freed by the caller when no longer needed
  */
 struct bufferevent *connect_server(struct event_base *base, const char *name, const int port) 
@@ -487,31 +619,8 @@ struct bufferevent *connect_server(struct event_base *base, const char *name, co
 		return NULL;
 	}
 
-	// For IP addresses, connect directly without DNS
-	if (is_valid_ip_address(name)) {
-		struct sockaddr_in sin;
-		memset(&sin, 0, sizeof(sin));
-		sin.sin_family = AF_INET;
-		sin.sin_addr.s_addr = inet_addr(name);
-		sin.sin_port = htons(port);
-
-		if (bufferevent_socket_connect(bev, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
-			debug(LOG_ERR, "Direct IP connection failed to %s:%d", name, port);
-			bufferevent_free(bev);
-			return NULL;
-		}
-	}
-	// Otherwise use DNS resolution
-	else if (main_ctl && main_ctl->dnsbase) {
-		if (bufferevent_socket_connect_hostname(bev, main_ctl->dnsbase, 
-											  AF_INET, name, port) < 0) {
-			debug(LOG_ERR, "DNS hostname connection failed to %s:%d", name, port);
-			bufferevent_free(bev);
-			return NULL;
-		}
-	}
-	else {
-		debug(LOG_ERR, "No DNS base available for hostname resolution");
+	if (dns_connect(bev, name, port) < 0) {
+		debug(LOG_ERR, "Connection failed to %s:%d", name, port);
 		bufferevent_free(bev);
 		return NULL;
 	}
@@ -519,55 +628,6 @@ struct bufferevent *connect_server(struct event_base *base, const char *name, co
 	return bev;
 }
 
-/**
- * @brief Creates and initializes a UDP server connection using libevent
- *
- * This function sets up a UDP socket and creates a bufferevent for it with the following steps:
- * 1. Creates a UDP socket
- * 2. Makes the socket non-blocking
- * 3. Creates a bufferevent for the socket with close-on-free option
- *
- * @param base Pointer to the event_base to be used for the bufferevent
- * @return struct bufferevent* Pointer to the created bufferevent on success, NULL on failure
- *
- * @note The returned bufferevent must be freed by the caller when no longer needed
- * @note The socket will be automatically closed when the bufferevent is freed
- */
-struct bufferevent *connect_udp_server(struct event_base *base)
-{
-	// Validate input parameter
-	if (!base) {
-		debug(LOG_ERR, "Invalid event base parameter");
-		return NULL;
-	}
-
-	// Create UDP socket
-	evutil_socket_t fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (fd < 0) {
-		debug(LOG_ERR, "Failed to create UDP socket: %s", strerror(errno));
-		return NULL;
-	}
-
-	// Make socket non-blocking
-	if (evutil_make_socket_nonblocking(fd) < 0) {
-		debug(LOG_ERR, "Failed to make UDP socket non-blocking: %s", strerror(errno));
-		evutil_closesocket(fd);
-		return NULL;
-	}
-
-	// Create bufferevent for UDP socket
-	struct bufferevent *bev = bufferevent_socket_new(base, fd, 
-													BEV_OPT_CLOSE_ON_FREE);
-	if (!bev) {
-		debug(LOG_ERR, "Failed to create UDP bufferevent: %s", strerror(errno));
-		evutil_closesocket(fd);
-		return NULL;
-	}
-
-	debug(LOG_DEBUG, "UDP server connection initialized successfully");
-	return bev;
-}
-
 /**
  * @brief Schedules a heartbeat timer event
  *
@@ -605,7 +665,7 @@ static void schedule_heartbeat_timer(struct event *timeout) {
 
 /**
  * Checks if the server connection has timed out based on the last pong response time.
- * If a timeout is detected, it resets the session and restarts the control process.
+ * If a timeout is detected, it tears the session down and schedules a reconnect.
  *
  * The function compares the time elapsed since the last pong response against the
  * heartbeat timeout value from the common configuration. If the elapsed time exceeds
@@ -632,9 +692,7 @@ static void check_server_timeout(time_t current_time) {
 		debug(LOG_INFO, "Server timeout detected: elapsed=%d seconds, timeout=%d seconds", 
 			  elapsed, conf->heartbeat_timeout);
 
-		reset_session_id();
-		clear_main_control();
-		run_control();
+		schedule_reconnect(ETIMEDOUT);
 	}
 }
 
@@ -658,6 +716,9 @@ static void heartbeat_handler(evutil_socket_t fd, short event, void *arg) {
 	if (is_xfrpc_connected()) {
 		debug(LOG_INFO, "Sending heartbeat ping to server");
 		ping();
+		tcp_mux_probe_rtt(main_ctl->connect_bev);
+		keep_mux_sessions_alive();
+		log_compression_stats();
 	}
 
 	// Reschedule next heartbeat
@@ -702,7 +763,11 @@ static int handle_ftp_configuration(struct proxy_service *ps, struct new_proxy_r
 		return 0;
 	}
 
-	main_ps->remote_data_port = npr->remote_port;
+	// The main proxy announces the port on its next registration
+	if (main_ps->remote_data_port != npr->remote_port) {
+		main_ps->remote_data_port = npr->remote_port;
+		drop_proxy_registrations();
+	}
 	return 1;
 }
 
@@ -757,15 +822,18 @@ static int proxy_service_resp_raw(struct new_proxy_response *npr)
 }
 
 /**
- * @brief Handles encrypted message and decrypts it
+ * @brief Appends a chunk of the encrypted control stream to a buffer
  *
- * @param enc_msg Pointer to the encrypted message buffer
- * @param ilen Length of the input encrypted message
- * @param out Double pointer to store the decrypted output message
+ * The stream starts with the IV of the server, which sets up the decoder.
+ * The rest is copied once into out and decrypted there in place.
  *
- * @return int Returns status code indicating success or failure of decryption
+ * @param enc_msg Pointer to the encrypted data
+ * @param ilen Length of the encrypted data
+ * @param out Evbuffer the plaintext is appended to
+ *
+ * @return Number of bytes appended, 0 if the chunk held only the IV, -1 on error
  */
-static int handle_enc_msg(const uint8_t *enc_msg, int ilen, uint8_t **out)
+static int handle_enc_msg(const uint8_t *enc_msg, int ilen, struct evbuffer *out)
 {
 	// Validate input parameters
 	if (!enc_msg || !out || ilen <= 0) {
@@ -797,22 +865,24 @@ static int handle_enc_msg(const uint8_t *enc_msg, int ilen, uint8_t **out)
 		// Check if we only received initialization vector
 		if (remaining_len == 0) {
 			debug(LOG_DEBUG, "Received only initialization vector data");
-			*out = NULL;
 			return 0;
 		}
 	}
 
-	// Decrypt the message
-	uint8_t *dec_msg = NULL;
-	size_t dec_len = decrypt_data(buf, remaining_len, get_main_decoder(), &dec_msg);
-	
-	if (dec_len <= 0 || !dec_msg) {
+	// AEAD records are authenticated and opened as they complete
+	if (is_aead_coder(get_main_decoder())) {
+		return open_records(get_main_decoder(), buf, remaining_len, out);
+	}
+
+	// Decrypt the message where it lands
+	size_t start = evbuffer_get_length(out);
+	if (evbuffer_add(out, buf, remaining_len) < 0 ||
+		decrypt_buffer(out, start, remaining_len, get_main_decoder()) != (size_t)remaining_len) {
 		debug(LOG_ERR, "Decryption failed");
 		return -1;
 	}
 
-	*out = dec_msg;
-	return dec_len;
+	return remaining_len;
 }
 
 /**
@@ -828,10 +898,6 @@ static int handle_enc_msg(const uint8_t *enc_msg, int ilen, uint8_t **out)
  */
 static void handle_type_req_work_conn(void *ctx)
 {
-	if (!is_xfrpc_connected()) {
-		start_proxy_services();
-		set_xfrpc_status(true);
-	}
 	new_client_connect();
 }
 
@@ -841,13 +907,13 @@ static void handle_type_req_work_conn(void *ctx)
  * This function processes the response received after requesting a new proxy setup.
  * It interprets the message header containing proxy setup response information.
  *
- * @param msg Pointer to the message header structure containing response data
+ * @param body NUL terminated JSON body of the message
  *
  * @note This function is for internal use within the control module
  */
-static void handle_type_new_proxy_resp(struct msg_hdr *msg)
+static void handle_type_new_proxy_resp(const char *body)
 {
-	struct new_proxy_response *npr = new_proxy_resp_unmarshal((const char *)msg->data);
+	struct new_proxy_response *npr = new_proxy_resp_unmarshal(body);
 	if (!npr) {
 		debug(LOG_ERR, "Failed to unmarshal new proxy response");
 		return;
@@ -861,15 +927,16 @@ static void handle_type_new_proxy_resp(struct msg_hdr *msg)
  * @brief Handles the start work connection message type
  *
  * @param msg Pointer to the message header structure
+ * @param body NUL terminated JSON body of the message
  * @param len Length of the message
  * @param ctx Pointer to context data
  *
  * This function processes messages of type 'start work connection'
  * received from the frp server.
  */
-static void handle_type_start_work_conn(struct msg_hdr *msg, int len, void *ctx)
+static void handle_type_start_work_conn(struct msg_hdr *msg, const char *body, int len, void *ctx)
 {
-	struct start_work_conn_resp *sr = start_work_conn_resp_unmarshal((const char *)msg->data);
+	struct start_work_conn_resp *sr = start_work_conn_resp_unmarshal(body);
 	if (!sr) {
 		debug(LOG_ERR, "Failed to unmarshal TypeStartWorkConn");
 		return;
@@ -885,15 +952,26 @@ static void handle_type_start_work_conn(struct msg_hdr *msg, int len, void *ctx)
 	assert(ctx);
 	struct proxy_client *client = (struct proxy_client *)ctx;
 	client->ps = ps;
+	if (ps->tcp_mux_window && get_common_config()->tcp_mux) {
+		tmux_stream_set_window(client->ctl_bev, &client->stream, ps->tcp_mux_window);
+	}
+	if (ps->mux_weight) {
+		client->stream.weight = ps->mux_weight;
+	}
 
 	int remaining_len = len - sizeof(struct msg_hdr) - msg_hton(msg->length);
 	debug(LOG_DEBUG, "Proxy service [%s] [%s:%d] starting work connection. Remaining data length %d",
 		  sr->proxy_name, ps->local_ip, ps->local_port, remaining_len);
 
 	if (remaining_len > 0) {
-		client->data_tail_size = remaining_len;
-		client->data_tail = msg->data + msg_hton(msg->length);
-		debug(LOG_DEBUG, "Data tail is %s", client->data_tail);
+		// The message buffer belongs to the caller, keep a private copy
+		client->data_tail = malloc(remaining_len);
+		if (client->data_tail) {
+			memcpy(client->data_tail, msg->data + msg_hton(msg->length), remaining_len);
+			client->data_tail_size = remaining_len;
+		} else {
+			debug(LOG_ERR, "Failed to allocate %d bytes of data tail", remaining_len);
+		}
 	}
 
 	start_xfrp_tunnel(client);
@@ -904,67 +982,61 @@ static void handle_type_start_work_conn(struct msg_hdr *msg, int len, void *ctx)
 /**
  * @brief Handles UDP packet types in message processing
  *
- * @param msg Pointer to the message header structure containing packet information
+ * @param body NUL terminated JSON body of the message
+ * @param len Length of the body
  * @param ctx Pointer to context data needed for packet processing
  *
  * This function processes UDP type packets received in the message header.
  * It performs the necessary handling and routing of UDP packets based on
  * the message contents and context provided.
  */
-static void handle_type_udp_packet(struct msg_hdr *msg, void *ctx)
+static void handle_type_udp_packet(const char *body, size_t len, void *ctx)
 {
-	struct udp_packet *udp = udp_packet_unmarshal((const char *)msg->data);
-	if (!udp) {
-		debug(LOG_ERR, "Failed to unmarshal TypeUDPPacket");
-		return;
-	}
-
-	debug(LOG_DEBUG, "Received UDP packet from server, content: %s", udp->content);
 	assert(ctx);
 	struct proxy_client *client = (struct proxy_client *)ctx;
 	assert(client->ps);
 
-	handle_udp_packet(udp, client);
-	SAFE_FREE(udp);
+	if (handle_udp_packet(client, body, len) < 0) {
+		debug(LOG_ERR, "Failed to handle TypeUDPPacket");
+	}
 }
 
 /**
- * @brief Handles the control work based on received buffer data
+ * @brief Performs the control operation of one complete message
  *
- * Processes control messages received in the buffer and performs
- * corresponding control operations based on the message content.
- *
- * @param buf Pointer to the received data buffer
- * @param len Length of the received data in bytes
+ * @param msg Pointer to the message
+ * @param len Length of the message and any data following it in bytes
  * @param ctx Context pointer for additional data
  */
-static void handle_control_work(const uint8_t *buf, int len, void *ctx)
+static void dispatch_control_msg(struct msg_hdr *msg, int len, void *ctx)
 {
-	uint8_t *frps_cmd = NULL;
+	uint8_t cmd_type = msg->type;
+	uint64_t body_len = msg_hton(msg->length);
 
-	if (!ctx) {
-		if (handle_enc_msg(buf, len, &frps_cmd) <= 0 || !frps_cmd) {
-			return;
-		}
-	} else {
-		frps_cmd = (uint8_t *)buf;
+	if (len < (int)sizeof(struct msg_hdr) || body_len > len - sizeof(struct msg_hdr)) {
+		debug(LOG_ERR, "Truncated message type %d: %d bytes", cmd_type, len);
+		return;
 	}
 
-	struct msg_hdr *msg = (struct msg_hdr *)frps_cmd;
-	uint8_t cmd_type = msg->type;
+	// The JSON body is followed by the next message or proxied data
+	char *body = strndup((const char *)msg->data, body_len);
+	if (!body) {
+		debug(LOG_ERR, "Failed to allocate message body");
+		return;
+	}
 
 	switch (cmd_type) {
 	case TypeReqWorkConn:
 		handle_type_req_work_conn(ctx);
 		break;
 	case TypeNewProxyResp:
-		handle_type_new_proxy_resp(msg);
+		handle_type_new_proxy_resp(body);
 		break;
 	case TypeStartWorkConn:
-		handle_type_start_work_conn(msg, len, ctx);
+		handle_type_start_work_conn(msg, body, len, ctx);
 		break;
 	case TypeUDPPacket:
-		handle_type_udp_packet(msg, ctx);
+		handle_type_udp_packet(body, body_len, ctx);
 		break;
 	case TypePong:
 		pong_time = time(NULL);
@@ -974,8 +1046,67 @@ static void handle_control_work(const uint8_t *buf, int len, void *ctx)
 		break;
 	}
 
-	if (!ctx)
-		free(frps_cmd);
+	free(body);
+}
+
+/**
+ * @brief Handles the control work based on received buffer data
+ *
+ * Messages on the control connection are encrypted as one stream and the
+ * server may put several of them into one read, or split one across reads.
+ * They are decrypted into a reassembly buffer and dispatched once complete.
+ * Work connection messages arrive in plain text.
+ *
+ * @param buf Pointer to the received data buffer
+ * @param len Length of the received data in bytes
+ * @param ctx Proxy client of a work connection, NULL for the control connection
+ */
+static void handle_control_work(const uint8_t *buf, int len, void *ctx)
+{
+	if (ctx) {
+		dispatch_control_msg((struct msg_hdr *)buf, len, ctx);
+		return;
+	}
+
+	if (!ctl_msgs) {
+		ctl_msgs = evbuffer_new();
+		assert(ctl_msgs);
+	}
+
+	// A failed chunk leaves the stream undecodable, drop what is pending
+	int cmd_len = handle_enc_msg(buf, len, ctl_msgs);
+	if (cmd_len < 0) {
+		evbuffer_drain(ctl_msgs, evbuffer_get_length(ctl_msgs));
+		return;
+	}
+	if (cmd_len == 0) {
+		return;
+	}
+
+	for (;;) {
+		size_t avail = evbuffer_get_length(ctl_msgs);
+		struct msg_hdr hdr;
+		if (avail < sizeof(hdr)) {
+			break;
+		}
+
+		evbuffer_copyout(ctl_msgs, &hdr, sizeof(hdr));
+		uint64_t msg_len = msg_hton(hdr.length);
+		if (msg_len > MAX_CONTROL_MSG_LEN) {
+			debug(LOG_ERR, "Control message too long: %llu", (unsigned long long)msg_len);
+			evbuffer_drain(ctl_msgs, avail);
+			break;
+		}
+
+		size_t total = sizeof(hdr) + msg_len;
+		if (avail < total) {
+			break;
+		}
+
+		struct msg_hdr *msg = (struct msg_hdr *)evbuffer_pullup(ctl_msgs, total);
+		dispatch_control_msg(msg, total, NULL);
+		evbuffer_drain(ctl_msgs, total);
+	}
 }
 
 static int validate_login_msg(const struct msg_hdr *mhdr) {
@@ -994,13 +1125,28 @@ static int validate_login_msg(const struct msg_hdr *mhdr) {
  * @return Returns status code: 0 on success, negative value on failure
  */
 static int process_login_response(const struct msg_hdr *mhdr) {
-	struct login_resp *lres = login_resp_unmarshal((const char *)mhdr->data);
+	// Encrypted control data may follow the JSON body
+	char *body = strndup((const char *)mhdr->data, msg_hton(mhdr->length));
+	if (!body) {
+		debug(LOG_ERR, "Failed to allocate login response");
+		return 0;
+	}
+
+	struct login_resp *lres = login_resp_unmarshal(body);
+	free(body);
 	if (!lres) {
 		debug(LOG_ERR, "Failed to unmarshal login response");
 		return 0;
 	}
 
 	int success = login_resp_check(lres);
+	if (success) {
+		set_main_cipher(lres->cipher);
+	}
+	SAFE_FREE(lres->version);
+	SAFE_FREE(lres->run_id);
+	SAFE_FREE(lres->error);
+	SAFE_FREE(lres->cipher);
 	free(lres);
 
 	if (!success) {
@@ -1028,26 +1174,8 @@ static void handle_remaining_data(struct msg_hdr *mhdr, int login_len, int ilen)
 		return;
 	}
 
-	uint8_t *enc_msg = mhdr->data + login_len;
-	uint8_t *frps_cmd = NULL;
-	
-	int nret = handle_enc_msg(enc_msg, ilen, &frps_cmd);
-	if (nret <= 0 || !frps_cmd) {
-		debug(LOG_ERR, "Failed to handle encrypted message");
-		return;
-	}
-
-	if (frps_cmd[0] != TypeReqWorkConn) {
-		debug(LOG_ERR, "Unexpected message type: %d", frps_cmd[0]);
-		free(frps_cmd);
-		return;
-	}
-
-	start_proxy_services();
-	set_xfrpc_status(true);
-	new_client_connect();
-	
-	free(frps_cmd);
+	// Usually the first ReqWorkConn, handled like any later control data
+	handle_control_work(mhdr->data + login_len, ilen, NULL);
 }
 
 
@@ -1071,7 +1199,8 @@ static int handle_login_response(const uint8_t *buf, int len)
 	}
 
 	struct msg_hdr *mhdr = (struct msg_hdr *)buf;
-	if (!validate_login_msg(mhdr)) {
+	if (len < (int)sizeof(struct msg_hdr) || !validate_login_msg(mhdr) ||
+		msg_hton(mhdr->length) > len - sizeof(struct msg_hdr)) {
 		return 0;
 	}
 
@@ -1080,6 +1209,8 @@ static int handle_login_response(const uint8_t *buf, int len)
 	}
 
 	is_login = 1;
+	ctl_state = CTL_ONLINE;
+	reconnect_attempts = 0;
 	
 	int login_len = msg_hton(mhdr->length);
 	int remaining_len = len - login_len - sizeof(struct msg_hdr);
@@ -1087,10 +1218,16 @@ static int handle_login_response(const uint8_t *buf, int len)
 	debug(LOG_INFO, "Login successful - message length: %d, total length: %d, remaining: %d", 
 		  login_len, len, remaining_len);
 
+	// Set up the decoder from the server IV first, so the encoder the
+	// proxy registrations create can reuse it
 	if (remaining_len > 0) {
 		handle_remaining_data(mhdr, login_len, remaining_len);
 	}
 
+	start_proxy_services();
+	set_xfrpc_status(true);
+	start_mux_sessions();
+
 	return 1;
 }
 
@@ -1112,8 +1249,8 @@ static void handle_frps_msg(uint8_t *buf, int len, void *ctx)
 		return;
 	}
 
-	// Handle message based on login state
-	if (!is_login) {
+	// Handle message based on login state, work connections are past it
+	if (!ctx && !is_login) {
 		// Handle login response first
 		if (!handle_login_response(buf, len)) {
 			debug(LOG_ERR, "Login response handling failed");
@@ -1126,145 +1263,297 @@ static void handle_frps_msg(uint8_t *buf, int len, void *ctx)
 	}
 }
 
-static struct tmux_stream abandon_stream;
-
 /**
  * @brief Handles TCP multiplexing communication
  *
  * This function processes TCP multiplexing data received from the bufferevent.
  *
  * @param bev The bufferevent structure containing the TCP connection
- * @param len Length of the data to be handled
  * @param ctx Context pointer for additional data (can be NULL)
  *
- * @details This function is called when TCP multiplexing data needs to be 
- * processed. It manages the communication between the client and server 
- * in a multiplexed TCP connection.
+ * @details The frames are decoded by the decoder of the control connection,
+ * which keeps partial frames across calls. A protocol error tears the
+ * connection down the same way a connection error does.
  */
-static void handle_tcp_mux(struct bufferevent *bev, int len, void *ctx)
+static void handle_tcp_mux(struct bufferevent *bev, void *ctx)
 {
-	static struct tcp_mux_header tmux_hdr;
-	static uint32_t stream_len = 0;
+	if (tmux_decoder_feed(&main_ctl->session.decoder, bev, handle_frps_msg) == 0) {
+		return;
+	}
 
-	while (len > 0) {
-		struct tmux_stream *cur = get_cur_stream();
-		size_t nr = 0;
+	debug(LOG_ERR, "TCP mux protocol error, dropping connection to server");
+	struct evbuffer *input = bufferevent_get_input(bev);
+	evbuffer_drain(input, evbuffer_get_length(input));
+	bufferevent_trigger_event(bev, BEV_EVENT_ERROR, 0);
+}
 
-		if (!cur) {
-			memset(&tmux_hdr, 0, sizeof(tmux_hdr));
-			uint8_t *data = (uint8_t *)&tmux_hdr;
+/**
+ * @brief Extra mux sessions
+ *
+ * With tcp_mux_sessions > 1, work connection streams are spread over
+ * additional TCP connections to frps, so a single connection's congestion
+ * window no longer limits all proxies. frps binds a work connection to this
+ * client through the run_id in its NewWorkConn message, so the extra
+ * sessions need no login of their own. A yamux PING on every heartbeat
+ * keeps each of them alive.
+ */
+struct mux_session_slot {
+	struct tmux_session session;
+	struct bufferevent *bev;	/* connection, also while still connecting */
+	struct event *retry_ev;		/* reconnect timer */
+};
 
-			if (len < sizeof(tmux_hdr)) {
-				debug(LOG_INFO, "len [%d] < sizeof tmux_hdr", len);
-				break;
-			}
+static struct mux_session_slot mux_slots[MAX_TCP_MUX_SESSIONS - 1];
+static int mux_slot_count;
 
-			nr = bufferevent_read(bev, data, sizeof(tmux_hdr));
-			assert(nr == sizeof(tmux_hdr));
-			assert(validate_tcp_mux_protocol(&tmux_hdr) > 0);
-			len -= nr;
-
-			if (tmux_hdr.type == DATA) {
-				uint32_t stream_id = ntohl(tmux_hdr.stream_id);
-				stream_len = ntohl(tmux_hdr.length);
-				cur = get_stream_by_id(stream_id);
-				if (!cur) {
-					debug(LOG_INFO, "cur is NULL stream_id is %d, stream_len is %d len is %d",
-						  stream_id, stream_len, len);
-					if (stream_len > 0)
-						cur = &abandon_stream;
-					else
-						continue;
-				}
-
-				if (len == 0) {
-					set_cur_stream(cur);
-					break;
-				}
-				if (len >= stream_len) {
-					nr = tmux_stream_read(bev, cur, stream_len);
-					assert(nr == stream_len);
-					len -= stream_len;
-				} else {
-					nr = tmux_stream_read(bev, cur, len);
-					stream_len -= len;
-					assert(nr == len);
-					set_cur_stream(cur);
-					len -= nr;
-					break;
-				}
-			}
-		} else {
-			assert(tmux_hdr.type == DATA);
-			if (len >= stream_len) {
-				nr = tmux_stream_read(bev, cur, stream_len);
-				assert(nr == stream_len);
-				len -= stream_len;
-			} else {
-				nr = tmux_stream_read(bev, cur, len);
-				stream_len -= len;
-				assert(nr == len);
-				len -= nr;
-				break;
-			}
-		}
+static void mux_session_connect(struct mux_session_slot *slot);
 
-		if (cur == &abandon_stream) {
-			debug(LOG_INFO, "abandon stream data ...");
-			memset(cur, 0, sizeof(abandon_stream));
-			set_cur_stream(NULL);
-			continue;
-		}
+/**
+ * @brief Handles control messages arriving on an extra mux session
+ *
+ * Only work connection streams run on extra sessions, so every message
+ * must belong to a proxy client.
+ *
+ * @param buf Pointer to buffer containing the message
+ * @param len Length of the message in bytes
+ * @param ctx The proxy client of the stream, NULL if there is none
+ */
+static void handle_session_msg(uint8_t *buf, int len, void *ctx)
+{
+	if (!ctx) {
+		debug(LOG_ERR, "Dropping %d bytes for a stream without work connection", len);
+		return;
+	}
 
-		switch (tmux_hdr.type) {
-		case DATA:
-		case WINDOW_UPDATE:
-			handle_tcp_mux_stream(&tmux_hdr, handle_frps_msg);
-			break;
-		case PING:
-			handle_tcp_mux_ping(&tmux_hdr);
-			break;
-		case GO_AWAY:
-			handle_tcp_mux_go_away(&tmux_hdr);
-			break;
-		default:
-			debug(LOG_ERR, "Unexpected tmux_hdr.type");
-			exit(-1);
-		}
+	handle_control_work(buf, len, ctx);
+}
+
+/**
+ * @brief Tears down an extra mux session and its work connections
+ *
+ * @param slot  The session slot
+ * @param retry Whether to reconnect after RETRY_DELAY_SECONDS
+ */
+static void mux_session_drop(struct mux_session_slot *slot, bool retry)
+{
+	del_proxy_clients_by_session(&slot->session);
+	tmux_session_reset(&slot->session);
+	if (slot->bev) {
+		bufferevent_free(slot->bev);
+		slot->bev = NULL;
+	}
 
-		set_cur_stream(NULL);
+	if (retry && slot->retry_ev) {
+		struct timeval tv = { .tv_sec = RETRY_DELAY_SECONDS, .tv_usec = 0 };
+		evtimer_add(slot->retry_ev, &tv);
 	}
 }
 
 /**
- * @brief Handles non-multiplexed data received from a buffered event
+ * @brief Read callback of an extra mux session
  *
- * @param bev The bufferevent structure containing the connection
- * @param input The evbuffer containing the received data
- * @param len Length of the data in the input buffer
- * @param ctx Context pointer for additional data (can be NULL)
- * 
- * @details This function processes data received on a non-multiplexed connection.
- *          It is called when data is available to be read from the bufferevent.
+ * @param bev The session bufferevent
+ * @param ctx The session slot
  */
-static void handle_non_mux(struct bufferevent *bev, struct evbuffer *input, int len, void *ctx)
+static void mux_session_recv_cb(struct bufferevent *bev, void *ctx)
 {
-	uint8_t *buf = calloc(len, 1);
-	assert(buf);
-	evbuffer_remove(input, buf, len);
+	struct mux_session_slot *slot = ctx;
 
-	handle_frps_msg(buf, len, ctx);
-	SAFE_FREE(buf);
+	if (tmux_decoder_feed(&slot->session.decoder, bev, handle_session_msg) < 0) {
+		debug(LOG_ERR, "TCP mux protocol error on extra session, reconnecting");
+		mux_session_drop(slot, true);
+	}
 }
 
 /**
- * @brief Callback function for handling received data from a bufferevent
- *
- * @param bev The bufferevent structure that received the data
- * @param ctx User-defined context pointer passed to the callback
+ * @brief Event callback of an extra mux session
  *
- * This function is called when data is received on the bufferevent.
- * It processes incoming data and performs necessary handling operations.
+ * @param bev  The session bufferevent
+ * @param what Bitmask of the events that occurred
+ * @param ctx  The session slot
+ */
+static void mux_session_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct mux_session_slot *slot = ctx;
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		debug(LOG_ERR, "Extra mux session %ld lost: %s",
+			  (long)(slot - mux_slots), strerror(errno));
+		mux_session_drop(slot, true);
+	} else if (what & BEV_EVENT_CONNECTED) {
+		debug(LOG_INFO, "Extra mux session %ld connected", (long)(slot - mux_slots));
+		tmux_session_init(&slot->session, bev);
+	}
+}
+
+/**
+ * @brief Reconnect timer callback of an extra mux session
+ *
+ * @param fd   Unused
+ * @param what Unused
+ * @param arg  The session slot
+ */
+static void mux_session_retry_cb(evutil_socket_t fd, short what, void *arg)
+{
+	mux_session_connect(arg);
+}
+
+/**
+ * @brief Opens the connection of an extra mux session
+ *
+ * @param slot The session slot
+ */
+static void mux_session_connect(struct mux_session_slot *slot)
+{
+	struct common_conf *c_conf = get_common_config();
+
+	if (slot->bev || !is_login) {
+		return;
+	}
+
+	slot->bev = connect_server(main_ctl->connect_base, c_conf->server_addr, c_conf->server_port);
+	if (!slot->bev) {
+		mux_session_drop(slot, true);
+		return;
+	}
+
+	bufferevent_setcb(slot->bev, mux_session_recv_cb, tmux_session_write_cb,
+					  mux_session_event_cb, slot);
+	bufferevent_enable(slot->bev, EV_READ|EV_WRITE);
+}
+
+/**
+ * @brief Connects the extra mux sessions once the client is logged in
+ */
+static void start_mux_sessions(void)
+{
+	struct common_conf *c_conf = get_common_config();
+	if (!c_conf->tcp_mux || c_conf->tcp_mux_sessions <= 1) {
+		return;
+	}
+
+	mux_slot_count = c_conf->tcp_mux_sessions - 1;
+	for (int i = 0; i < mux_slot_count; i++) {
+		struct mux_session_slot *slot = &mux_slots[i];
+		if (!slot->retry_ev) {
+			slot->retry_ev = evtimer_new(main_ctl->connect_base, mux_session_retry_cb, slot);
+		}
+		mux_session_connect(slot);
+	}
+}
+
+/**
+ * @brief Closes all extra mux sessions, without reconnecting
+ */
+static void stop_mux_sessions(void)
+{
+	for (int i = 0; i < mux_slot_count; i++) {
+		struct mux_session_slot *slot = &mux_slots[i];
+		if (slot->retry_ev) {
+			evtimer_del(slot->retry_ev);
+		}
+		mux_session_drop(slot, false);
+	}
+}
+
+/**
+ * @brief Pings the extra mux sessions and drops the ones that went silent
+ *
+ * Called on every heartbeat. A session whose last PING acknowledgment is
+ * older than heartbeat_timeout is reconnected.
+ */
+static void keep_mux_sessions_alive(void)
+{
+	struct common_conf *c_conf = get_common_config();
+	time_t now = time(NULL);
+
+	for (int i = 0; i < mux_slot_count; i++) {
+		struct mux_session_slot *slot = &mux_slots[i];
+		if (!slot->session.bev) {
+			continue;
+		}
+
+		if (now - slot->session.last_ack > c_conf->heartbeat_timeout) {
+			debug(LOG_ERR, "Extra mux session %d timed out, reconnecting", i);
+			mux_session_drop(slot, true);
+			continue;
+		}
+		tmux_session_ping(&slot->session);
+	}
+}
+
+/**
+ * @brief Picks the mux session for a new work connection
+ *
+ * Prefers the session with the fewest bytes waiting to be written, then
+ * the one carrying the fewest streams. The main session is always a
+ * candidate.
+ *
+ * @return The chosen session
+ */
+static struct tmux_session *pick_mux_session(void)
+{
+	struct tmux_session *best = &main_ctl->session;
+	size_t best_backlog = tmux_session_backlog(best);
+
+	for (int i = 0; i < mux_slot_count; i++) {
+		struct tmux_session *session = &mux_slots[i].session;
+		if (!session->bev) {
+			continue;
+		}
+
+		size_t backlog = tmux_session_backlog(session);
+		if (backlog < best_backlog ||
+			(backlog == best_backlog && session->nstreams < best->nstreams)) {
+			best = session;
+			best_backlog = backlog;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * @brief Handles non-multiplexed data received from a buffered event
+ *
+ * @param bev The bufferevent structure containing the connection
+ * @param input The evbuffer containing the received data
+ * @param len Length of the data in the input buffer
+ * @param ctx Context pointer for additional data (can be NULL)
+ * 
+ * @details This function processes data received on a non-multiplexed connection.
+ *          It is called when data is available to be read from the bufferevent.
+ */
+static void handle_non_mux(struct bufferevent *bev, struct evbuffer *input, int len, void *ctx)
+{
+	// A work connection starts with a plain StartWorkConn, wait until it is complete
+	if (ctx) {
+		struct msg_hdr hdr;
+		if (len < (int)sizeof(hdr)) {
+			return;
+		}
+		evbuffer_copyout(input, &hdr, sizeof(hdr));
+		if (msg_hton(hdr.length) > len - sizeof(hdr)) {
+			return;
+		}
+	}
+
+	uint8_t *buf = calloc(len, 1);
+	assert(buf);
+	evbuffer_remove(input, buf, len);
+
+	handle_frps_msg(buf, len, ctx);
+	SAFE_FREE(buf);
+}
+
+/**
+ * @brief Callback function for handling received data from a bufferevent
+ *
+ * @param bev The bufferevent structure that received the data
+ * @param ctx User-defined context pointer passed to the callback
+ *
+ * This function is called when data is received on the bufferevent.
+ * It processes incoming data and performs necessary handling operations.
  */
 static void recv_cb(struct bufferevent *bev, void *ctx)
 {
@@ -1277,39 +1566,125 @@ static void recv_cb(struct bufferevent *bev, void *ctx)
 	struct common_conf *c_conf = get_common_config();
 
 	if (c_conf->tcp_mux) {
-		handle_tcp_mux(bev, len, ctx);
+		handle_tcp_mux(bev, ctx);
 	} else {
 		handle_non_mux(bev, input, len, ctx);
 	}
 }
 
 /**
- * @brief Handles connection failures for the xfrpc client
+ * @brief Tells whether a connection error is worth an immediate retry
  *
- * This function implements the connection failure handling logic, including
- * retry mechanisms and connection state management.
+ * These end a session that worked, e.g. frps restarting or a NAT mapping
+ * expiring, while the server itself likely still answers.
  *
- * @param c_conf Pointer to the common configuration structure
- * @param retry_times Pointer to the number of retry attempts made
+ * @param err errno of the failure, 0 when the server closed the connection
+ * @return true if transient
+ */
+static bool is_transient_error(int err)
+{
+	switch (err) {
+	case 0:
+	case ECONNRESET:
+	case ECONNABORTED:
+	case ENETRESET:
+	case EPIPE:
+	case ETIMEDOUT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * @brief Returns a random number of milliseconds below a bound
+ *
+ * rand() is reseeded with the time elsewhere, so clients restarted
+ * together would draw the same delays; RAND_bytes() differs per client.
  *
- * @note This function modifies the retry_times parameter to track retry attempts
+ * @param bound Exclusive upper bound, positive
+ * @return The number
  */
-static void handle_connection_failure(struct common_conf *c_conf, int *retry_times) {
-	debug(LOG_ERR, "Connection to server [%s:%d] failed: %s", 
-		  c_conf->server_addr, 
-		  c_conf->server_port,
-		  strerror(errno));
+static long random_ms(long bound)
+{
+	uint32_t r;
 
-	(*retry_times)++;
-	if (*retry_times >= MAX_RETRY_TIMES) {
-		debug(LOG_INFO, "Maximum retry attempts (%d) reached", MAX_RETRY_TIMES);
+	if (RAND_bytes((unsigned char *)&r, sizeof(r)) != 1) {
+		r = (uint32_t)random();
 	}
+	return r % bound;
+}
+
+/**
+ * @brief Tears the control connection down and schedules a reconnect
+ *
+ * The delay is drawn uniformly below a window (full jitter), so clients
+ * dropped together by an frps restart come back spread out instead of
+ * all at once. The window doubles from RECONNECT_BASE_MS with every
+ * failed reconnect up to RECONNECT_MAX_MS. A session that was online and
+ * ended on a transient error retries within RECONNECT_FAST_MS first.
+ *
+ * Does nothing while a reconnect is already scheduled.
+ *
+ * @param err errno of the failure, 0 when the server closed the connection
+ */
+static void schedule_reconnect(int err)
+{
+	if (ctl_state == CTL_BACKOFF) {
+		return;
+	}
+
+	long window;
+	if (ctl_state == CTL_ONLINE && is_transient_error(err)) {
+		window = RECONNECT_FAST_MS;
+	} else {
+		int shift = reconnect_attempts < 16 ? reconnect_attempts : 16;
+		window = (long)RECONNECT_BASE_MS << shift;
+		if (window > RECONNECT_MAX_MS) {
+			window = RECONNECT_MAX_MS;
+		}
+		reconnect_attempts++;
+	}
+	long delay = random_ms(window);
 
-	sleep(RETRY_DELAY_SECONDS);
-	
 	reset_session_id();
 	clear_main_control();
-	run_control();
+	if (main_ctl->connect_bev) {
+		bufferevent_free(main_ctl->connect_bev);
+		main_ctl->connect_bev = NULL;
+	}
+
+	ctl_state = CTL_BACKOFF;
+	struct timeval tv = { delay / 1000, (delay % 1000) * 1000 };
+	evtimer_add(main_ctl->reconnect_ev, &tv);
+	debug(LOG_INFO, "Reconnecting to server in %ld ms", delay);
+}
+
+/**
+ * @brief Timer callback reconnecting to the server once the backoff elapsed
+ *
+ * @param fd Unused
+ * @param what Unused
+ * @param arg Unused
+ */
+static void reconnect_cb(evutil_socket_t fd, short what, void *arg)
+{
+	start_base_connect();
+}
+
+/**
+ * @brief Handles connection failures for the xfrpc client
+ *
+ * @param c_conf Pointer to the common configuration structure
+ * @param err errno of the failure, 0 when the server closed the connection
+ */
+static void handle_connection_failure(struct common_conf *c_conf, int err) {
+	debug(LOG_ERR, "Connection to server [%s:%d] failed: %s", 
+		  c_conf->server_addr, 
+		  c_conf->server_port,
+		  err ? strerror(err) : "closed by server");
+
+	schedule_reconnect(err);
 }
 
 /**
@@ -1325,7 +1700,11 @@ static void handle_connection_success(struct bufferevent *bev) {
 	debug(LOG_INFO, "Successfully connected to xfrp server");
 	
 	// Initialize window and login
-	send_window_update(bev, &main_ctl->stream, 0);
+	if (get_common_config()->tcp_mux) {
+		tmux_session_init(&main_ctl->session, bev);
+		send_window_update(bev, &main_ctl->stream, 0);
+	}
+	tcp_mux_probe_rtt(bev);
 	login();
 	
 	// Setup keepalive mechanism
@@ -1346,7 +1725,6 @@ static void handle_connection_success(struct bufferevent *bev) {
  */
 static void connect_event_cb(struct bufferevent *bev, short what, void *ctx)
 {
-	static int retry_times = 0;
 	struct common_conf *c_conf = get_common_config();
 	
 	if (!c_conf) {
@@ -1354,11 +1732,14 @@ static void connect_event_cb(struct bufferevent *bev, short what, void *ctx)
 		return;
 	}
 
-	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
-		handle_connection_failure(c_conf, &retry_times);
+	if (what & BEV_EVENT_ERROR) {
+		handle_connection_failure(c_conf, EVUTIL_SOCKET_ERROR());
 	} 
+	else if (what & BEV_EVENT_EOF) {
+		handle_connection_failure(c_conf, 0);
+	}
 	else if (what & BEV_EVENT_CONNECTED) {
-		retry_times = 0;
+		ctl_state = CTL_LOGIN;
 		handle_connection_success(bev);
 	}
 }
@@ -1469,7 +1850,7 @@ static int setup_server_callbacks(struct bufferevent *bev)
 	}
 
 	bufferevent_enable(bev, EV_WRITE|EV_READ);
-	bufferevent_setcb(bev, recv_cb, NULL, connect_event_cb, NULL);
+	bufferevent_setcb(bev, recv_cb, tmux_session_write_cb, connect_event_cb, NULL);
 	return 0;
 }
 
@@ -1490,12 +1871,14 @@ static void start_base_connect()
 		exit(1);
 	}
 
-	// Initialize server connection
+	// Initialize server connection, a failure is retried like a dropped one
+	ctl_state = CTL_CONNECTING;
 	if (init_server_connection(&main_ctl->connect_bev,
 							 main_ctl->connect_base,
 							 c_conf->server_addr,
 							 c_conf->server_port) != 0) {
-		exit(1);
+		schedule_reconnect(errno);
+		return;
 	}
 
 	// Setup callbacks for the connection
@@ -1560,37 +1943,182 @@ void login(void) {
 }
 
 /**
- * @brief Prepares a message of the specified type for communication
+ * @brief Encodes a message header and payload into a buffer
  *
- * @param type The type of message to be prepared
- * @return int Returns 0 on success, negative value on failure
+ * @param buf     Destination, sizeof(struct msg_hdr) + msg_len bytes
+ * @param type    The type of message
+ * @param msg     Message payload
+ * @param msg_len Length of the payload
+ */
+static void encode_message(uint8_t *buf, const enum msg_type type,
+						  const char *msg, const size_t msg_len)
+{
+	uint64_t length = msg_hton((uint64_t)msg_len);
+
+	buf[0] = type;
+	memcpy(buf + offsetof(struct msg_hdr, length), &length, sizeof(length));
+	memcpy(buf + sizeof(struct msg_hdr), msg, msg_len);
+}
+
+/**
+ * @brief Returns the encode scratch buffer of the calling thread
+ *
+ * Mux frames are assembled here before tmux_stream_write() frames them.
+ * The buffer only grows, so steady traffic encodes without allocating.
+ *
+ * @param size Number of bytes needed
+ * @return The scratch buffer, NULL if it could not be grown
+ */
+static uint8_t *encode_scratch(size_t size)
+{
+	static __thread uint8_t *scratch;
+	static __thread size_t scratch_size;
+
+	if (size > scratch_size) {
+		size_t new_size = scratch_size ? scratch_size : MSG_SCRATCH_SIZE;
+		while (new_size < size) {
+			new_size *= 2;
+		}
+
+		uint8_t *buf = realloc(scratch, new_size);
+		if (!buf) {
+			debug(LOG_ERR, "Failed to grow encode buffer to %zu bytes", new_size);
+			return NULL;
+		}
+		scratch = buf;
+		scratch_size = new_size;
+	}
+	return scratch;
+}
+
+/**
+ * @brief Encodes a message and sends it as AEAD records
+ *
+ * The message is assembled in the per-thread scratch buffer and sealed
+ * from there into the bufferevent output, or through a mux stream into a
+ * per-thread evbuffer whose chains the stream takes over.
+ *
+ * @param bout    The bufferevent to send on
+ * @param type    The type of message
+ * @param msg     Message payload
+ * @param msg_len Length of the payload
+ * @param stream  The tmux stream, used with mux only
+ * @param encoder Encoder with an AEAD cipher
+ * @return 0 on success, -1 on failure
+ */
+static int write_sealed_message(struct bufferevent *bout, const enum msg_type type,
+							   const char *msg, const size_t msg_len,
+							   struct tmux_stream *stream, struct frp_coder *encoder)
+{
+	static __thread struct evbuffer *sealed;
+	size_t total_len = msg_len + sizeof(struct msg_hdr);
+	struct common_conf *c_conf = get_common_config();
+
+	uint8_t *buf = encode_scratch(total_len);
+	if (!buf) {
+		return -1;
+	}
+	encode_message(buf, type, msg, msg_len);
+
+	if (!c_conf->tcp_mux) {
+		if (seal_records(encoder, buf, total_len, bufferevent_get_output(bout)) == 0) {
+			debug(LOG_ERR, "Failed to seal message");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!sealed && !(sealed = evbuffer_new())) {
+		debug(LOG_ERR, "Failed to allocate sealing buffer");
+		return -1;
+	}
+
+	size_t sealed_len = seal_records(encoder, buf, total_len, sealed);
+	if (sealed_len == 0) {
+		debug(LOG_ERR, "Failed to seal message");
+		evbuffer_drain(sealed, evbuffer_get_length(sealed));
+		return -1;
+	}
+
+	if (tmux_stream_write_buffer(bout, sealed, stream) != sealed_len) {
+		debug(LOG_ERR, "Failed to write message through TCP mux");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Encodes a message straight into its output and sends it
+ *
+ * Without mux the header and payload are written into space reserved in
+ * the bufferevent output buffer and encrypted there. Through a mux stream
+ * they are assembled in the per-thread scratch buffer, which the stream
+ * copies into its frame.
+ *
+ * @param bout    The bufferevent to send on
+ * @param type    The type of message
+ * @param msg     Message payload
+ * @param msg_len Length of the payload
+ * @param stream  The tmux stream, used with mux only
+ * @param encoder Encoder to encrypt with, NULL to send in plain
+ * @return 0 on success, -1 on failure
  */
-static int prepare_message(const enum msg_type type,
-						 const char *msg,
-						 const size_t msg_len,
-						 struct msg_hdr **msg_out,
-						 size_t *total_len)
+static int write_message(struct bufferevent *bout, const enum msg_type type,
+						const char *msg, const size_t msg_len,
+						struct tmux_stream *stream, struct frp_coder *encoder)
 {
-	// Validate inputs
-	if (!msg || !msg_out || !total_len) {
+	if (!msg) {
 		debug(LOG_ERR, "Invalid input parameters");
 		return -1;
 	}
 
-	// Calculate total message length and allocate memory
-	*total_len = msg_len + sizeof(struct msg_hdr);
-	struct msg_hdr *req_msg = calloc(*total_len, 1);
-	if (!req_msg) {
-		debug(LOG_ERR, "Failed to allocate memory for message");
+	size_t total_len = msg_len + sizeof(struct msg_hdr);
+	struct common_conf *c_conf = get_common_config();
+
+	if (is_aead_coder(encoder)) {
+		return write_sealed_message(bout, type, msg, msg_len, stream, encoder);
+	}
+
+	if (c_conf->tcp_mux) {
+		uint8_t *buf = encode_scratch(total_len);
+		if (!buf) {
+			return -1;
+		}
+
+		encode_message(buf, type, msg, msg_len);
+		if (encoder && encrypt_data_inplace(buf, total_len, encoder) != total_len) {
+			debug(LOG_ERR, "Encryption failed");
+			return -1;
+		}
+
+		if (tmux_stream_write(bout, buf, total_len, stream) != total_len) {
+			debug(LOG_ERR, "Failed to write message through TCP mux");
+			return -1;
+		}
+		return 0;
+	}
+
+	struct evbuffer *output = bufferevent_get_output(bout);
+	struct evbuffer_iovec vec;
+
+	// A single vector makes the reserved space contiguous
+	if (evbuffer_reserve_space(output, total_len, &vec, 1) != 1) {
+		debug(LOG_ERR, "Failed to reserve %zu bytes for message", total_len);
 		return -1;
 	}
 
-	// Prepare message header and content 
-	req_msg->type = type;
-	req_msg->length = msg_hton((uint64_t)msg_len);
-	memcpy(req_msg->data, msg, msg_len);
+	encode_message(vec.iov_base, type, msg, msg_len);
+	if (encoder && encrypt_data_inplace(vec.iov_base, total_len, encoder) != total_len) {
+		// Nothing is committed, the reserved space is simply dropped
+		debug(LOG_ERR, "Encryption failed");
+		return -1;
+	}
 
-	*msg_out = req_msg;
+	vec.iov_len = total_len;
+	if (evbuffer_commit_space(output, &vec, 1) < 0) {
+		debug(LOG_ERR, "Failed to write message directly");
+		return -1;
+	}
 	return 0;
 }
 
@@ -1616,76 +2144,13 @@ void send_msg_frp_server(struct bufferevent *bev,
 	// Log debug info
 	debug(LOG_DEBUG, "Sending message: type=%d, len=%zu", type, msg_len);
 	if (msg) {
-		debug(LOG_DEBUG, "Message content: %s", msg);
-	}
-
-	// Prepare message
-	struct msg_hdr *req_msg = NULL;
-	size_t total_len = 0;
-	if (prepare_message(type, msg, msg_len, &req_msg, &total_len) != 0) {
-		return;
-	}
-
-	// Send message based on mux configuration
-	struct common_conf *c_conf = get_common_config();
-	if (c_conf->tcp_mux) {
-		if (tmux_stream_write(bout, (uint8_t *)req_msg, total_len, stream) < 0) {
-			debug(LOG_ERR, "Failed to write message through TCP mux");
-		}
-	} else {
-		if (bufferevent_write(bout, (uint8_t *)req_msg, total_len) < 0) {
-			debug(LOG_ERR, "Failed to write message directly"); 
-		}
-	}
-
-	free(req_msg);
-}
-
-/**
- * @brief Prepares an encrypted message of specified type
- * 
- * @param type The type of message to be encrypted
- * 
- * @return int Returns 0 on success, negative value on error
- */
-static int prepare_encrypted_message(const enum msg_type type,
-								   const char *msg,
-								   const size_t msg_len,
-								   uint8_t **enc_msg_out,
-								   size_t *enc_len_out)
-{
-	// Validate inputs
-	if (!msg || !enc_msg_out || !enc_len_out) {
-		debug(LOG_ERR, "Invalid input parameters");
-		return -1;
-	}
-
-	// Prepare message header and content
-	size_t total_len = msg_len + sizeof(struct msg_hdr);
-	struct msg_hdr *req_msg = calloc(total_len, 1);
-	if (!req_msg) {
-		debug(LOG_ERR, "Failed to allocate memory for message");
-		return -1;
+		debug(LOG_DEBUG, "Message content: %.*s", (int)msg_len, msg);
 	}
 
-	req_msg->type = type;
-	req_msg->length = msg_hton((uint64_t)msg_len);
-	memcpy(req_msg->data, msg, msg_len);
-
-	// Encrypt message
-	uint8_t *enc_msg = NULL;
-	size_t enc_len = encrypt_data((uint8_t *)req_msg, total_len, 
-								 get_main_encoder(), &enc_msg);
-	free(req_msg);
-
-	if (enc_len <= 0 || !enc_msg) {
-		debug(LOG_ERR, "Encryption failed");
-		return -1;
+	// A message lost or cut short leaves the connection out of step
+	if (write_message(bout, type, msg, msg_len, stream, NULL) != 0) {
+		bufferevent_trigger_event(bout, BEV_EVENT_ERROR, BEV_OPT_DEFER_CALLBACKS);
 	}
-
-	*enc_msg_out = enc_msg;
-	*enc_len_out = enc_len;
-	return 0;
 }
 
 /**
@@ -1710,7 +2175,7 @@ static int initialize_encoder(struct bufferevent *bout, struct tmux_stream *stre
 
 	struct common_conf *c_conf = get_common_config();
 	if (c_conf->tcp_mux) {
-		if (tmux_stream_write(bout, coder->iv, 16, stream) < 0) {
+		if (tmux_stream_write(bout, coder->iv, 16, stream) != 16) {
 			debug(LOG_ERR, "Failed to write IV through TCP mux");
 			return -1;
 		}
@@ -1744,31 +2209,17 @@ void send_enc_msg_frp_server(struct bufferevent *bev,
 		return;
 	}
 
-	// Initialize encoder if needed
+	// Initialize encoder if needed; without one the session can't go on
 	if (!get_main_encoder() && initialize_encoder(bout, stream) != 0) {
+		bufferevent_trigger_event(bout, BEV_EVENT_ERROR, BEV_OPT_DEFER_CALLBACKS);
 		return;
 	}
 
-	// Prepare and encrypt message
-	uint8_t *enc_msg = NULL;
-	size_t enc_len = 0;
-	if (prepare_encrypted_message(type, msg, msg_len, &enc_msg, &enc_len) != 0) {
-		return;
-	}
-
-	// Send encrypted message
-	struct common_conf *c_conf = get_common_config();
-	if (c_conf->tcp_mux) {
-		if (tmux_stream_write(bout, enc_msg, enc_len, stream) < 0) {
-			debug(LOG_ERR, "Failed to write encrypted message through TCP mux");
-		}
-	} else {
-		if (bufferevent_write(bout, enc_msg, enc_len) < 0) {
-			debug(LOG_ERR, "Failed to write encrypted message directly");
-		}
+	// Encode and encrypt the message in place. Once it failed the encoder
+	// may have moved on without the server, nothing sent later would decode
+	if (write_message(bout, type, msg, msg_len, stream, get_main_encoder()) != 0) {
+		bufferevent_trigger_event(bout, BEV_EVENT_ERROR, BEV_OPT_DEFER_CALLBACKS);
 	}
-
-	free(enc_msg);
 }
 
 struct control *
@@ -1916,17 +2367,17 @@ static int init_event_base(struct control *ctl)
 }
 
 /**
- * @brief Initializes the DNS base for the control structure
- * 
- * @param ctl Pointer to the control structure
- * @return int Returns 0 on success, -1 on failure
+ * @brief Creates a DNS resolver for an event base
+ *
+ * @param base Event base the resolver runs on
+ * @return The resolver, NULL on failure
  */
-static int init_dns_base(struct control *ctl)
+struct evdns_base *create_dns_base(struct event_base *base)
 {
-	struct evdns_base *dnsbase = evdns_base_new(ctl->connect_base, 1);
+	struct evdns_base *dnsbase = evdns_base_new(base, 1);
 	if (!dnsbase) {
 		debug(LOG_ERR, "Failed to create DNS base");
-		return -1;
+		return NULL;
 	}
 
 	// Configure DNS options
@@ -1945,8 +2396,37 @@ static int init_dns_base(struct control *ctl)
 		evdns_base_nameserver_ip_add(dnsbase, dns_servers[i]);
 	}
 
-	ctl->dnsbase = dnsbase;
-	return 0;
+	return dnsbase;
+}
+
+/**
+ * @brief Initializes the DNS base for the control structure
+ * 
+ * @param ctl Pointer to the control structure
+ * @return int Returns 0 on success, -1 on failure
+ */
+static int init_dns_base(struct control *ctl)
+{
+	ctl->dnsbase = create_dns_base(ctl->connect_base);
+	return ctl->dnsbase ? 0 : -1;
+}
+
+/**
+ * @brief Returns the DNS resolver to use for connections on an event base
+ *
+ * Worker loops have resolvers of their own, evdns requests must run on the
+ * loop of the connection that waits for them.
+ *
+ * @param base Event base of the connection
+ * @return The resolver, NULL if none is available
+ */
+struct evdns_base *get_dns_base(struct event_base *base)
+{
+	struct evdns_base *dnsbase = worker_dns_base(base);
+	if (dnsbase) {
+		return dnsbase;
+	}
+	return main_ctl ? main_ctl->dnsbase : NULL;
 }
 
 /**
@@ -1973,24 +2453,34 @@ void init_main_control()
 		exit(1);
 	}
 
+	// Worker threads must be up before the main base exists, see start_workers()
+	struct common_conf *c_conf = get_common_config();
+	if (start_workers(c_conf->worker_threads) != 0) {
+		debug(LOG_ERR, "Running work connections on the main loop");
+	}
+
 	// Initialize event base
 	if (init_event_base(main_ctl) != 0) {
 		free(main_ctl);
 		exit(1);
 	}
 
+	main_ctl->reconnect_ev = evtimer_new(main_ctl->connect_base, reconnect_cb, NULL);
+	if (!main_ctl->reconnect_ev) {
+		debug(LOG_ERR, "Failed to create reconnect timer");
+		event_base_free(main_ctl->connect_base);
+		free(main_ctl);
+		exit(1);
+	}
+
 	// Initialize TCP multiplexing if enabled
-	struct common_conf *c_conf = get_common_config();
 	if (c_conf->tcp_mux) {
 		init_tmux_stream(&main_ctl->stream, get_next_session_id(), INIT);
+		tmux_session_reset(&main_ctl->session);
+		tmux_stream_attach(&main_ctl->stream, &main_ctl->session);
 	}
 
-	// Skip DNS initialization if server address is IP
-	if (is_valid_ip_address(c_conf->server_addr)) {
-		return;
-	}
-
-	// Initialize DNS base
+	// Initialize DNS base, SOCKS5 targets and local services may be hostnames
 	if (init_dns_base(main_ctl) != 0) {
 		event_base_free(main_ctl->connect_base);
 		free(main_ctl);
@@ -2028,9 +2518,7 @@ static void clear_main_control()
 
 	// Clear event timers
 	if (main_ctl->ticker_ping) {
-		if (evtimer_del(main_ctl->ticker_ping) < 0) {
-			debug(LOG_ERR, "Failed to delete ticker ping timer");
-		}
+		event_free(main_ctl->ticker_ping);
 		main_ctl->ticker_ping = NULL;
 	}
 
@@ -2049,12 +2537,19 @@ static void clear_main_control()
 	// Clean up resources
 	clear_all_proxy_client();
 	free_crypto_resources();
+	if (ctl_msgs) {
+		evbuffer_drain(ctl_msgs, evbuffer_get_length(ctl_msgs));
+	}
 
 	// Reinitialize TCP multiplexing if enabled
 	struct common_conf *conf = get_common_config();
 	if (conf && conf->tcp_mux) {
+		stop_mux_sessions();
+		tmux_session_reset(&main_ctl->session);
+		release_tmux_stream(&main_ctl->stream);
 		uint32_t session_id = get_next_session_id();
 		init_tmux_stream(&main_ctl->stream, session_id, INIT);
+		tmux_stream_attach(&main_ctl->stream, &main_ctl->session);
 		debug(LOG_DEBUG, "Reinitialized TCP mux stream with session ID %u", session_id);
 	}
 }
@@ -2088,10 +2583,17 @@ void close_main_control()
 			main_ctl->dnsbase = NULL;
 		}
 
+		if (main_ctl->reconnect_ev) {
+			event_free(main_ctl->reconnect_ev);
+			main_ctl->reconnect_ev = NULL;
+		}
+
 		event_base_free(main_ctl->connect_base);
 		main_ctl->connect_base = NULL;
 	}
 
+	stop_workers();
+
 	// Free the main control structure
 	free_main_control();
 }
@@ -10,8 +10,13 @@
 #include "msg.h"
 #include "uthash.h"
 
-#define MAX_RETRY_TIMES 100
 #define RETRY_DELAY_SECONDS 2
+#define RECONNECT_BASE_MS 1000     /* first backoff window of a reconnect */
+#define RECONNECT_MAX_MS 60000     /* backoff windows stop growing here */
+#define RECONNECT_FAST_MS 1000     /* window of the retry after a transient drop */
+#define MAX_CONTROL_MSG_LEN (1024 * 1024)
+#define MSG_SCRATCH_SIZE 4096      /* initial size of the message encode buffer */
+#define WORK_CONN_MSG_SIZE 256     /* NewWorkConn JSON, run_id included */
 
 /**
  * @brief Main control structure for FRP client
@@ -22,8 +27,10 @@ struct control {
     struct bufferevent *connect_bev;  /* Main I/O event buffer */
     struct event *ticker_ping;        /* Heartbeat timer */
     struct event *tcp_mux_ping_event; /* TCP multiplexing ping event */
+    struct event *reconnect_ev;       /* Reconnect after a backoff delay */
     uint32_t tcp_mux_ping_id;         /* TCP multiplexing ping ID */
     struct tmux_stream stream;        /* Multiplexing stream */
+    struct tmux_session session;      /* Mux session on connect_bev */
 };
 
 /* Control lifecycle functions */
@@ -35,7 +42,8 @@ void close_main_control(void);
 /* Server connection functions */
 struct bufferevent *connect_server(struct event_base *base, const char *name,
                                    const int port);
-struct bufferevent *connect_udp_server(struct event_base *base);
+struct evdns_base *create_dns_base(struct event_base *base);
+struct evdns_base *get_dns_base(struct event_base *base);
 void connect_eventcb(struct bufferevent *bev, short events, void *ptr);
 
 /* Server communication functions */
@@ -64,6 +72,4 @@ void send_new_proxy(struct proxy_service *ps);
 struct bufferevent *connect_server(struct event_base *base, const char *name,
                                    const int port);
 
-struct bufferevent *connect_udp_server(struct event_base *base);
-
 #endif //XFRPC_CONTROL_H
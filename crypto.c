@@ -10,7 +10,12 @@
 #include <assert.h>
 #include <time.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <limits.h>
 #include <openssl/ssl.h>
+#include <event2/buffer.h>
 
 #include "fastpbkdf2.h"
 #include "crypto.h"
@@ -18,6 +23,13 @@
 #include "common.h"
 #include "debug.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__linux__) && (defined(__aarch64__) || defined(__arm__))
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 /** 
  * Default salt value used for key derivation
  */
@@ -28,6 +40,41 @@ static const char *default_salt = "frp";
  */
 static const size_t block_size = 16;
 
+/**
+ * Extents handed to the cipher per evbuffer_peek() round
+ */
+#define CRYPT_IOVECS 16
+
+/**
+ * Idle cipher contexts kept per thread
+ */
+#define CTX_POOL_SIZE 16
+
+/**
+ * PBKDF2 iterations frp derives its keys with
+ */
+#define PBKDF2_ITERATIONS 64
+
+/**
+ * Derived keys kept, one per token and salt pair in use
+ */
+#define KEY_CACHE_SIZE 4
+
+/**
+ * AEAD record layout: 2 byte length, payload, 16 byte tag. The 12 byte
+ * nonce is the record sequence number, so it never goes on the wire.
+ */
+#define AEAD_TAG_SIZE 16
+#define AEAD_NONCE_SIZE 12
+#define AEAD_OVERHEAD (2 + AEAD_TAG_SIZE)
+#define AEAD_MAX_RECORD 16384
+
+/**
+ * Direction labels mixed into the AEAD record keys
+ */
+#define AEAD_LABEL_CLIENT "xfrpc client"
+#define AEAD_LABEL_SERVER "xfrpc server"
+
 /**
  * Global encoder instance used for encryption operations
  * Initialized by init_main_encoder()
@@ -41,28 +88,70 @@ static struct frp_coder *main_encoder = NULL;
 static struct frp_coder *main_decoder = NULL;
 
 /**
- * Persistent encryption context for improved performance
- * Reused across multiple encrypt_data() calls
+ * Cipher of the control connection, agreed on at login
  */
-static EVP_CIPHER_CTX *enc_ctx = NULL;
+static int main_cipher = CIPHER_AES_128_CFB;
 
 /**
- * Persistent decryption context for improved performance
- * Reused across multiple decrypt_data() calls
+ * Cipher contexts released by finished coders of this thread, handed to
+ * the next coder instead of freeing and allocating one per connection
  */
-static EVP_CIPHER_CTX *dec_ctx = NULL;
+static __thread EVP_CIPHER_CTX *ctx_pool[CTX_POOL_SIZE];
+static __thread int ctx_pool_count;
+
+/**
+ * @brief Takes a cipher context from the pool of the calling thread
+ *
+ * @return A reset cipher context, or NULL if none could be allocated
+ */
+static EVP_CIPHER_CTX *ctx_pool_get(void)
+{
+	if (ctx_pool_count > 0) {
+		return ctx_pool[--ctx_pool_count];
+	}
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) {
+		debug(LOG_ERR, "Failed to create cipher context");
+	}
+	return ctx;
+}
+
+/**
+ * @brief Returns a cipher context to the pool of the calling thread
+ *
+ * The key schedule and stream state are wiped before the context is
+ * pooled. Contexts beyond CTX_POOL_SIZE are freed.
+ *
+ * @param ctx The cipher context, may be NULL
+ */
+static void ctx_pool_put(EVP_CIPHER_CTX *ctx)
+{
+	if (!ctx) return;
+
+	if (ctx_pool_count < CTX_POOL_SIZE && EVP_CIPHER_CTX_reset(ctx)) {
+		ctx_pool[ctx_pool_count++] = ctx;
+		return;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+}
 
 /**
  * @brief Frees all resources associated with a frp_coder structure
  *
  * This helper function safely deallocates the memory used by a frp_coder
- * structure and its members (salt and token).
+ * structure and its members (salt and token). Its cipher context goes
+ * back to the pool.
  *
  * @param coder Pointer to the frp_coder structure to be freed
  */
 static void free_frp_coder(struct frp_coder *coder)
 {
 	if (!coder) return;
+	ctx_pool_put(coder->ctx);
+	if (coder->records) {
+		evbuffer_free(coder->records);
+	}
 	SAFE_FREE(coder->salt);
 	SAFE_FREE(coder->token);
 	SAFE_FREE(coder);
@@ -92,21 +181,17 @@ static void free_all_frp_coders(void)
  *
  * This function performs complete cleanup of all crypto-related resources:
  * - Frees the main encoder and decoder
- * - Releases the encryption and decryption contexts
- * Should be called before program termination.
+ * - Releases the pooled cipher contexts of the calling thread
+ * Called when the control connection is torn down and before program
+ * termination.
  */
 void free_crypto_resources(void)
 {
 	free_all_frp_coders();
+	main_cipher = CIPHER_AES_128_CFB;
 
-	if (enc_ctx) {
-		EVP_CIPHER_CTX_free(enc_ctx);
-		enc_ctx = NULL;
-	}
-
-	if (dec_ctx) {
-		EVP_CIPHER_CTX_free(dec_ctx);
-		dec_ctx = NULL;
+	while (ctx_pool_count > 0) {
+		EVP_CIPHER_CTX_free(ctx_pool[--ctx_pool_count]);
 	}
 }
 
@@ -147,7 +232,10 @@ struct frp_coder *new_coder(const char *token, const char *salt)
 	}
 
 	encrypt_key(enc->token, strlen(enc->token), enc->salt, enc->key, block_size);
-	encrypt_iv(enc->iv, block_size);
+	if (!encrypt_iv(enc->iv, block_size)) {
+		free_frp_coder(enc);
+		return NULL;
+	}
 	return enc;
 }
 
@@ -168,6 +256,9 @@ struct frp_coder *clone_coder(const struct frp_coder *coder)
 	if (!enc) return NULL;
 
 	memcpy(enc, coder, sizeof(*coder));
+	enc->ctx = NULL;	// the clone runs a stream of its own
+	enc->records = NULL;
+	enc->seq = 0;
 	enc->token = strdup(coder->token);
 	enc->salt = strdup(coder->salt);
 
@@ -196,6 +287,9 @@ struct frp_coder *init_main_encoder()
 		struct common_conf *c_conf = get_common_config();
 		main_encoder = new_coder(c_conf->auth_token, default_salt);
 	}
+	if (main_encoder) {
+		main_encoder->cipher = main_cipher;
+	}
 	return main_encoder;
 }
 
@@ -212,7 +306,10 @@ struct frp_coder *init_main_decoder(const uint8_t *iv)
 {
 	struct common_conf *c_conf = get_common_config();
 	main_decoder = new_coder(c_conf->auth_token, default_salt);
-	memcpy(main_decoder->iv, iv, block_size);
+	if (main_decoder) {
+		memcpy(main_decoder->iv, iv, block_size);
+		main_decoder->cipher = main_cipher;
+	}
 	return main_decoder;
 }
 
@@ -266,12 +363,84 @@ int is_decoder_inited()
 	return get_main_decoder() != NULL;
 }
 
+/**
+ * @brief Derived keys of recent (token, salt, iterations) triples
+ *
+ * Token and salt do not change while xfrpc runs, so PBKDF2 only has to run
+ * once, not for every coder of every reconnect. The lock is held across a
+ * derivation: a coder created while the background precompute is running
+ * waits for its result instead of deriving the key a second time.
+ */
+struct key_cache_entry {
+	char        *token;
+	char        *salt;
+	int         iterations;
+	uint8_t     key[16];
+};
+
+static struct key_cache_entry key_cache[KEY_CACHE_SIZE];
+static int key_cache_next;	/* slot replaced by the next miss */
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Looks up a derived key, running PBKDF2-HMAC-SHA1 on a miss
+ *
+ * @param token The input token used as the password
+ * @param token_len Length of the token
+ * @param salt The salt value used in key derivation
+ * @param iterations PBKDF2 iteration count
+ * @param key Buffer receiving the 16 byte key
+ */
+static void derive_key(const char *token, size_t token_len, const char *salt,
+					   int iterations, uint8_t *key)
+{
+	pthread_mutex_lock(&key_cache_lock);
+
+	for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+		struct key_cache_entry *e = &key_cache[i];
+		if (e->token && e->iterations == iterations &&
+			strlen(e->token) == token_len && memcmp(e->token, token, token_len) == 0 &&
+			strcmp(e->salt, salt) == 0) {
+			memcpy(key, e->key, sizeof(e->key));
+			pthread_mutex_unlock(&key_cache_lock);
+			return;
+		}
+	}
+
+	fastpbkdf2_hmac_sha1((void *)token, 
+						 token_len, 
+						 (void *)salt, 
+						 strlen(salt), 
+						 iterations,
+						 (void *)key, 
+						 block_size);
+
+	// Tokens with an embedded NUL are not cached, strlen() could not match them
+	struct key_cache_entry *e = &key_cache[key_cache_next];
+	char *token_copy = strndup(token, token_len);
+	char *salt_copy = strdup(salt);
+	if (token_copy && salt_copy && strlen(token_copy) == token_len) {
+		SAFE_FREE(e->token);
+		SAFE_FREE(e->salt);
+		e->token = token_copy;
+		e->salt = salt_copy;
+		e->iterations = iterations;
+		memcpy(e->key, key, sizeof(e->key));
+		key_cache_next = (key_cache_next + 1) % KEY_CACHE_SIZE;
+	} else {
+		SAFE_FREE(token_copy);
+		SAFE_FREE(salt_copy);
+	}
+
+	pthread_mutex_unlock(&key_cache_lock);
+}
+
 /**
  * @brief Generates an encryption key using PBKDF2-HMAC-SHA1
  *
  * This function derives a cryptographic key from a token and salt using
  * PBKDF2-HMAC-SHA1 with 64 iterations. The key length is fixed at 16 bytes
- * for AES-128.
+ * for AES-128. Keys are cached, so each token and salt pair is derived once.
  *
  * @param token The input token used as the password
  * @param token_len Length of the token
@@ -287,26 +456,56 @@ unsigned char *encrypt_key(const char *token, size_t token_len, const char *salt
 		return NULL;
 	}
 
-	fastpbkdf2_hmac_sha1((void *)token, 
-						 token_len, 
-						 (void *)salt, 
-						 strlen(salt), 
-						 64,            // Number of iterations 
-						 (void *)key, 
-						 block_size);
+	derive_key(token, token_len, salt, PBKDF2_ITERATIONS, key);
 	return key;
 }
 
+/**
+ * @brief Thread body deriving the key of the configured token
+ *
+ * @param arg Unused
+ * @return Always NULL
+ */
+static void *precompute_key(void *arg)
+{
+	struct common_conf *c_conf = get_common_config();
+	const char *token = c_conf->auth_token ? c_conf->auth_token : "";
+	uint8_t key[16];
+
+	encrypt_key(token, strlen(token), default_salt, key, sizeof(key));
+	return NULL;
+}
+
+/**
+ * @brief Derives the key of the configured token in the background
+ *
+ * Started once the configuration is loaded, so the derivation overlaps
+ * with connecting and logging in. Coders created before it finishes wait
+ * for its result. Must run after daemonizing, a fork would lose the thread.
+ */
+void start_key_precompute(void)
+{
+	pthread_t tid;
+
+	if (pthread_create(&tid, NULL, precompute_key, NULL) != 0) {
+		// The first coder derives the key itself
+		debug(LOG_INFO, "Failed to start key precompute thread");
+		return;
+	}
+	pthread_detach(tid);
+}
+
 /**
  * @brief Generates a random initialization vector (IV)
  *
- * This function creates a cryptographically secure IV by generating
- * random bytes between 1 and 255. The IV is used for AES-128-CFB
- * encryption.
+ * The IV must never repeat for a token: AEAD record keys are derived
+ * from it and count nonces up from zero, so it comes from the OpenSSL
+ * CSPRNG rather than anything time based.
  *
  * @param iv_buf Buffer to store the generated IV
  * @param iv_len Length of the IV to generate (must be >= block_size)
- * @return Pointer to the generated IV buffer, or NULL if parameters are invalid
+ * @return Pointer to the generated IV buffer, or NULL if parameters are
+ *         invalid or no random bytes are available
  */
 unsigned char *encrypt_iv(unsigned char *iv_buf, size_t iv_len)
 {
@@ -314,20 +513,117 @@ unsigned char *encrypt_iv(unsigned char *iv_buf, size_t iv_len)
 		return NULL;
 	}
 
-	srand((unsigned int)time(NULL));
-	for (size_t i = 0; i < iv_len; i++) {
-		iv_buf[i] = (rand() % 254) + 1;  // Generate values between 1 and 255
+	if (RAND_bytes(iv_buf, iv_len) != 1) {
+		debug(LOG_ERR, "Failed to generate a random IV");
+		return NULL;
 	}
 
 	return iv_buf;
 }
 
+/**
+ * @brief Returns the EVP cipher of an AEAD transport cipher
+ *
+ * @param cipher One of the AEAD values of enum frp_cipher
+ * @return The EVP cipher, NULL if the cipher is not an AEAD
+ */
+static const EVP_CIPHER *aead_evp_cipher(int cipher)
+{
+	switch (cipher) {
+	case CIPHER_AES_128_GCM:
+		return EVP_aes_128_gcm();
+	case CIPHER_CHACHA20_POLY1305:
+		return EVP_chacha20_poly1305();
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * @brief Keys a cipher context for the AEAD records of a coder
+ *
+ * The record key is HMAC-SHA256 over the IV and the direction, keyed with
+ * the PBKDF2 key of the token, so the two directions never share a key
+ * and nonce even when they share an IV. AES-128-GCM uses the first 16
+ * bytes of it, ChaCha20-Poly1305 all 32.
+ *
+ * @param ctx   The cipher context
+ * @param coder The coder, its cipher is an AEAD
+ * @param enc   1 for the client to server direction, 0 for the other one
+ * @return 0 on success, -1 on failure
+ */
+static int aead_init(EVP_CIPHER_CTX *ctx, struct frp_coder *coder, int enc)
+{
+	const EVP_CIPHER *cipher = aead_evp_cipher(coder->cipher);
+	uint8_t info[16 + sizeof(AEAD_LABEL_CLIENT)];
+	uint8_t record_key[EVP_MAX_MD_SIZE];
+	unsigned int key_len = 0;
+
+	const char *label = enc ? AEAD_LABEL_CLIENT : AEAD_LABEL_SERVER;
+	memcpy(info, coder->iv, 16);
+	memcpy(info + 16, label, sizeof(AEAD_LABEL_CLIENT));
+
+	if (!cipher ||
+		!HMAC(EVP_sha256(), coder->key, sizeof(coder->key), info, sizeof(info),
+			  record_key, &key_len) ||
+		!EVP_CipherInit_ex(ctx, cipher, NULL, NULL, NULL, enc) ||
+		!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, AEAD_NONCE_SIZE, NULL) ||
+		!EVP_CipherInit_ex(ctx, NULL, NULL, record_key, NULL, enc)) {
+		debug(LOG_ERR, "Failed to initialize AEAD cipher context");
+		OPENSSL_cleanse(record_key, sizeof(record_key));
+		return -1;
+	}
+
+	OPENSSL_cleanse(record_key, sizeof(record_key));
+	return 0;
+}
+
+/**
+ * @brief Returns the cipher context of a coder, setting it up on first use
+ *
+ * A coder runs one CFB stream in one direction, so the direction is fixed
+ * by the first call.
+ *
+ * @param coder Pointer to the frp_coder structure containing key and IV
+ * @param enc 1 to encrypt, 0 to decrypt
+ * @return The cipher context, or NULL if it could not be set up
+ */
+static EVP_CIPHER_CTX *coder_ctx(struct frp_coder *coder, int enc)
+{
+	if (coder->ctx) {
+		return coder->ctx;
+	}
+
+	EVP_CIPHER_CTX *ctx = ctx_pool_get();
+	if (!ctx) {
+		return NULL;
+	}
+
+	if (coder->cipher != CIPHER_AES_128_CFB) {
+		if (aead_init(ctx, coder, enc) < 0) {
+			ctx_pool_put(ctx);
+			return NULL;
+		}
+		coder->ctx = ctx;
+		return ctx;
+	}
+
+	if (!EVP_CipherInit_ex(ctx, EVP_aes_128_cfb(), NULL, coder->key, coder->iv, enc)) {
+		debug(LOG_ERR, "Failed to initialize cipher context");
+		ctx_pool_put(ctx);
+		return NULL;
+	}
+
+	coder->ctx = ctx;
+	return ctx;
+}
+
 /**
  * @brief Encrypts data using AES-128-CFB cipher
  *
  * This function encrypts data using AES-128-CFB cipher mode with no padding.
- * It uses a persistent EVP_CIPHER_CTX context (enc_ctx) for better performance
- * across multiple calls.
+ * The CFB stream state lives in the cipher context of the encoder, so
+ * consecutive calls continue one stream.
  *
  * @param src_data Pointer to the source data buffer to encrypt
  * @param srclen Length of the source data
@@ -338,9 +634,7 @@ unsigned char *encrypt_iv(unsigned char *iv_buf, size_t iv_len)
 size_t encrypt_data(const uint8_t *src_data, size_t srclen, 
 				   struct frp_coder *encoder, uint8_t **ret)
 {
-	int outlen = 0, tmplen = 0;
 	uint8_t *outbuf = NULL;
-	EVP_CIPHER_CTX *ctx = NULL;
 	
 	// Input validation
 	if (!src_data || !encoder || !ret) {
@@ -356,40 +650,140 @@ size_t encrypt_data(const uint8_t *src_data, size_t srclen,
 	}
 	*ret = outbuf;
 
-	// Initialize or reuse encryption context
-	if (!enc_ctx) {
-		enc_ctx = EVP_CIPHER_CTX_new();
-		if (!enc_ctx) {
-			debug(LOG_ERR, "Failed to create cipher context");
+	memcpy(outbuf, src_data, srclen);
+	return encrypt_data_inplace(outbuf, srclen, encoder);
+}
+
+/**
+ * @brief Runs a CFB context over a buffer in place
+ *
+ * CFB is a stream mode: every byte goes out as soon as it is fed, so no
+ * EVP_*Final_ex call is needed and the context simply carries on with the
+ * next buffer of the stream.
+ *
+ * @param ctx  Encryption or decryption context
+ * @param data Buffer transformed in place
+ * @param len  Length of the data
+ * @return 0 on success, -1 on failure
+ */
+static int cfb_update(EVP_CIPHER_CTX *ctx, uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		int chunk = len > INT_MAX ? INT_MAX : (int)len;
+		int outlen = 0;
+
+		if (!EVP_CipherUpdate(ctx, data, &outlen, data, chunk) || outlen != chunk) {
+			debug(LOG_ERR, "EVP_CipherUpdate error!");
+			return -1;
+		}
+		data += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/**
+ * @brief Runs a CFB context over a range of an evbuffer in place
+ *
+ * Walks the extents of the range with evbuffer_peek(), so the data is
+ * neither linearized nor copied.
+ *
+ * @param ctx    Encryption or decryption context
+ * @param buf    The evbuffer holding the data
+ * @param offset Start of the range
+ * @param len    Length of the range
+ * @return The length of the range, or 0 on failure
+ */
+static size_t cfb_update_buffer(EVP_CIPHER_CTX *ctx, struct evbuffer *buf,
+								size_t offset, size_t len)
+{
+	struct evbuffer_iovec vecs[CRYPT_IOVECS];
+	struct evbuffer_ptr pos;
+	size_t done = 0;
+
+	if (evbuffer_get_length(buf) < offset + len ||
+		evbuffer_ptr_set(buf, &pos, offset, EVBUFFER_PTR_SET) < 0) {
+		debug(LOG_ERR, "Invalid evbuffer range %zu+%zu", offset, len);
+		return 0;
+	}
+
+	while (done < len) {
+		int n = evbuffer_peek(buf, len - done, &pos, vecs, CRYPT_IOVECS);
+		if (n <= 0) {
+			return 0;
+		}
+
+		for (int i = 0; i < n && i < CRYPT_IOVECS && done < len; i++) {
+			size_t chunk = vecs[i].iov_len < len - done ? vecs[i].iov_len : len - done;
+			if (cfb_update(ctx, vecs[i].iov_base, chunk) < 0) {
+				return 0;
+			}
+			done += chunk;
+		}
+
+		if (done < len && evbuffer_ptr_set(buf, &pos, offset + done, EVBUFFER_PTR_SET) < 0) {
 			return 0;
 		}
-		EVP_EncryptInit_ex(enc_ctx, EVP_aes_128_cfb(), NULL, 
-						  encoder->key, encoder->iv);
 	}
-	ctx = enc_ctx;
+	return len;
+}
 
-	// Perform encryption
-	if (!EVP_EncryptUpdate(ctx, outbuf, &tmplen, src_data, srclen)) {
-		debug(LOG_ERR, "EVP_EncryptUpdate error!");
+/**
+ * @brief Encrypts data in place using AES-128-CFB cipher
+ *
+ * CFB is a stream mode, so the ciphertext has the length of the plaintext
+ * and can overwrite it. Uses the same encoder context as encrypt_data(),
+ * the two can be mixed on one stream.
+ *
+ * @param data Buffer holding the plaintext, overwritten with the ciphertext
+ * @param len Length of the data
+ * @param encoder Pointer to the frp_coder structure containing key and IV
+ * @return The length of the encrypted data, or 0 if encryption fails
+ */
+size_t encrypt_data_inplace(uint8_t *data, size_t len, struct frp_coder *encoder)
+{
+	if (!data || !encoder) {
+		debug(LOG_ERR, "Invalid input parameters");
 		return 0;
 	}
-	outlen = tmplen;
 
-	if (!EVP_EncryptFinal_ex(ctx, outbuf + outlen, &tmplen)) {
-		debug(LOG_ERR, "EVP_EncryptFinal_ex error!");
+	EVP_CIPHER_CTX *ctx = coder_ctx(encoder, 1);
+	if (!ctx || cfb_update(ctx, data, len) < 0) {
+		return 0;
+	}
+	return len;
+}
+
+/**
+ * @brief Decrypts a range of an evbuffer in place using AES-128-CFB cipher
+ *
+ * @param buf Evbuffer holding the ciphertext
+ * @param offset Start of the range to decrypt
+ * @param len Length of the range
+ * @param decoder Pointer to the frp_coder structure containing key and IV
+ * @return The length of the decrypted data, or 0 if decryption fails
+ */
+size_t decrypt_buffer(struct evbuffer *buf, size_t offset, size_t len,
+					  struct frp_coder *decoder)
+{
+	if (!buf || !decoder) {
+		debug(LOG_ERR, "Invalid input parameters");
 		return 0;
 	}
-	outlen += tmplen;
 
-	return outlen;
+	EVP_CIPHER_CTX *ctx = coder_ctx(decoder, 0);
+	if (!ctx) {
+		return 0;
+	}
+	return cfb_update_buffer(ctx, buf, offset, len);
 }
 
 /**
  * @brief Decrypts data using AES-128-CFB cipher
  *
  * This function decrypts data that was encrypted using AES-128-CFB cipher mode.
- * It uses a persistent EVP_CIPHER_CTX context (dec_ctx) for better performance
- * across multiple calls.
+ * The CFB stream state lives in the cipher context of the decoder, so
+ * consecutive calls continue one stream.
  *
  * @param enc_data Pointer to the encrypted data buffer
  * @param enclen Length of the encrypted data
@@ -400,9 +794,7 @@ size_t encrypt_data(const uint8_t *src_data, size_t srclen,
 size_t decrypt_data(const uint8_t *enc_data, size_t enclen, 
 				   struct frp_coder *decoder, uint8_t **ret)
 {
-	int outlen = 0, tmplen = 0;
 	uint8_t *outbuf = NULL;
-	EVP_CIPHER_CTX *ctx = NULL;
 	
 	// Input validation
 	if (!enc_data || !decoder || !ret) {
@@ -418,48 +810,320 @@ size_t decrypt_data(const uint8_t *enc_data, size_t enclen,
 	}
 	*ret = outbuf;
 
-	// Initialize or reuse decryption context
-	if (!dec_ctx) {
-		dec_ctx = EVP_CIPHER_CTX_new();
-		if (!dec_ctx) {
-			debug(LOG_ERR, "Failed to create cipher context");
+	EVP_CIPHER_CTX *ctx = coder_ctx(decoder, 0);
+	if (!ctx) {
+		return 0;
+	}
+
+	memcpy(outbuf, enc_data, enclen);
+	if (cfb_update(ctx, outbuf, enclen) < 0) {
+		return 0;
+	}
+	return enclen;
+}
+
+/**
+ * @brief Sets the nonce of the next record of a coder
+ *
+ * The nonce is the record sequence number, big endian in the last 8 of
+ * its 12 bytes. A coder never seals more than 2^64 records.
+ *
+ * @param ctx   The keyed cipher context of the coder
+ * @param coder The coder
+ * @param enc   1 when sealing, 0 when opening
+ * @return 0 on success, -1 on failure
+ */
+static int aead_next_nonce(EVP_CIPHER_CTX *ctx, struct frp_coder *coder, int enc)
+{
+	uint8_t nonce[AEAD_NONCE_SIZE] = {0};
+	uint64_t seq = coder->seq++;
+
+	for (int i = AEAD_NONCE_SIZE - 1; i >= AEAD_NONCE_SIZE - 8; i--) {
+		nonce[i] = seq & 0xff;
+		seq >>= 8;
+	}
+	return EVP_CipherInit_ex(ctx, NULL, NULL, NULL, nonce, enc) ? 0 : -1;
+}
+
+/**
+ * @brief Seals data into AEAD records appended to an evbuffer
+ *
+ * A record is the 2 byte big endian length of its payload, the encrypted
+ * payload and the 16 byte tag. The length is authenticated as additional
+ * data. Each record is sealed straight into space reserved in out.
+ *
+ * @param encoder Encoder with an AEAD cipher
+ * @param data    Plaintext
+ * @param len     Length of the plaintext
+ * @param out     Evbuffer the records are appended to
+ * @return Number of bytes appended to out, 0 on failure
+ */
+size_t seal_records(struct frp_coder *encoder, const uint8_t *data, size_t len,
+					struct evbuffer *out)
+{
+	if (!encoder || !data || !out) {
+		debug(LOG_ERR, "Invalid input parameters");
+		return 0;
+	}
+
+	EVP_CIPHER_CTX *ctx = coder_ctx(encoder, 1);
+	if (!ctx) {
+		return 0;
+	}
+
+	size_t sealed = 0;
+	while (len > 0) {
+		size_t chunk = len > AEAD_MAX_RECORD ? AEAD_MAX_RECORD : len;
+		struct evbuffer_iovec vec;
+		int outlen = 0;
+
+		if (evbuffer_reserve_space(out, chunk + AEAD_OVERHEAD, &vec, 1) != 1) {
+			debug(LOG_ERR, "Failed to reserve space for AEAD record");
+			return 0;
+		}
+
+		uint8_t *rec = vec.iov_base;
+		rec[0] = chunk >> 8;
+		rec[1] = chunk & 0xff;
+
+		if (aead_next_nonce(ctx, encoder, 1) < 0 ||
+			!EVP_EncryptUpdate(ctx, NULL, &outlen, rec, 2) ||
+			!EVP_EncryptUpdate(ctx, rec + 2, &outlen, data, chunk) ||
+			!EVP_EncryptFinal_ex(ctx, rec + 2 + outlen, &outlen) ||
+			!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE,
+								 rec + 2 + chunk)) {
+			debug(LOG_ERR, "Failed to seal AEAD record");
+			return 0;
+		}
+
+		vec.iov_len = chunk + AEAD_OVERHEAD;
+		if (evbuffer_commit_space(out, &vec, 1) < 0) {
 			return 0;
 		}
-		EVP_DecryptInit_ex(dec_ctx, EVP_aes_128_cfb(), NULL, 
-						  decoder->key, decoder->iv);
+
+		data += chunk;
+		len -= chunk;
+		sealed += chunk + AEAD_OVERHEAD;
 	}
-	ctx = dec_ctx;
+	return sealed;
+}
 
-	// Perform decryption
-	if (!EVP_DecryptUpdate(ctx, outbuf, &tmplen, enc_data, enclen)) {
-		debug(LOG_ERR, "EVP_DecryptUpdate error!");
-		return 0;
+/**
+ * @brief Opens the complete AEAD records of a stream chunk
+ *
+ * Partial records are kept in the decoder until the rest arrives. A
+ * record failing authentication ends the stream: nothing after it can be
+ * trusted.
+ *
+ * @param decoder Decoder with an AEAD cipher
+ * @param data    Received stream data
+ * @param len     Length of the data
+ * @param out     Evbuffer the plaintext is appended to
+ * @return Number of plaintext bytes appended to out, -1 on failure
+ */
+int open_records(struct frp_coder *decoder, const uint8_t *data, size_t len,
+				 struct evbuffer *out)
+{
+	if (!decoder || !data || !out) {
+		debug(LOG_ERR, "Invalid input parameters");
+		return -1;
+	}
+
+	EVP_CIPHER_CTX *ctx = coder_ctx(decoder, 0);
+	if (!ctx) {
+		return -1;
+	}
+
+	if (!decoder->records && !(decoder->records = evbuffer_new())) {
+		debug(LOG_ERR, "Failed to allocate AEAD record buffer");
+		return -1;
+	}
+	if (evbuffer_add(decoder->records, data, len) < 0) {
+		return -1;
 	}
-	outlen = tmplen;
 
-	if (!EVP_DecryptFinal_ex(ctx, outbuf + outlen, &tmplen)) {
-		debug(LOG_ERR, "EVP_DecryptFinal_ex error");
+	int opened = 0;
+	for (;;) {
+		size_t avail = evbuffer_get_length(decoder->records);
+		uint8_t hdr[2];
+
+		if (avail < sizeof(hdr)) {
+			break;
+		}
+		evbuffer_copyout(decoder->records, hdr, sizeof(hdr));
+
+		size_t chunk = (hdr[0] << 8) | hdr[1];
+		if (chunk == 0 || chunk > AEAD_MAX_RECORD) {
+			debug(LOG_ERR, "Invalid AEAD record length %zu", chunk);
+			return -1;
+		}
+		if (avail < chunk + AEAD_OVERHEAD) {
+			break;
+		}
+
+		uint8_t *rec = evbuffer_pullup(decoder->records, chunk + AEAD_OVERHEAD);
+		struct evbuffer_iovec vec;
+		int outlen = 0;
+
+		if (!rec || evbuffer_reserve_space(out, chunk, &vec, 1) != 1) {
+			debug(LOG_ERR, "Failed to reserve space for AEAD record");
+			return -1;
+		}
+
+		if (aead_next_nonce(ctx, decoder, 0) < 0 ||
+			!EVP_DecryptUpdate(ctx, NULL, &outlen, rec, 2) ||
+			!EVP_DecryptUpdate(ctx, vec.iov_base, &outlen, rec + 2, chunk) ||
+			!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE,
+								 rec + 2 + chunk) ||
+			EVP_DecryptFinal_ex(ctx, (uint8_t *)vec.iov_base + outlen, &outlen) <= 0) {
+			// Uncommitted, the forged plaintext never reaches out
+			debug(LOG_ERR, "AEAD record failed authentication");
+			return -1;
+		}
+
+		vec.iov_len = chunk;
+		if (evbuffer_commit_space(out, &vec, 1) < 0) {
+			return -1;
+		}
+		evbuffer_drain(decoder->records, chunk + AEAD_OVERHEAD);
+		opened += chunk;
+	}
+	return opened;
+}
+
+/**
+ * @brief Tells whether a coder frames its stream as AEAD records
+ *
+ * @param coder The coder
+ * @return 1 for AEAD records, 0 for the plain CFB stream
+ */
+int is_aead_coder(const struct frp_coder *coder)
+{
+	return coder && coder->cipher != CIPHER_AES_128_CFB;
+}
+
+/**
+ * @brief Tells whether the CPU has AES instructions
+ *
+ * @return 1 if AES runs in hardware, 0 if not or unknown
+ */
+static int has_aes_hw(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
 		return 0;
 	}
-	outlen += tmplen;
+	return (ecx & bit_AES) != 0;
+#elif defined(__linux__) && defined(__aarch64__) && defined(HWCAP_AES)
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__linux__) && defined(__arm__) && defined(HWCAP2_AES)
+	return (getauxval(AT_HWCAP2) & HWCAP2_AES) != 0;
+#else
+	return 0;
+#endif
+}
+
+static const struct {
+	int         cipher;
+	const char  *name;
+} cipher_names[] = {
+	{ CIPHER_AES_128_CFB,       "aes-128-cfb" },
+	{ CIPHER_AES_128_GCM,       "aes-128-gcm" },
+	{ CIPHER_CHACHA20_POLY1305, "chacha20-poly1305" },
+	{ CIPHER_AUTO,              "auto" },
+};
+
+/**
+ * @brief Parses a transport_cipher setting
+ *
+ * @param name Cipher name, "cfb" is accepted for aes-128-cfb
+ * @return The enum frp_cipher value, -1 if the name is unknown
+ */
+int parse_transport_cipher(const char *name)
+{
+	if (!name) return -1;
+	if (strcmp(name, "cfb") == 0) return CIPHER_AES_128_CFB;
+
+	for (size_t i = 0; i < sizeof(cipher_names) / sizeof(cipher_names[0]); i++) {
+		if (strcmp(name, cipher_names[i].name) == 0) {
+			return cipher_names[i].cipher;
+		}
+	}
+	return -1;
+}
 
-	return outlen;
+/**
+ * @brief Returns the name of a transport cipher, as offered at login
+ *
+ * @param cipher The enum frp_cipher value
+ * @return The name, "aes-128-cfb" for unknown values
+ */
+const char *transport_cipher_name(int cipher)
+{
+	for (size_t i = 0; i < sizeof(cipher_names) / sizeof(cipher_names[0]); i++) {
+		if (cipher_names[i].cipher == cipher) {
+			return cipher_names[i].name;
+		}
+	}
+	return cipher_names[0].name;
+}
+
+/**
+ * @brief Resolves the automatic transport cipher choice
+ *
+ * AES-128-GCM where the CPU has AES instructions, ChaCha20-Poly1305 on
+ * the many routers without them, where it is several times faster than
+ * table based AES.
+ *
+ * @param cipher A parsed transport_cipher setting
+ * @return The cipher to offer to the server
+ */
+int resolve_transport_cipher(int cipher)
+{
+	if (cipher != CIPHER_AUTO) {
+		return cipher;
+	}
+	return has_aes_hw() ? CIPHER_AES_128_GCM : CIPHER_CHACHA20_POLY1305;
+}
+
+/**
+ * @brief Sets the control connection cipher from the login response
+ *
+ * The AEAD cipher offered at login is used only if the server names it in
+ * its response. Stock frps does not, and the connection keeps to CFB.
+ *
+ * @param accepted Cipher named by the server, NULL if none
+ */
+void set_main_cipher(const char *accepted)
+{
+	struct common_conf *c_conf = get_common_config();
+	int offered = c_conf->transport_cipher;
+
+	main_cipher = CIPHER_AES_128_CFB;
+	if (offered == CIPHER_AES_128_CFB) {
+		return;
+	}
+
+	if (accepted && strcmp(accepted, transport_cipher_name(offered)) == 0) {
+		main_cipher = offered;
+		debug(LOG_INFO, "Control connection uses %s", accepted);
+	} else {
+		debug(LOG_INFO, "Server does not support %s, using aes-128-cfb",
+			  transport_cipher_name(offered));
+	}
 }
 
 /**
  * @brief Frees a frp_coder structure and its members
  * 
  * This function safely frees all memory associated with a frp_coder structure,
- * including its token and salt members. It uses the SAFE_FREE macro to handle
- * NULL pointers gracefully.
+ * including its token and salt members, and pools its cipher context. It
+ * handles NULL pointers gracefully.
  *
  * @param encoder Pointer to the frp_coder structure to be freed. Can be NULL.
  */
 void free_encoder(struct frp_coder *encoder) 
 {
-	if (encoder) {
-		SAFE_FREE(encoder->token);
-		SAFE_FREE(encoder->salt);
-		SAFE_FREE(encoder);
-	}
+	free_frp_coder(encoder);
 }
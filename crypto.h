@@ -11,9 +11,22 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <openssl/evp.h>
 
 #include "common.h"
 
+struct evbuffer;
+
+/**
+ * @brief Ciphers of the encrypted control connection
+ */
+enum frp_cipher {
+	CIPHER_AES_128_CFB = 0,     /**< frp stream cipher, the one stock frps speaks */
+	CIPHER_AES_128_GCM,         /**< AEAD records, for CPUs with AES instructions */
+	CIPHER_CHACHA20_POLY1305,   /**< AEAD records, for CPUs without them */
+	CIPHER_AUTO,                /**< AEAD picked by a CPU feature probe */
+};
+
 /**
  * @brief Structure for FRP encryption/decryption operations
  */
@@ -22,6 +35,10 @@ struct frp_coder {
 	char        *salt;      /**< Salt value for key derivation */
 	uint8_t     iv[16];     /**< Initialization vector */
 	char        *token;     /**< Authentication token */
+	EVP_CIPHER_CTX *ctx;    /**< Stream state, set up on first use */
+	int         cipher;     /**< enum frp_cipher, never CIPHER_AUTO */
+	uint64_t    seq;        /**< Nonce of the next AEAD record */
+	struct evbuffer *records; /**< Partial AEAD records received */
 };
 
 /**
@@ -84,6 +101,11 @@ struct frp_coder *new_coder(const char *token, const char *salt);
  */
 uint8_t *encrypt_key(const char *token, size_t token_len, const char *salt, uint8_t *key, size_t key_len);
 
+/**
+ * @brief Derive the key of the configured token in a background thread
+ */
+void start_key_precompute(void);
+
 /**
  * @brief Encrypt initialization vector
  * @param iv_buf IV buffer
@@ -102,6 +124,79 @@ uint8_t *encrypt_iv(uint8_t *iv_buf, size_t iv_len);
  */
 size_t encrypt_data(const uint8_t *src_data, size_t srclen, struct frp_coder *encoder, uint8_t **ret);
 
+/**
+ * @brief Encrypt data in place using specified encoder
+ * @param data Buffer holding plaintext, overwritten with ciphertext
+ * @param len Data length
+ * @param encoder Encoder structure
+ * @return Size of encrypted data
+ */
+size_t encrypt_data_inplace(uint8_t *data, size_t len, struct frp_coder *encoder);
+
+/**
+ * @brief Decrypt a range of an evbuffer in place
+ * @param buf Evbuffer holding ciphertext
+ * @param offset Start of the range
+ * @param len Length of the range
+ * @param decoder Decoder structure
+ * @return Size of decrypted data, 0 on failure
+ */
+size_t decrypt_buffer(struct evbuffer *buf, size_t offset, size_t len, struct frp_coder *decoder);
+
+/**
+ * @brief Seal data into AEAD records appended to an evbuffer
+ * @param encoder Encoder with an AEAD cipher
+ * @param data Plaintext
+ * @param len Plaintext length
+ * @param out Evbuffer receiving the records
+ * @return Bytes appended, 0 on failure
+ */
+size_t seal_records(struct frp_coder *encoder, const uint8_t *data, size_t len, struct evbuffer *out);
+
+/**
+ * @brief Open the complete AEAD records of received stream data
+ * @param decoder Decoder with an AEAD cipher
+ * @param data Received data
+ * @param len Data length
+ * @param out Evbuffer receiving the plaintext
+ * @return Plaintext bytes appended, -1 on failure
+ */
+int open_records(struct frp_coder *decoder, const uint8_t *data, size_t len, struct evbuffer *out);
+
+/**
+ * @brief Check if a coder uses AEAD records
+ * @param coder Coder structure
+ * @return 1 for AEAD, 0 for the CFB stream
+ */
+int is_aead_coder(const struct frp_coder *coder);
+
+/**
+ * @brief Parse a transport cipher name
+ * @param name Cipher name
+ * @return enum frp_cipher value, -1 if unknown
+ */
+int parse_transport_cipher(const char *name);
+
+/**
+ * @brief Get the name of a transport cipher
+ * @param cipher enum frp_cipher value
+ * @return Cipher name
+ */
+const char *transport_cipher_name(int cipher);
+
+/**
+ * @brief Resolve CIPHER_AUTO by probing the CPU
+ * @param cipher enum frp_cipher value
+ * @return The cipher to offer
+ */
+int resolve_transport_cipher(int cipher);
+
+/**
+ * @brief Set the control connection cipher from the login response
+ * @param accepted Cipher named by the server, NULL if none
+ */
+void set_main_cipher(const char *accepted);
+
 /**
  * @brief Get main encoder instance
  * @return Pointer to main encoder
@@ -127,7 +222,7 @@ size_t get_block_size(void);
 void free_encoder(struct frp_coder *encoder);
 
 /**
- * @brief Free EVP cipher context
+ * @brief Free the main coders and the pooled cipher contexts of this thread
  */
 void free_crypto_resources(void);
 
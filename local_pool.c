@@ -0,0 +1,285 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * Copyright (c) 2023 Dengfeng Liu <liudf0716@gmail.com>
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "uthash.h"
+#include "client.h"
+#include "control.h"
+#include "local_pool.h"
+
+enum pool_slot_state {
+	SLOT_EMPTY,
+	SLOT_CONNECTING,
+	SLOT_READY,         /* connected, waiting to be taken */
+};
+
+struct local_pool;
+
+struct pool_slot {
+	struct local_pool   *pool;
+	struct bufferevent  *bev;
+	enum pool_slot_state state;
+};
+
+/**
+ * @brief Local connections of one proxy kept ready on one event loop
+ *
+ * A pooled connection is handed out once and never comes back: a local
+ * service may tie state to a connection, so one that carried a user
+ * connection is not reused for another.
+ */
+struct local_pool {
+	struct proxy_service *ps;       /* key */
+	struct event_base    *base;
+	struct pool_slot     *slots;    /* ps->local_pool_size of them */
+	int                  failures;  /* refills failed in a row */
+	struct event         *retry_ev; /* refill after a failure */
+	UT_hash_handle       hh;
+};
+
+/* Loops never share connections, so every thread has its own pools */
+static __thread struct local_pool *local_pools;
+
+static void local_pool_refill(struct local_pool *pool);
+
+/**
+ * @brief Closes the connection of a slot, if any, and empties it
+ *
+ * @param slot The slot
+ */
+static void drop_slot(struct pool_slot *slot)
+{
+	if (slot->bev) {
+		bufferevent_free(slot->bev);
+		slot->bev = NULL;
+	}
+	slot->state = SLOT_EMPTY;
+}
+
+/**
+ * @brief Backs off after a pooled connection failed
+ *
+ * Refills are retried after 1, 2, 4... seconds. After LOCAL_POOL_RETRIES
+ * failed refills in a row the pool waits for its next use instead.
+ *
+ * @param pool The pool
+ */
+static void pool_failed(struct local_pool *pool)
+{
+	// Slots failing together count once
+	if (evtimer_pending(pool->retry_ev, NULL) || pool->failures > LOCAL_POOL_RETRIES) {
+		return;
+	}
+
+	if (++pool->failures > LOCAL_POOL_RETRIES) {
+		debug(LOG_INFO, "Local pool of proxy [%s]: %d refills failed, refilling on next use",
+			  pool->ps->proxy_name, LOCAL_POOL_RETRIES);
+		return;
+	}
+
+	struct timeval tv = { 1 << (pool->failures - 1), 0 };
+	evtimer_add(pool->retry_ev, &tv);
+}
+
+/**
+ * @brief Timer refilling a pool after a failure
+ *
+ * @param fd Unused
+ * @param what Unused
+ * @param arg The local_pool
+ */
+static void pool_retry_cb(evutil_socket_t fd, short what, void *arg)
+{
+	local_pool_refill(arg);
+}
+
+/**
+ * @brief Event callback of a pooled connection
+ *
+ * A connection becomes ready once connected and is rotated out after
+ * local_pool_idle seconds unused. Anything else, a failed connect or the
+ * local service closing it, counts as a failure.
+ *
+ * @param bev The pooled connection
+ * @param what Type of event that occurred
+ * @param ctx The pool_slot holding the connection
+ */
+static void pool_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct pool_slot *slot = ctx;
+	struct local_pool *pool = slot->pool;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		struct timeval idle = { pool->ps->local_pool_idle, 0 };
+		slot->state = SLOT_READY;
+		bufferevent_set_timeouts(bev, &idle, NULL);
+		return;
+	}
+
+	int rotated = (what & BEV_EVENT_TIMEOUT) && slot->state == SLOT_READY;
+	drop_slot(slot);
+
+	if (rotated) {
+		pool->failures = 0;
+		local_pool_refill(pool);
+	} else {
+		debug(LOG_DEBUG, "Local pool of proxy [%s]: connection failed or closed (0x%x)",
+			  pool->ps->proxy_name, what);
+		pool_failed(pool);
+	}
+}
+
+/**
+ * @brief Opens connections to the local service for the empty slots of a pool
+ *
+ * Connects run asynchronously; slots become ready in pool_event_cb().
+ *
+ * @param pool The pool
+ */
+static void local_pool_refill(struct local_pool *pool)
+{
+	struct proxy_service *ps = pool->ps;
+
+	if (pool->failures > LOCAL_POOL_RETRIES) {
+		return;
+	}
+
+	for (int i = 0; i < ps->local_pool_size; i++) {
+		struct pool_slot *slot = &pool->slots[i];
+		if (slot->state != SLOT_EMPTY) {
+			continue;
+		}
+
+		slot->bev = connect_server(pool->base, ps->local_ip, ps->local_port);
+		if (!slot->bev) {
+			pool_failed(pool);
+			return;
+		}
+
+		// Data a server-first protocol sends early stays queued in the input
+		slot->state = SLOT_CONNECTING;
+		bufferevent_setcb(slot->bev, NULL, NULL, pool_event_cb, slot);
+		bufferevent_enable(slot->bev, EV_READ);
+	}
+}
+
+/**
+ * @brief Returns the pool of a proxy on the calling thread, creating it on first use
+ *
+ * @param ps The proxy service
+ * @param base Event loop of the calling thread
+ * @return The pool, NULL on allocation failure
+ */
+static struct local_pool *get_local_pool(struct proxy_service *ps, struct event_base *base)
+{
+	struct local_pool *pool = NULL;
+
+	HASH_FIND_PTR(local_pools, &ps, pool);
+	if (pool) {
+		return pool;
+	}
+
+	pool = calloc(1, sizeof(struct local_pool));
+	if (!pool) {
+		debug(LOG_ERR, "Failed to allocate local pool");
+		return NULL;
+	}
+
+	pool->slots = calloc(ps->local_pool_size, sizeof(struct pool_slot));
+	pool->retry_ev = evtimer_new(base, pool_retry_cb, pool);
+	if (!pool->slots || !pool->retry_ev) {
+		debug(LOG_ERR, "Failed to allocate local pool");
+		if (pool->retry_ev) {
+			event_free(pool->retry_ev);
+		}
+		free(pool->slots);
+		free(pool);
+		return NULL;
+	}
+
+	for (int i = 0; i < ps->local_pool_size; i++) {
+		pool->slots[i].pool = pool;
+	}
+	pool->ps = ps;
+	pool->base = base;
+	HASH_ADD_PTR(local_pools, ps, pool);
+	return pool;
+}
+
+/**
+ * @brief Tells whether a pooled connection is still open
+ *
+ * The local service may have closed it since the loop last looked.
+ *
+ * @param bev The pooled connection
+ * @return 1 if open, 0 if closed or failed
+ */
+static int local_conn_alive(struct bufferevent *bev)
+{
+	char c;
+	ssize_t n = recv(bufferevent_getfd(bev), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/**
+ * @brief Takes a connected local connection of a proxy from its pool
+ *
+ * The taken slot is refilled right away. The pool of a loop fills on its
+ * first use, so that first work connection still connects by itself.
+ *
+ * @param ps The proxy service, with local_pool_size set
+ * @param base Event loop the connection is for
+ * @return A connected bufferevent with no callbacks, NULL if none is ready
+ */
+struct bufferevent *local_pool_take(struct proxy_service *ps, struct event_base *base)
+{
+	if (!ps || ps->local_pool_size <= 0) {
+		return NULL;
+	}
+
+	struct local_pool *pool = get_local_pool(ps, base);
+	if (!pool || pool->base != base) {
+		return NULL;
+	}
+
+	struct bufferevent *bev = NULL;
+	for (int i = 0; i < ps->local_pool_size && !bev; i++) {
+		struct pool_slot *slot = &pool->slots[i];
+		if (slot->state != SLOT_READY) {
+			continue;
+		}
+
+		if (!local_conn_alive(slot->bev)) {
+			drop_slot(slot);
+			continue;
+		}
+
+		bev = slot->bev;
+		slot->bev = NULL;
+		slot->state = SLOT_EMPTY;
+	}
+
+	if (bev) {
+		bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+		bufferevent_set_timeouts(bev, NULL, NULL);
+	}
+
+	// Being used again restarts a pool that gave up
+	if (pool->failures > LOCAL_POOL_RETRIES) {
+		pool->failures = 0;
+	}
+	if (!evtimer_pending(pool->retry_ev, NULL)) {
+		local_pool_refill(pool);
+	}
+
+	return bev;
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * Copyright (c) 2023 Dengfeng Liu <liudf0716@gmail.com>
+ */
+
+#ifndef XFRPC_LOCAL_POOL_H
+#define XFRPC_LOCAL_POOL_H
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+struct proxy_service;
+
+// Upper bound of local_pool_size
+#define MAX_LOCAL_POOL_SIZE 64
+
+// Default seconds a pooled local connection may stay unused
+#define LOCAL_POOL_IDLE     30
+
+// Failed refills in a row before a pool stops refilling until next used
+#define LOCAL_POOL_RETRIES  5
+
+struct bufferevent *local_pool_take(struct proxy_service *ps, struct event_base *base);
+
+#endif // XFRPC_LOCAL_POOL_H
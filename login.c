@@ -101,7 +101,7 @@ void init_login()
 	c_login->user = NULL;
 	c_login->timestamp = 0;
 	c_login->metas = NULL;
-	c_login->pool_count = 1;
+	c_login->pool_count = c_conf->pool_count;
 	c_login->privilege_key = NULL;
 	c_login->logged = 0;
 
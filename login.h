@@ -39,6 +39,7 @@ typedef struct login_resp {
 	char    *version;
 	char    *run_id;
 	char    *error;
+	char    *cipher;    // AEAD cipher accepted by the server, NULL for CFB
 } login_resp_t;
 
 // Function declarations
@@ -20,6 +20,7 @@
 #include "login.h"
 #include "client.h"
 #include "utils.h"
+#include "crypto.h"
 
 /**
  * @brief Macro to add a typed value to a JSON object
@@ -280,6 +281,16 @@ size_t login_request_marshal(char **msg)
 		JSON_MARSHAL_TYPE(j_login_req, "run_id", string, lg->run_id);
 	}
 
+	// Offer an AEAD cipher, servers that do not know it ignore the meta
+	if (cf->transport_cipher != CIPHER_AES_128_CFB) {
+		struct json_object *j_metas = json_object_new_object();
+		if (j_metas) {
+			JSON_MARSHAL_TYPE(j_metas, "xfrpc_cipher", string,
+							  transport_cipher_name(cf->transport_cipher));
+			json_object_object_add(j_login_req, "metas", j_metas);
+		}
+	}
+
 	// Convert to string
 	size_t nret = 0;
 	const char *json_str = json_object_to_json_string(j_login_req);
@@ -396,44 +407,58 @@ int new_proxy_service_marshal(const struct proxy_service *np_req, char **msg)
 }
 
 /**
- * @brief Marshals work connection data into a JSON string
+ * @brief Marshals work connection data into a caller supplied buffer
  *
- * Creates a JSON object containing work connection information and converts it to a string.
- * The resulting JSON string contains the "run_id" field from the work_conn structure.
+ * NewWorkConn is sent for every work connection the server asks for, so
+ * the JSON is written by hand instead of going through a json-c object
+ * tree. The output is a plain JSON object with the "run_id" field.
  *
  * @param work_c Pointer to the work connection structure to marshal
- * @param msg    Pointer to char pointer that will store the resulting JSON string
+ * @param buf    Buffer receiving the JSON text, not NUL terminated
+ * @param size   Size of buf
  *
- * @return Length of the marshaled string on success, 0 on failure
- *         The caller is responsible for freeing the allocated string in *msg
+ * @return Length of the marshaled string on success, 0 on failure or if
+ *         it does not fit into buf
  */
-int new_work_conn_marshal(const struct work_conn *work_c, char **msg)
+int new_work_conn_marshal(const struct work_conn *work_c, char *buf, size_t size)
 {
-	if (!work_c || !msg) {
+	static const char prefix[] = "{\"run_id\":\"";
+	static const char suffix[] = "\"}";
+	static const char hex[] = "0123456789abcdef";
+
+	if (!work_c || !buf) {
 		return 0;
 	}
 
-	struct json_object *j_new_work_conn = json_object_new_object();
-	if (!j_new_work_conn) {
+	const char *run_id = SAFE_JSON_STRING(work_c->run_id);
+	size_t len = sizeof(prefix) - 1;
+	if (size < len + sizeof(suffix) - 1) {
 		return 0;
 	}
+	memcpy(buf, prefix, len);
 
-	// Add run_id field
-	JSON_MARSHAL_TYPE(j_new_work_conn, "run_id", string, SAFE_JSON_STRING(work_c->run_id));
+	for (const unsigned char *p = (const unsigned char *)run_id; *p; p++) {
+		// Leave room for the longest escape and the suffix
+		if (len + 6 + sizeof(suffix) - 1 > size) {
+			return 0;
+		}
 
-	// Convert to JSON string
-	const char *json_str = json_object_to_json_string(j_new_work_conn);
-	int nret = 0;
-	
-	if (json_str && strlen(json_str) > 0) {
-		*msg = strdup(json_str);
-		if (*msg) {
-			nret = strlen(json_str);
+		if (*p == '"' || *p == '\\') {
+			buf[len++] = '\\';
+			buf[len++] = *p;
+		} else if (*p < 0x20) {
+			memcpy(buf + len, "\\u00", 4);
+			buf[len + 4] = hex[*p >> 4];
+			buf[len + 5] = hex[*p & 0xf];
+			len += 6;
+		} else {
+			buf[len++] = *p;
 		}
 	}
 
-	json_object_put(j_new_work_conn);
-	return nret;
+	memcpy(buf + len, suffix, sizeof(suffix) - 1);
+	len += sizeof(suffix) - 1;
+	return (int)len;
 }
 
 /**
@@ -565,6 +590,15 @@ struct login_resp *login_resp_unmarshal(const char *jres)
 		}
 	}
 
+	// Get optional cipher field, only servers supporting AEAD send it
+	struct json_object *l_cipher = NULL;
+	if (json_object_object_get_ex(j_lg_res, "cipher", &l_cipher)) {
+		const char *cipher_str = json_object_get_string(l_cipher);
+		if (cipher_str && !(lr->cipher = strdup(cipher_str))) {
+			goto error;
+		}
+	}
+
 	json_object_put(j_lg_res);
 	return lr;
 
@@ -574,6 +608,7 @@ error:
 		SAFE_FREE(lr->version);
 		SAFE_FREE(lr->run_id);
 		SAFE_FREE(lr->error);
+		SAFE_FREE(lr->cipher);
 		SAFE_FREE(lr);
 	}
 	return NULL;
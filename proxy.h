@@ -51,9 +51,13 @@ void set_ftp_data_proxy_tunnel(const char *ftp_proxy_name,
 							  struct ftp_pasv *remote_fp);
 
 // UDP proxy callbacks
-void udp_proxy_c2s_cb(struct bufferevent *bev, void *ctx);
 void udp_proxy_s2c_cb(struct bufferevent *bev, void *ctx);
-void handle_udp_packet(struct udp_packet *udp_pkt, struct proxy_client *client);
+int handle_udp_packet(struct proxy_client *client, const char *body, size_t len);
+int handle_udp_work_data(struct proxy_client *client, struct evbuffer *src);
+int udp_local_addr(struct proxy_service *ps, struct sockaddr_in *addr);
+int udp_tunnel_open(struct proxy_client *client);
+void udp_tunnel_resume(struct proxy_client *client);
+void free_udp_tunnel(struct udp_tunnel *udp);
 
 // SOCKS protocol handlers
 uint32_t handle_socks5(struct proxy_client *client, struct ring_buffer *rb, int len);
@@ -28,6 +28,8 @@
 #include "config.h"
 #include "tcpmux.h"
 #include "control.h"
+#include "resolver.h"
+#include "zip.h"
 
 /** @brief Maximum buffer size for SOCKS5 protocol data */
 #define SOCKS5_BUFFER_SIZE 2048
@@ -167,9 +169,7 @@ static struct bufferevent *socks5_proxy_connect(struct proxy_client *client, str
 		case 0x03: // Domain name
 			debug(LOG_DEBUG, "SOCKS5 connecting to domain: %s:%d", 
 				addr->addr, ntohs(addr->port));
-			connect_result = bufferevent_socket_connect_hostname(bev,
-				get_main_control()->dnsbase, AF_INET, 
-				(char *)addr->addr, ntohs(addr->port));
+			connect_result = dns_connect(bev, (char *)addr->addr, ntohs(addr->port));
 			break;
 
 		case 0x04: { // IPv6
@@ -197,7 +197,9 @@ static struct bufferevent *socks5_proxy_connect(struct proxy_client *client, str
 	}
 
 	// Setup callbacks and enable bufferevent
-	bufferevent_setcb(bev, tcp_proxy_c2s_cb, NULL, xfrp_proxy_event_cb, client);
+	bufferevent_setcb(bev, tcp_proxy_c2s_cb,
+					 get_common_config()->tcp_mux ? tmux_stream_local_write_cb : NULL,
+					 xfrp_proxy_event_cb, client);
 	bufferevent_enable(bev, EV_READ | EV_WRITE);
 
 	return bev;
@@ -228,6 +230,12 @@ uint32_t handle_ss5(struct proxy_client *client, struct ring_buffer *rb, int len
 		return len;
 	}
 
+	// Target connection still in progress, keep the data in the ring until
+	// handle_post_connection_data() flushes it
+	if (client->state == SOCKS5_INIT && client->local_proxy_bev) {
+		return bytes_processed;
+	}
+
 	// Handle initial connection request
 	if (client->state == SOCKS5_INIT && len >= 7) {
 		debug(LOG_DEBUG, "Processing initial SOCKS5 connection request, len: %d", len);
@@ -346,11 +354,13 @@ uint32_t handle_socks5(struct proxy_client *client, struct ring_buffer *rb, int
  * 1. Validates client and control connection
  * 2. Checks for available data in source buffer
  * 3. If TCP multiplexing is disabled, directly forwards data to control connection
- * 4. If TCP multiplexing is enabled, reads data into temporary buffer and writes
- *    to multiplexed stream
+ * 4. If TCP multiplexing is enabled, hands the input buffer to the multiplexed
+ *    stream, which moves the chains without copying, queueing what the
+ *    transmit scheduler cannot send yet
  * 
- * @note In multiplexing mode, if partial write occurs, the read event is disabled
- *       to prevent buffer overflow
+ * @note Reading pauses while the work connection backlog is above
+ *       TX_HIGH_WATERMARK or, in multiplexing mode, while the stream is
+ *       blocked
  */
 void tcp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
 {
@@ -370,31 +380,43 @@ void tcp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
 	struct common_conf *c_conf = get_common_config();
 	if (!c_conf->tcp_mux) {
 		struct evbuffer *dst = bufferevent_get_output(client->ctl_bev);
-		evbuffer_add_buffer(dst, src);
-		return;
-	}
-
-	uint8_t *buf = calloc(1, len);
-	if (!buf) {
-		debug(LOG_ERR, "Failed to allocate memory for buffer");
+		if (!client->zip_out) {
+			evbuffer_add_buffer(dst, src);
+		} else if (zip_compress(client->zip_out, src, dst) < 0) {
+			debug(LOG_ERR, "Failed to compress data of stream %d", client->stream_id);
+			bufferevent_trigger_event(bev, BEV_EVENT_ERROR, 0);
+			return;
+		}
+		// The work connection write callback resumes reading once it drained
+		if (evbuffer_get_length(dst) >= TX_HIGH_WATERMARK) {
+			bufferevent_disable(bev, EV_READ);
+		}
 		return;
 	}
 
-	size_t nr = bufferevent_read(bev, buf, len);
-	if (nr != len) {
-		debug(LOG_ERR, "Failed to read complete data: expected %zu, got %zu", len, nr);
-		free(buf);
-		return;
+	// Compressed data goes through a scratch buffer the stream write drains
+	if (client->zip_out) {
+		static __thread struct evbuffer *zbuf;
+		if (!zbuf && !(zbuf = evbuffer_new())) {
+			debug(LOG_ERR, "Failed to allocate compression buffer");
+			return;
+		}
+		if (zip_compress(client->zip_out, src, zbuf) < 0) {
+			debug(LOG_ERR, "Failed to compress data of stream %d", client->stream.id);
+			evbuffer_drain(zbuf, evbuffer_get_length(zbuf));
+			bufferevent_trigger_event(bev, BEV_EVENT_ERROR, 0);
+			return;
+		}
+		src = zbuf;
+		len = evbuffer_get_length(zbuf);
 	}
 
-	uint32_t written = tmux_stream_write(client->ctl_bev, buf, len, &client->stream);
-	if (written < len) {
-		debug(LOG_DEBUG, "Stream %d: Partial write %u/%zu bytes, disabling read",
+	uint32_t written = tmux_stream_write_buffer(client->ctl_bev, src, &client->stream);
+	if (written < len || tmux_stream_blocked(&client->stream)) {
+		debug(LOG_DEBUG, "Stream %d: wrote %u/%zu bytes, pausing read",
 			  client->stream.id, written, len);
-		bufferevent_disable(bev, EV_READ);
+		tmux_stream_pause(&client->stream, bev);
 	}
-
-	free(buf);
 }
 
 /**
@@ -425,7 +447,12 @@ void tcp_proxy_s2c_cb(struct bufferevent *bev, void *ctx)
 
 	if (!c_conf->tcp_mux) {
 		struct evbuffer *dst = bufferevent_get_output(client->local_proxy_bev);
-		evbuffer_add_buffer(dst, src);
+		if (!client->zip_in) {
+			evbuffer_add_buffer(dst, src);
+		} else if (zip_decompress(client->zip_in, src, dst) < 0) {
+			debug(LOG_ERR, "Corrupt compressed data from frps, closing work connection");
+			bufferevent_trigger_event(bev, BEV_EVENT_ERROR, 0);
+		}
 		return;
 	}
 
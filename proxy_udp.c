@@ -4,6 +4,11 @@
  * Copyright (c) 2023 Dengfeng Liu <liudf0716@gmail.com>
  */
 
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 
 #include "debug.h"
@@ -14,44 +19,188 @@
 #include "tcpmux.h"
 #include "control.h"
 
+#define UDP_MAX_PACKET_SIZE 1500
+#define BASE64_ENCODE_SIZE(x) ((((x) + 2) / 3) * 4)
+
+/* Largest UDPPacket message accepted from frps */
+#define UDP_MAX_MSG_SIZE    (BASE64_ENCODE_SIZE(UDP_MAX_PACKET_SIZE) + 512)
+
+/* Longest "r" address object kept to address replies */
+#define UDP_PEER_MAX        128
+
+/*
+ * frps wraps every datagram in a UDPPacket message,
+ * {"c":"<base64>","l":{...},"r":{"IP":"...","Port":n,"Zone":""}}, and
+ * expects replies to carry the same "r" object. Replies are rendered from
+ * a fixed template around the base64 content.
+ */
+static const char UDP_MSG_PREFIX[] = "{\"c\":\"";
+static const char UDP_MSG_PEER[] = "\",\"r\":";
+
+/* Datagrams moved per recvmmsg()/sendmmsg() call */
+#define UDP_BATCH           32
+
+/* Receive batches taken per readable event before yielding to other sockets */
+#define UDP_READ_ROUNDS     8
+
+/* Idle seconds after which a peer's session and its local socket go away */
+#define UDP_SESSION_IDLE    60
+
+/* Slots of the expiry wheel, one per second, more than UDP_SESSION_IDLE */
+#define UDP_WHEEL_SLOTS     64
+
+/* Most peers all UDP proxies together serve at a time, whatever the fd limit */
+#define UDP_MAX_SESSIONS    65536
+
+/**
+ * @brief One remote peer of a UDP proxy
+ *
+ * Every peer gets its own non-blocking socket connected to the local
+ * service, so whatever is read from it is a reply to that peer alone. The
+ * "r" object frps sent for the peer is both the key of the session and
+ * the address of its replies.
+ */
+struct udp_session {
+    struct udp_tunnel  *tunnel;
+    evutil_socket_t     fd;
+    struct event       *ev;                 /* read event of fd */
+    uint32_t            last_tick;          /* wheel tick of the last datagram */
+    struct udp_session *wheel_next;         /* next session in the same wheel slot */
+    size_t              peer_len;
+    char                peer[UDP_PEER_MAX]; /* "r" object with its braces */
+    UT_hash_handle      hh;
+};
+
+/**
+ * @brief State of the UDP datagrams carried by one work connection
+ *
+ * Sessions sit in a hashed timer wheel slot of the tick they expire at.
+ * Traffic only refreshes last_tick; a session found in its slot while
+ * still active is put back for its new expiry.
+ */
+struct udp_tunnel {
+    struct proxy_client *client;
+    struct sockaddr_in   addr;              /* the local service */
+    struct evbuffer     *rx;                /* partial message received from frps */
+    struct udp_session  *sessions;          /* by peer */
+    struct udp_session  *last;              /* session of the last message from frps */
+    int                  nsessions;
+    int                  paused;            /* reading stopped by flow control */
+    struct event        *tick_ev;           /* advances the wheel every second */
+    uint32_t             tick;
+    struct udp_session  *wheel[UDP_WHEEL_SLOTS];
+};
+
+/**
+ * @brief Datagrams gathered for one recvmmsg() or sendmmsg() call
+ */
+struct udp_batch {
+    struct mmsghdr  msgs[UDP_BATCH];
+    struct iovec    iov[UDP_BATCH];
+    int             count;              /* datagrams queued for sending */
+    evutil_socket_t fd;                 /* socket they are queued for */
+    uint8_t         data[UDP_BATCH][UDP_MAX_PACKET_SIZE];
+};
+
 // Base64 encoding table
 static const char BASE64_CHARS[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+static char base64_pairs[4096][2];      /* 12 bits to two characters */
+static uint8_t base64_values[256];      /* character to 6 bits, 0xff if invalid */
+static pthread_once_t base64_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t local_addr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int udp_session_cap;             /* sessions allowed across all tunnels */
+static int udp_session_total;           /* sessions open across all tunnels */
+static pthread_once_t udp_session_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Derives the process-wide session cap from the descriptor limit
+ *
+ * Every session holds a socket, so sessions may take half of
+ * RLIMIT_NOFILE. The other half stays with the control connection, TCP
+ * proxies and libevent.
+ */
+static void udp_session_cap_init(void)
+{
+    struct rlimit rl;
+    rlim_t nofile = 1024;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        nofile = rl.rlim_cur;
+    }
+    udp_session_cap = nofile / 2 > UDP_MAX_SESSIONS ? UDP_MAX_SESSIONS : (int)(nofile / 2);
+    debug(LOG_DEBUG, "UDP proxies serve at most %d peers", udp_session_cap);
+}
+
+/**
+ * @brief Takes a slot of the process-wide session cap
+ *
+ * @return 0 on success, -1 if all slots are taken
+ */
+static int udp_session_reserve(void)
+{
+    pthread_once(&udp_session_once, udp_session_cap_init);
+
+    if (__atomic_add_fetch(&udp_session_total, 1, __ATOMIC_RELAXED) > udp_session_cap) {
+        __atomic_sub_fetch(&udp_session_total, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Gives back a slot taken by udp_session_reserve()
+ */
+static void udp_session_release(void)
+{
+    __atomic_sub_fetch(&udp_session_total, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Fills the base64 lookup tables
+ */
+static void base64_init(void)
+{
+    for (int i = 0; i < 4096; i++) {
+        base64_pairs[i][0] = BASE64_CHARS[i >> 6];
+        base64_pairs[i][1] = BASE64_CHARS[i & 0x3f];
+    }
+
+    memset(base64_values, 0xff, sizeof(base64_values));
+    for (int i = 0; i < 64; i++) {
+        base64_values[(uint8_t)BASE64_CHARS[i]] = i;
+    }
+}
+
 /**
  * Encode binary data using base64 encoding
  * @param src Input binary data
  * @param srclen Length of input data
- * @param dst Output buffer for base64 encoded string
- * @return Length of encoded string or -1 on error
+ * @param dst Output buffer, BASE64_ENCODE_SIZE(srclen) bytes
+ * @return Length of encoded string
  */
-static int base64_encode(const uint8_t *src, int srclen, char *dst) 
+static size_t base64_encode(const uint8_t *src, size_t srclen, char *dst)
 {
-    if (!src || !dst || srclen < 0) return -1;
-    
-    uint32_t bits_buf = 0;
-    int bits_cnt = 0;
     char *out = dst;
 
-    while (srclen--) {
-        bits_buf = (bits_buf << 8) | *src++;
-        bits_cnt += 8;
+    pthread_once(&base64_once, base64_init);
 
-        while (bits_cnt >= 6) {
-            bits_cnt -= 6;
-            *out++ = BASE64_CHARS[(bits_buf >> bits_cnt) & 0x3f];
-        }
+    // Three bytes make two 12 bit lookups
+    for (; srclen >= 3; srclen -= 3, src += 3, out += 4) {
+        uint32_t v = (src[0] << 16) | (src[1] << 8) | src[2];
+        memcpy(out, base64_pairs[v >> 12], 2);
+        memcpy(out + 2, base64_pairs[v & 0xfff], 2);
     }
 
-    // Handle remaining bits
-    if (bits_cnt > 0) {
-        *out++ = BASE64_CHARS[(bits_buf << (6 - bits_cnt)) & 0x3f];
-        
-        // Add padding
-        while (bits_cnt < 6) {
-            *out++ = '=';
-            bits_cnt += 2;
-        }
+    if (srclen > 0) {
+        uint32_t v = (src[0] << 16) | (srclen > 1 ? src[1] << 8 : 0);
+        memcpy(out, base64_pairs[v >> 12], 2);
+        out[2] = srclen > 1 ? base64_pairs[v & 0xfff][0] : '=';
+        out[3] = '=';
+        out += 4;
     }
 
     return out - dst;
@@ -61,313 +210,723 @@ static int base64_encode(const uint8_t *src, int srclen, char *dst)
  * Decode base64 encoded string to binary data
  * @param src Input base64 encoded string
  * @param srclen Length of input string
- * @param dst Output buffer for decoded data
+ * @param dst Output buffer for decoded data, srclen / 4 * 3 bytes
  * @return Length of decoded data or -1 on error
  */
-static int base64_decode(const char *src, int srclen, uint8_t *dst)
+static int base64_decode(const char *src, size_t srclen, uint8_t *dst)
 {
-    if (!src || !dst || srclen < 0) return -1;
-
-    uint32_t bits_buf = 0;
-    int bits_cnt = 0;
+    const uint8_t *in = (const uint8_t *)src;
     uint8_t *out = dst;
 
-    while (srclen--) {
-        char c = *src++;
-        
-        if (c == '=') {
-            bits_buf <<= 6;
-            bits_cnt += 6;
-            continue;
+    pthread_once(&base64_once, base64_init);
+
+    if (srclen % 4) return -1;
+
+    // The last quad may carry padding
+    size_t full = srclen;
+    if (srclen && in[srclen - 1] == '=') {
+        full -= 4;
+    }
+
+    for (size_t i = 0; i < full; i += 4, out += 3) {
+        uint8_t a = base64_values[in[i]], b = base64_values[in[i + 1]];
+        uint8_t c = base64_values[in[i + 2]], d = base64_values[in[i + 3]];
+        if ((a | b | c | d) & 0x80) return -1;  // Invalid character
+
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        out[0] = v >> 16;
+        out[1] = v >> 8;
+        out[2] = v;
+    }
+
+    if (full < srclen) {
+        const uint8_t *q = in + full;
+        uint8_t a = base64_values[q[0]], b = base64_values[q[1]];
+        uint8_t c = q[2] == '=' ? 0 : base64_values[q[2]];
+        if ((a | b | c) & 0x80) return -1;
+
+        // Check for invalid trailing bits
+        if (q[2] == '=' ? (b & 0x0f) : (c & 0x03)) return -1;
+
+        *out++ = (a << 2) | (b >> 4);
+        if (q[2] != '=') {
+            *out++ = (b << 4) | (c >> 2);
         }
+    }
 
-        const char *p = strchr(BASE64_CHARS, c);
-        if (!p) return -1;  // Invalid character
+    return out - dst;
+}
 
-        bits_buf = (bits_buf << 6) | (p - BASE64_CHARS);
-        bits_cnt += 6;
+/**
+ * @brief Returns the resolved local address of a UDP proxy
+ *
+ * Resolved once per proxy and cached, so datagrams never wait for DNS.
+ * Lookups are serialized since any worker thread may ask first.
+ *
+ * @param ps The UDP proxy service
+ * @param addr Filled with the local address
+ * @return 0 on success, -1 if local_ip does not resolve
+ */
+int udp_local_addr(struct proxy_service *ps, struct sockaddr_in *addr)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&local_addr_lock);
+    if (!ps->udp_addr_ok) {
+        struct sockaddr_in *sin = &ps->udp_addr;
+        memset(sin, 0, sizeof(*sin));
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(ps->local_port);
+
+        const char *ip = ps->local_ip ? ps->local_ip : "127.0.0.1";
+        struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+        struct addrinfo *res = NULL;
+
+        if (inet_pton(AF_INET, ip, &sin->sin_addr) > 0) {
+            ps->udp_addr_ok = 1;
+        } else if (getaddrinfo(ip, NULL, &hints, &res) == 0 && res) {
+            sin->sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+            ps->udp_addr_ok = 1;
+        } else {
+            debug(LOG_ERR, "Failed to resolve hostname: %s", ip);
+            ret = -1;
+        }
 
-        if (bits_cnt >= 8) {
-            bits_cnt -= 8;
-            *out++ = (bits_buf >> bits_cnt) & 0xff;
+        if (res) {
+            freeaddrinfo(res);
         }
     }
+    if (ret == 0) {
+        *addr = ps->udp_addr;
+    }
+    pthread_mutex_unlock(&local_addr_lock);
 
-    // Check for invalid trailing bits
-    if (bits_buf & ((1 << bits_cnt) - 1)) {
-        return -1;
+    return ret;
+}
+
+/**
+ * @brief Returns the datagram batch of the calling thread
+ *
+ * Queued datagrams are flushed before the caller returns to the loop, so
+ * the read side of any UDP tunnel on the thread may reuse the batch.
+ *
+ * @return The batch, NULL on allocation failure
+ */
+static struct udp_batch *get_udp_batch(void)
+{
+    static __thread struct udp_batch *batch;
+
+    if (!batch && (batch = calloc(1, sizeof(struct udp_batch)))) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            batch->iov[i].iov_base = batch->data[i];
+            batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+            batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
     }
+    return batch;
+}
 
-    return out - dst;
+/**
+ * @brief Sends the datagrams queued in a batch with as few syscalls as possible
+ *
+ * UDP may drop, so datagrams the socket cannot take right now are
+ * dropped rather than buffered.
+ *
+ * @param b The batch, emptied
+ */
+static void udp_batch_flush(struct udp_batch *b)
+{
+    int sent = 0;
+
+    while (sent < b->count) {
+        int n = sendmmsg(b->fd, b->msgs + sent, b->count - sent, 0);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            debug(LOG_DEBUG, "Local udp socket busy, dropping %d datagrams", b->count - sent);
+            break;
+        }
+
+        // e.g. ECONNREFUSED left by an earlier datagram, skip the one that failed
+        debug(LOG_DEBUG, "Failed to send udp datagram to local service: %s", strerror(errno));
+        sent++;
+    }
+    b->count = 0;
 }
 
-#define UDP_MAX_PACKET_SIZE 1500
-#define BASE64_ENCODE_SIZE(x) ((((x) + 2) / 3) * 4 + 1)
+/**
+ * @brief Returns the UDP state of a work connection
+ *
+ * @param client Proxy client of a UDP work connection
+ * @return The state, NULL if the tunnel is not open
+ */
+static struct udp_tunnel *get_udp_tunnel(struct proxy_client *client)
+{
+    return client ? client->udp : NULL;
+}
 
 /**
- * @brief Decodes base64 encoded data from a source buffer to a destination buffer
+ * @brief Files a session under the wheel slot of the tick it expires at
  *
- * @param src Source evbuffer containing the base64 encoded data
- * @param dst Destination evbuffer where the decoded data will be stored
- * @return int Returns 0 on success, -1 on failure
+ * @param udp The tunnel owning the session
+ * @param s The session
  */
-static int evutil_base64_decode(struct evbuffer *src, struct evbuffer *dst)
+static void udp_wheel_insert(struct udp_tunnel *udp, struct udp_session *s)
 {
-    if (!src || !dst) return -1;
+    uint32_t slot = (s->last_tick + UDP_SESSION_IDLE) % UDP_WHEEL_SLOTS;
 
-    size_t src_len = evbuffer_get_length(src);
-    if (src_len == 0) return 0;
+    s->wheel_next = udp->wheel[slot];
+    udp->wheel[slot] = s;
+}
 
-    char *src_buf = malloc(src_len);
-    if (!src_buf) return -1;
+/**
+ * @brief Closes the socket of a session and frees it
+ *
+ * The caller has taken the session off the wheel.
+ *
+ * @param udp The tunnel owning the session
+ * @param s The session
+ */
+static void free_udp_session(struct udp_tunnel *udp, struct udp_session *s)
+{
+    HASH_DEL(udp->sessions, s);
+    if (udp->last == s) {
+        udp->last = NULL;
+    }
+    udp->nsessions--;
+    udp_session_release();
 
-    uint8_t *decode_buf = malloc(src_len); // Base64 decode is always smaller than input
-    if (!decode_buf) {
-        free(src_buf);
-        return -1;
+    if (s->ev) {
+        event_free(s->ev);
+    }
+    if (s->fd >= 0) {
+        evutil_closesocket(s->fd);
     }
+    free(s);
+}
+
+/**
+ * @brief Frees the UDP state of a work connection and closes its sockets
+ *
+ * @param udp The state, may be NULL
+ */
+void free_udp_tunnel(struct udp_tunnel *udp)
+{
+    if (!udp) return;
 
-    evbuffer_remove(src, src_buf, src_len);
-    int decode_len = base64_decode(src_buf, src_len, decode_buf);
-    
-    if (decode_len > 0 && decode_len <= UDP_MAX_PACKET_SIZE) {
-        evbuffer_add(dst, decode_buf, decode_len);
+    struct udp_session *s, *tmp;
+    HASH_ITER(hh, udp->sessions, s, tmp) {
+        free_udp_session(udp, s);
     }
 
-    free(src_buf);
-    free(decode_buf);
-    
-    return decode_len;
+    if (udp->tick_ev) {
+        event_free(udp->tick_ev);
+    }
+    if (udp->rx) {
+        evbuffer_free(udp->rx);
+    }
+    free(udp);
 }
 
 /**
- * @brief Encodes data from a source buffer to base64 format in a destination buffer
+ * @brief Advances the expiry wheel of a tunnel by one second
  *
- * @param src Source evbuffer containing data to be encoded
- * @param dst Destination evbuffer where the base64 encoded data will be stored
- * @return int Returns 0 on success, -1 on failure
+ * Sessions idle for UDP_SESSION_IDLE are closed, the others in the slot
+ * move on to their new expiry. The timer stops with the last session.
+ *
+ * @param fd Unused
+ * @param what Unused
+ * @param arg The udp_tunnel
+ */
+static void udp_tunnel_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct udp_tunnel *udp = arg;
+    uint32_t slot = ++udp->tick % UDP_WHEEL_SLOTS;
+    struct udp_session *s = udp->wheel[slot];
+
+    udp->wheel[slot] = NULL;
+    while (s) {
+        struct udp_session *next = s->wheel_next;
+
+        if (udp->tick - s->last_tick >= UDP_SESSION_IDLE) {
+            debug(LOG_DEBUG, "UDP session %.*s idle, closing", (int)s->peer_len, s->peer);
+            free_udp_session(udp, s);
+        } else {
+            udp_wheel_insert(udp, s);
+        }
+        s = next;
+    }
+
+    if (udp->nsessions == 0) {
+        event_del(udp->tick_ev);
+    }
+}
+
+static void udp_session_read_cb(evutil_socket_t fd, short what, void *arg);
+
+/**
+ * @brief Returns the session of a peer, opening it on its first datagram
  *
- * This function takes the contents of the source evbuffer, performs base64 encoding
- * on the data, and stores the resulting encoded data in the destination evbuffer.
- * The function uses the libevent evbuffer structure for buffer management.
+ * @param udp The tunnel
+ * @param peer "r" object of the peer, with its braces
+ * @param peer_len Length of the object
+ * @return The session, NULL if it cannot be opened
  */
-static int evutil_base64_encode(struct evbuffer *src, struct evbuffer *dst)
+static struct udp_session *get_udp_session(struct udp_tunnel *udp, const char *peer,
+                                           size_t peer_len)
 {
-    if (!src || !dst) return -1;
+    struct udp_session *s = udp->last;
 
-    size_t src_len = evbuffer_get_length(src);
-    if (src_len == 0) return 0;
-    if (src_len > UDP_MAX_PACKET_SIZE) return -1;
+    // Datagrams tend to come in runs from the same peer
+    if (s && s->peer_len == peer_len && memcmp(s->peer, peer, peer_len) == 0) {
+        return s;
+    }
 
-    uint8_t *src_buf = malloc(src_len);
-    if (!src_buf) return -1;
+    HASH_FIND(hh, udp->sessions, peer, peer_len, s);
+    if (s) {
+        udp->last = s;
+        return s;
+    }
 
-    size_t encode_buf_len = BASE64_ENCODE_SIZE(src_len);
-    char *encode_buf = malloc(encode_buf_len);
-    if (!encode_buf) {
-        free(src_buf);
-        return -1;
+    if (udp_session_reserve() < 0) {
+        debug(LOG_INFO, "UDP proxies at %d peers, dropping datagram of %.*s",
+              udp_session_cap, (int)peer_len, peer);
+        return NULL;
+    }
+
+    s = calloc(1, sizeof(struct udp_session));
+    if (!s) {
+        debug(LOG_ERR, "Failed to allocate udp session");
+        udp_session_release();
+        return NULL;
     }
+    s->tunnel = udp;
+    s->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    memcpy(s->peer, peer, peer_len);
+    s->peer_len = peer_len;
+
+    if (s->fd < 0) {
+        debug(LOG_ERR, "Failed to create UDP socket: %s", strerror(errno));
+    } else if (evutil_make_socket_nonblocking(s->fd) < 0) {
+        debug(LOG_ERR, "Failed to make UDP socket non-blocking: %s", strerror(errno));
+    } else if (connect(s->fd, (struct sockaddr *)&udp->addr, sizeof(udp->addr)) < 0) {
+        debug(LOG_ERR, "Failed to connect UDP socket: %s", strerror(errno));
+    } else if (!(s->ev = event_new(udp->client->base, s->fd, EV_READ | EV_PERSIST,
+                                   udp_session_read_cb, s))) {
+        debug(LOG_ERR, "Failed to allocate udp session event");
+    } else {
+        if (!udp->paused) {
+            event_add(s->ev, NULL);
+        }
+        if (udp->nsessions++ == 0) {
+            struct timeval tv = { 1, 0 };
+            event_add(udp->tick_ev, &tv);
+        }
+        s->last_tick = udp->tick;
+        HASH_ADD_KEYPTR(hh, udp->sessions, s->peer, s->peer_len, s);
+        udp_wheel_insert(udp, s);
+        udp->last = s;
 
-    evbuffer_remove(src, src_buf, src_len);
-    int encode_len = base64_encode(src_buf, src_len, encode_buf);
-    
-    if (encode_len > 0) {
-        evbuffer_add(dst, encode_buf, encode_len);
+        debug(LOG_DEBUG, "UDP session %.*s opened", (int)peer_len, peer);
+        return s;
     }
 
-    free(src_buf);
-    free(encode_buf);
-    
-    return encode_len;
+    if (s->fd >= 0) {
+        evutil_closesocket(s->fd);
+    }
+    free(s);
+    udp_session_release();
+    return NULL;
+}
+
+/**
+ * @brief Finds the string value of a key in a UDPPacket message
+ *
+ * frps encodes the message with Go's encoding/json, which puts no spaces
+ * around separators; base64 content and addresses never need escaping.
+ *
+ * @param body Message body, not NUL terminated
+ * @param len Length of the body
+ * @param key Key with quotes, colon and opening character, e.g. "\"c\":\""
+ * @param end Character closing the value
+ * @param vlen Set to the length of the value
+ * @return Start of the value, NULL if the key is missing
+ */
+static const char *udp_msg_field(const char *body, size_t len, const char *key,
+                                 char end, size_t *vlen)
+{
+    size_t klen = strlen(key);
+    const char *v = memmem(body, len, key, klen);
+    if (!v) return NULL;
+
+    v += klen;
+    const char *e = memchr(v, end, body + len - v);
+    if (!e) return NULL;
+
+    *vlen = e - v;
+    return v;
 }
 
-static int resolve_local_addr(const char *ip, struct sockaddr_in *addr) {
-    if (inet_pton(AF_INET, ip, &addr->sin_addr) > 0) {
+/**
+ * @brief Queues the datagram of a UDPPacket message for the local service
+ *
+ * The datagram goes out on the session of the peer in its "r" object,
+ * decoded straight into the batch. A full batch, or one queued for
+ * another socket, is flushed first.
+ *
+ * @param udp UDP state of the work connection
+ * @param b Batch of the calling thread
+ * @param body JSON body of the message, not necessarily NUL terminated
+ * @param len Length of the body
+ * @return 0 on success, -1 if the message is malformed
+ */
+static int queue_udp_packet(struct udp_tunnel *udp, struct udp_batch *b,
+                            const char *body, size_t len)
+{
+    size_t clen, peer_len;
+    const char *content = udp_msg_field(body, len, UDP_MSG_PREFIX + 1, '"', &clen);
+    const char *peer = udp_msg_field(body, len, "\"r\":{", '}', &peer_len);
+
+    if (!content || !peer || peer_len + 2 > UDP_PEER_MAX) {
+        debug(LOG_DEBUG, "UDP packet without content or peer, dropped");
         return 0;
     }
+    if (clen > BASE64_ENCODE_SIZE(UDP_MAX_PACKET_SIZE)) {
+        debug(LOG_ERR, "UDP packet of %zu base64 bytes too large", clen);
+        return -1;
+    }
+
+    // Keep the object with its braces
+    struct udp_session *s = get_udp_session(udp, peer - 1, peer_len + 2);
+    if (!s) {
+        return 0;
+    }
+    s->last_tick = udp->tick;
+
+    if (b->count == UDP_BATCH || (b->count > 0 && b->fd != s->fd)) {
+        udp_batch_flush(b);
+    }
 
-    struct hostent *host = gethostbyname(ip);
-    if (!host) {
-        debug(LOG_ERR, "Failed to resolve hostname: %s", ip);
+    int n = base64_decode(content, clen, b->data[b->count]);
+    if (n < 0) {
+        debug(LOG_ERR, "Base64 decoding failed");
         return -1;
     }
 
-    memcpy(&addr->sin_addr, host->h_addr, host->h_length);
+    b->fd = s->fd;
+    b->iov[b->count].iov_len = n;
+    b->count++;
     return 0;
 }
 
 /**
- * @brief Handles incoming UDP packets for proxying
- * 
- * This function processes UDP packets received from a client and handles the UDP proxy
- * protocol logic for forwarding the packet to its destination.
- * 
- * @param udp_pkt Pointer to the UDP packet structure containing packet data
- * @param client Pointer to the proxy client structure representing the connected client
- * 
- * @note The function assumes both parameters are valid non-NULL pointers
+ * @brief Sends the datagram of a UDPPacket message to the local service
+ *
+ * @param client Proxy client of the UDP work connection
+ * @param body JSON body of the message, not necessarily NUL terminated
+ * @param len Length of the body
+ * @return 0 on success, -1 if the message is malformed
  */
-void handle_udp_packet(struct udp_packet *udp_pkt, struct proxy_client *client) {
-    if (!udp_pkt || !client || !client->local_proxy_bev || !client->ps) {
+int handle_udp_packet(struct proxy_client *client, const char *body, size_t len)
+{
+    struct udp_tunnel *udp = get_udp_tunnel(client);
+    struct udp_batch *b = get_udp_batch();
+
+    if (!udp || !b) {
         debug(LOG_ERR, "Invalid parameters in handle_udp_packet");
-        return;
+        return -1;
     }
 
-    // Decode base64 content
-    struct evbuffer *base64_input = evbuffer_new();
-    struct evbuffer *decoded_output = evbuffer_new();
-    if (!base64_input || !decoded_output) {
-        debug(LOG_ERR, "Failed to create evbuffers");
-        goto cleanup;
+    int ret = queue_udp_packet(udp, b, body, len);
+    udp_batch_flush(b);
+    return ret;
+}
+
+/**
+ * @brief Processes the UDPPacket messages frps sent on a work connection
+ *
+ * Complete messages are handled in place and their datagrams go out in
+ * batches, a partial one stays until the rest arrives.
+ *
+ * @param client Proxy client of the UDP work connection
+ * @param src Data read from frps, drained
+ * @return 0 on success, -1 if the stream is malformed
+ */
+int handle_udp_work_data(struct proxy_client *client, struct evbuffer *src)
+{
+    struct udp_tunnel *udp = get_udp_tunnel(client);
+    struct udp_batch *b = get_udp_batch();
+
+    if (!udp || !b) {
+        debug(LOG_ERR, "UDP work data without an open tunnel");
+        return -1;
     }
+    evbuffer_add_buffer(udp->rx, src);
+
+    int ret = 0;
+    struct msg_hdr hdr;
+    while (evbuffer_copyout(udp->rx, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+        uint64_t body_len = msg_hton(hdr.length);
+        if (body_len > UDP_MAX_MSG_SIZE) {
+            debug(LOG_ERR, "UDP work connection message of %" PRIu64 " bytes too large",
+                  body_len);
+            ret = -1;
+            break;
+        }
+
+        size_t msg_len = sizeof(hdr) + body_len;
+        if (evbuffer_get_length(udp->rx) < msg_len) {
+            break;
+        }
 
-    size_t content_len = strlen(udp_pkt->content);
-    if (evbuffer_add(base64_input, udp_pkt->content, content_len) != 0) {
-        debug(LOG_ERR, "Failed to add content to base64_input buffer");
-        goto cleanup;
+        struct msg_hdr *msg = (struct msg_hdr *)evbuffer_pullup(udp->rx, msg_len);
+        if (msg->type == TypeUDPPacket) {
+            queue_udp_packet(udp, b, (const char *)msg->data, body_len);
+        } else {
+            debug(LOG_DEBUG, "Ignoring message type %d on udp work connection", msg->type);
+        }
+        evbuffer_drain(udp->rx, msg_len);
     }
 
-    if (evutil_base64_decode(base64_input, decoded_output) < 0) {
-        debug(LOG_ERR, "Base64 decoding failed");
-        goto cleanup;
+    udp_batch_flush(b);
+    return ret;
+}
+
+/**
+ * @brief Renders a datagram as a UDPPacket message into dst
+ *
+ * The message header, JSON template and base64 content are written into
+ * one reservation of dst; nothing is allocated per datagram.
+ *
+ * @param s Session of the peer the datagram goes to
+ * @param data Datagram
+ * @param len Length of the datagram
+ * @param dst Evbuffer the message is appended to
+ * @return Length of the message, -1 on failure
+ */
+static int render_udp_packet(struct udp_session *s, const uint8_t *data, size_t len,
+                             struct evbuffer *dst)
+{
+    size_t body_len = sizeof(UDP_MSG_PREFIX) - 1 + BASE64_ENCODE_SIZE(len) +
+                      sizeof(UDP_MSG_PEER) - 1 + s->peer_len + 1;
+    struct evbuffer_iovec vec;
+
+    if (evbuffer_reserve_space(dst, sizeof(struct msg_hdr) + body_len, &vec, 1) != 1) {
+        return -1;
     }
 
-    // Setup local address
-    struct sockaddr_in local_addr;
-    memset(&local_addr, 0, sizeof(local_addr));
-    local_addr.sin_family = AF_INET;
-    local_addr.sin_port = htons(client->ps->local_port);
+    struct msg_hdr *msg = vec.iov_base;
+    char *p = (char *)msg->data;
+    msg->type = TypeUDPPacket;
+    msg->length = msg_hton(body_len);
+
+    memcpy(p, UDP_MSG_PREFIX, sizeof(UDP_MSG_PREFIX) - 1);
+    p += sizeof(UDP_MSG_PREFIX) - 1;
+    p += base64_encode(data, len, p);
+    memcpy(p, UDP_MSG_PEER, sizeof(UDP_MSG_PEER) - 1);
+    p += sizeof(UDP_MSG_PEER) - 1;
+    memcpy(p, s->peer, s->peer_len);
+    p += s->peer_len;
+    *p = '}';
+
+    vec.iov_len = sizeof(struct msg_hdr) + body_len;
+    if (evbuffer_commit_space(dst, &vec, 1) < 0) {
+        return -1;
+    }
+    return vec.iov_len;
+}
 
-    if (resolve_local_addr(client->ps->local_ip, &local_addr) != 0) {
-        goto cleanup;
+/**
+ * @brief Sends a batch of replies read from a session to frps
+ *
+ * Each datagram is rendered as a UDPPacket message addressed to the peer
+ * of the session, straight into the work connection output, or into a
+ * scratch buffer the mux stream takes in one write.
+ *
+ * @param s Session the batch was read from
+ * @param b Batch filled by recvmmsg()
+ * @param n Number of datagrams received
+ * @return 1 if the work connection is backed up and reading should pause, 0 otherwise
+ */
+static int forward_udp_batch(struct udp_session *s, struct udp_batch *b, int n)
+{
+    struct proxy_client *client = s->tunnel->client;
+    int mux = get_common_config()->tcp_mux;
+    struct evbuffer *dst;
+
+    if (mux) {
+        static __thread struct evbuffer *scratch;
+        if (!scratch && !(scratch = evbuffer_new())) {
+            debug(LOG_ERR, "Failed to allocate udp packet buffer");
+            return 0;
+        }
+        dst = scratch;
+    } else {
+        dst = bufferevent_get_output(client->ctl_bev);
     }
 
-    // Forward decoded data
-    struct evbuffer *dst = bufferevent_get_output(client->local_proxy_bev);
-    if (evbuffer_add_buffer(dst, decoded_output) != 0) {
-        debug(LOG_ERR, "Failed to forward decoded data");
+    for (int i = 0; i < n; i++) {
+        size_t len = b->msgs[i].msg_len;
+        if (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            debug(LOG_DEBUG, "Dropping %zu bytes from local udp service", len);
+            continue;
+        }
+        if (render_udp_packet(s, b->data[i], len, dst) < 0) {
+            debug(LOG_ERR, "UDP packet rendering failed");
+            break;
+        }
     }
+    s->last_tick = s->tunnel->tick;
 
-cleanup:
-    if (base64_input) evbuffer_free(base64_input);
-    if (decoded_output) evbuffer_free(decoded_output);
+    if (!mux) {
+        return evbuffer_get_length(dst) >= TX_HIGH_WATERMARK;
+    }
+
+    if (evbuffer_get_length(dst) > 0) {
+        tmux_stream_write_buffer(client->ctl_bev, dst, &client->stream);
+    }
+    if (tmux_stream_blocked(&client->stream)) {
+        tmux_stream_pause(&client->stream, NULL);
+        return 1;
+    }
+    return 0;
 }
 
 /**
- * @brief Callback function for handling UDP proxy client-to-server data transfer
- *
- * This function processes UDP data received from a client, encodes it in base64,
- * packages it into a UDP packet structure, and forwards it to the server.
- * The data is sent either directly or through TCP multiplexing depending on configuration.
+ * @brief Stops reading the local sockets of a tunnel until udp_tunnel_resume()
  *
- * The process includes:
- * 1. Base64 encoding of received data
- * 2. Creating and populating UDP packet structure
- * 3. Marshalling packet to JSON format
- * 4. Sending data to server based on TCP multiplexing configuration
+ * @param udp The tunnel
+ */
+static void udp_tunnel_pause(struct udp_tunnel *udp)
+{
+    struct udp_session *s, *tmp;
+
+    udp->paused = 1;
+    HASH_ITER(hh, udp->sessions, s, tmp) {
+        event_del(s->ev);
+    }
+}
+
+/**
+ * @brief Read event of the local socket of a session
  *
- * @param bev Bufferevent structure containing the received data
- * @param ctx Context pointer containing proxy client information
+ * Takes the replies of the local service in batches of UDP_BATCH per
+ * recvmmsg() and stops reading while the work connection is backed up.
  *
- * @note The function handles memory cleanup for all allocated resources
- * @note The function will return early if client parameters are invalid or memory allocation fails
+ * @param fd The local UDP socket
+ * @param what Event flags
+ * @param arg The udp_session of the socket
  */
-void udp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
+static void udp_session_read_cb(evutil_socket_t fd, short what, void *arg)
 {
-    struct proxy_client *client = (struct proxy_client *)ctx;
-    if (!client || !client->ctl_bev || !client->ps) {
-        debug(LOG_ERR, "Invalid client parameters");
-        return;
-    }
+    struct udp_session *s = arg;
+    struct udp_batch *b = get_udp_batch();
 
-    struct evbuffer *src = bufferevent_get_input(bev);
-    struct evbuffer *base64_output = evbuffer_new();
-    if (!base64_output) {
-        debug(LOG_ERR, "Failed to create base64 output buffer");
+    if (!b || !s->tunnel->client->ctl_bev) {
         return;
     }
 
-    // Encode data to base64
-    if (evutil_base64_encode(src, base64_output) < 0) {
-        debug(LOG_ERR, "Base64 encoding failed");
-        evbuffer_free(base64_output);
-        return;
+    for (int round = 0; round < UDP_READ_ROUNDS; round++) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            b->iov[i].iov_len = UDP_MAX_PACKET_SIZE;
+        }
+
+        int n = recvmmsg(fd, b->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+            // A refused datagram to the local service only reports ECONNREFUSED
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR && errno != ECONNREFUSED) {
+                debug(LOG_ERR, "Failed to read local udp socket: %s", strerror(errno));
+            }
+            return;
+        }
+
+        if (forward_udp_batch(s, b, n)) {
+            udp_tunnel_pause(s->tunnel);
+            return;
+        }
+        if (n < UDP_BATCH) {
+            return;
+        }
     }
+}
 
-    // Create and populate UDP packet structure
-    struct udp_packet *udp_pkt = calloc(1, sizeof(struct udp_packet));
-    struct udp_addr *raddr = calloc(1, sizeof(struct udp_addr));
-    if (!udp_pkt || !raddr) {
-        debug(LOG_ERR, "Memory allocation failed");
-        goto cleanup;
+/**
+ * @brief Prepares the UDP state of a work connection
+ *
+ * The local address is resolved here; the sockets to the local service
+ * are opened per peer as their datagrams arrive.
+ *
+ * @param client Proxy client of a UDP work connection
+ * @return 0 on success, -1 on failure
+ */
+int udp_tunnel_open(struct proxy_client *client)
+{
+    struct udp_tunnel *udp = calloc(1, sizeof(struct udp_tunnel));
+    if (!udp) {
+        debug(LOG_ERR, "Failed to allocate udp tunnel state");
+        return -1;
     }
+    udp->client = client;
 
-    udp_pkt->content = (char *)evbuffer_pullup(base64_output, -1);
-    udp_pkt->raddr = raddr;
-    raddr->addr = client->ps->local_ip;
-    raddr->port = client->ps->local_port;
+    if (udp_local_addr(client->ps, &udp->addr) < 0) {
+        free_udp_tunnel(udp);
+        return -1;
+    }
 
-    // Marshal UDP packet to JSON
-    char *json_buf = NULL;
-    if (new_udp_packet_marshal(udp_pkt, &json_buf) < 0 || !json_buf) {
-        debug(LOG_ERR, "UDP packet marshalling failed");
-        goto cleanup;
+    if (!(udp->rx = evbuffer_new()) ||
+        !(udp->tick_ev = event_new(client->base, -1, EV_PERSIST, udp_tunnel_tick_cb, udp))) {
+        debug(LOG_ERR, "Failed to allocate udp tunnel events");
+        free_udp_tunnel(udp);
+        return -1;
     }
 
-    size_t json_len = strlen(json_buf);
-    struct common_conf *c_conf = get_common_config();
+    client->udp = udp;
+    return 0;
+}
 
-    // Send data based on TCP multiplexing configuration
-    if (!c_conf->tcp_mux) {
-        struct evbuffer *dst = bufferevent_get_output(client->ctl_bev);
-        if (evbuffer_add(dst, json_buf, json_len) < 0) {
-            debug(LOG_ERR, "Failed to add data to output buffer");
-        }
-    } else {
-        uint32_t written = tmux_stream_write(client->ctl_bev, 
-                                           (uint8_t *)json_buf, 
-                                           json_len, 
-                                           &client->stream);
-        if (written < json_len) {
-            debug(LOG_DEBUG, "Partial write on stream %d: %u/%zu bytes", 
-                  client->stream.id, written, json_len);
-            bufferevent_disable(bev, EV_READ);
-        }
+/**
+ * @brief Resumes reading the local UDP sockets of a work connection
+ *
+ * @param client Proxy client of a UDP work connection
+ */
+void udp_tunnel_resume(struct proxy_client *client)
+{
+    struct udp_tunnel *udp = get_udp_tunnel(client);
+    if (!udp || !udp->paused) {
+        return;
     }
 
-cleanup:
-    free(json_buf);
-    free(raddr);
-    free(udp_pkt);
-    evbuffer_free(base64_output);
+    struct udp_session *s, *tmp;
+    udp->paused = 0;
+    HASH_ITER(hh, udp->sessions, s, tmp) {
+        event_add(s->ev, NULL);
+    }
 }
 
 /**
  * @brief Callback function for handling data from server to client in UDP proxy
- * 
- * This function is triggered when data is received from the server and needs to be
- * forwarded to the local UDP client. It reads from the server's bufferevent and
- * writes to the client's local proxy bufferevent.
+ *
+ * Reads the UDPPacket messages frps sends on a direct work connection and
+ * forwards their datagrams to the local UDP service.
  *
  * @param bev The bufferevent structure containing data from the server
  * @param ctx Context pointer containing the proxy client structure
- *
- * @note The function will return early if client or local_proxy_bev is NULL
  */
 void udp_proxy_s2c_cb(struct bufferevent *bev, void *ctx)
 {
     struct proxy_client *client = (struct proxy_client *)ctx;
-    if (!client || !client->local_proxy_bev) {
+    if (!client || !client->udp) {
         debug(LOG_ERR, "Invalid client parameters");
         return;
     }
 
-    struct evbuffer *src = bufferevent_get_input(bev);
-    struct evbuffer *dst = bufferevent_get_output(client->local_proxy_bev);
-    
-    // Forward data from server to local UDP socket
-    if (evbuffer_add_buffer(dst, src) != 0) {
-        debug(LOG_ERR, "Failed to forward data from server to client");
+    if (handle_udp_work_data(client, bufferevent_get_input(bev)) < 0) {
+        bufferevent_trigger_event(bev, BEV_EVENT_ERROR, 0);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,786 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * Copyright (c) 2023 Dengfeng Liu <liudf0716@gmail.com>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+
+#include "debug.h"
+#include "uthash.h"
+#include "control.h"
+#include "resolver.h"
+
+/**
+ * @brief A connection waiting for its name to resolve
+ *
+ * The waiter holds a reference on the bufferevent, so it stays valid if
+ * its owner frees it in the meantime.
+ */
+struct dns_waiter {
+	struct bufferevent  *bev;
+	int                 port;
+	struct dns_waiter   *next;
+};
+
+/**
+ * @brief Cached answer for one name
+ *
+ * A and AAAA are looked up together; the entry expires with the shorter
+ * of their TTLs. Entries with lookups in flight are never evicted, the
+ * evdns callbacks point at them.
+ */
+struct dns_entry {
+	char                *name;          /* key, lower case */
+	struct dns_addrs    addrs;
+	int                 valid;          /* addrs, or a negative answer, are cached */
+	int                 negative;       /* the name does not exist */
+	int                 ttl;            /* seconds the answer was cached for */
+	time_t              expires;
+
+	int                 pending;        /* lookups in flight */
+	struct dns_addrs    fresh;          /* answers of the lookups in flight */
+	int                 fresh_ttl;
+	int                 fresh_failed;   /* a lookup failed, e.g. timed out */
+	int                 fresh_nxdomain; /* the name does not exist */
+	struct dns_waiter   *waiters;
+	UT_hash_handle      hh;
+};
+
+/* evdns resolvers are bound to a loop, so every thread caches on its own */
+static __thread struct dns_entry *dns_cache;
+static __thread int dns_cache_count;
+
+/* /etc/hosts, read once and shared read-only by all threads */
+static struct dns_entry *dns_hosts;
+static pthread_once_t dns_hosts_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Adds an address to a set, ignoring it when the family is full
+ *
+ * @param a The address set
+ * @param af AF_INET or AF_INET6
+ * @param addr struct in_addr or struct in6_addr
+ */
+static void dns_addrs_add(struct dns_addrs *a, int af, const void *addr)
+{
+	if (af == AF_INET && a->n4 < DNS_MAX_ADDRS) {
+		memcpy(&a->v4[a->n4++], addr, sizeof(struct in_addr));
+	} else if (af == AF_INET6 && a->n6 < DNS_MAX_ADDRS) {
+		memcpy(&a->v6[a->n6++], addr, sizeof(struct in6_addr));
+	}
+}
+
+/**
+ * @brief Copies a host name in lower case
+ *
+ * @param dst Buffer of at least 256 bytes
+ * @param name Host name
+ * @return 0 on success, -1 if the name is empty or too long
+ */
+static int dns_normalize(char *dst, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len > 0 && name[len - 1] == '.') {
+		len--;
+	}
+	if (len == 0 || len > 253) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		dst[i] = tolower((unsigned char)name[i]);
+	}
+	dst[len] = '\0';
+	return 0;
+}
+
+/**
+ * @brief Reads /etc/hosts into dns_hosts
+ *
+ * evdns only consults the hosts file for getaddrinfo() style lookups,
+ * which do not report TTLs, so the cache answers from it itself.
+ */
+static void dns_load_hosts(void)
+{
+	FILE *fp = fopen("/etc/hosts", "r");
+	if (!fp) {
+		return;
+	}
+
+	char line[512];
+	while (fgets(line, sizeof(line), fp)) {
+		char *hash = strchr(line, '#');
+		if (hash) {
+			*hash = '\0';
+		}
+
+		char *save = NULL;
+		char *ip = strtok_r(line, " \t\r\n", &save);
+		if (!ip) {
+			continue;
+		}
+
+		int af = strchr(ip, ':') ? AF_INET6 : AF_INET;
+		struct in6_addr addr;
+		if (inet_pton(af, ip, &addr) != 1) {
+			continue;
+		}
+
+		char *name;
+		while ((name = strtok_r(NULL, " \t\r\n", &save))) {
+			char key[256];
+			if (dns_normalize(key, name) < 0) {
+				continue;
+			}
+
+			struct dns_entry *e = NULL;
+			HASH_FIND_STR(dns_hosts, key, e);
+			if (!e) {
+				e = calloc(1, sizeof(struct dns_entry));
+				if (!e || !(e->name = strdup(key))) {
+					free(e);
+					continue;
+				}
+				e->valid = 1;
+				HASH_ADD_KEYPTR(hh, dns_hosts, e->name, strlen(e->name), e);
+			}
+			dns_addrs_add(&e->addrs, af, &addr);
+		}
+	}
+	fclose(fp);
+}
+
+/**
+ * @brief Tells whether the owner of a bufferevent gave up on it
+ *
+ * bufferevent_free() clears the callbacks; a reference held here keeps
+ * the bufferevent itself alive.
+ *
+ * @param bev The bufferevent
+ * @return 1 if it has no event callback anymore, 0 otherwise
+ */
+static int dns_bev_abandoned(struct bufferevent *bev)
+{
+	bufferevent_event_cb eventcb = NULL;
+
+	bufferevent_getcb(bev, NULL, NULL, &eventcb, NULL);
+	return eventcb == NULL;
+}
+
+struct dns_race;
+
+/**
+ * @brief One connect of a race, to one address
+ */
+struct dns_attempt {
+	struct dns_race *race;
+	evutil_socket_t fd;
+	struct event    *ev;
+};
+
+/**
+ * @brief Connects racing the addresses of a name (RFC 8305)
+ *
+ * Attempts start DNS_ATTEMPT_DELAY_MS apart, or as soon as the previous
+ * one fails, alternating families. The first connected socket is handed
+ * to the bufferevent and the other attempts are closed.
+ */
+struct dns_race {
+	struct bufferevent      *bev;       /* referenced while racing */
+	struct event            *timer;     /* starts the next attempt */
+	struct sockaddr_storage addrs[2 * DNS_MAX_ADDRS];
+	socklen_t               lens[2 * DNS_MAX_ADDRS];
+	int                     naddrs;
+	int                     next;       /* next address to try */
+	struct dns_attempt      attempts[2 * DNS_MAX_ADDRS];
+	int                     running;
+	int                     error;      /* errno of the last failed attempt */
+	char                    name[256];  /* cached name the addresses are of, if any */
+};
+
+static void dns_race_next(struct dns_race *race);
+
+/**
+ * @brief Closes an attempt
+ *
+ * @param at The attempt
+ * @param keep_fd Whether the socket was handed over and stays open
+ */
+static void dns_attempt_close(struct dns_attempt *at, int keep_fd)
+{
+	if (at->ev) {
+		event_free(at->ev);
+		at->ev = NULL;
+	}
+	if (at->fd >= 0 && !keep_fd) {
+		evutil_closesocket(at->fd);
+	}
+	at->fd = -1;
+	at->race->running--;
+}
+
+/**
+ * @brief Ends a race, closing the attempts still running
+ *
+ * @param race The race
+ */
+static void dns_race_free(struct dns_race *race)
+{
+	for (int i = 0; i < race->next; i++) {
+		if (race->attempts[i].fd >= 0) {
+			dns_attempt_close(&race->attempts[i], 0);
+		}
+	}
+	event_free(race->timer);
+	bufferevent_decref(race->bev);
+	free(race);
+}
+
+/**
+ * @brief Moves the address that won a race to the front of its cache entry
+ *
+ * Later connects to the name then try it first and only race the others
+ * when it stops answering.
+ *
+ * @param name Cached name the address belongs to, empty if none
+ * @param sa The winning address
+ */
+static void dns_remember(const char *name, const struct sockaddr *sa)
+{
+	struct dns_entry *e = NULL;
+
+	if (!name[0]) {
+		return;
+	}
+	HASH_FIND_STR(dns_cache, name, e);
+	if (!e) {
+		return;
+	}
+
+	struct dns_addrs *a = &e->addrs;
+	if (sa->sa_family == AF_INET) {
+		const struct in_addr *addr = &((const struct sockaddr_in *)sa)->sin_addr;
+		for (int i = 1; i < a->n4; i++) {
+			if (!memcmp(&a->v4[i], addr, sizeof(*addr))) {
+				a->v4[i] = a->v4[0];
+				a->v4[0] = *addr;
+				break;
+			}
+		}
+		a->prefer6 = 0;
+	} else {
+		const struct in6_addr *addr = &((const struct sockaddr_in6 *)sa)->sin6_addr;
+		for (int i = 1; i < a->n6; i++) {
+			if (!memcmp(&a->v6[i], addr, sizeof(*addr))) {
+				a->v6[i] = a->v6[0];
+				a->v6[0] = *addr;
+				break;
+			}
+		}
+		a->prefer6 = 1;
+	}
+}
+
+/**
+ * @brief Hands the winning socket of a race to its bufferevent
+ *
+ * The socket is connected already; connecting the bufferevent with no
+ * address lets it report BEV_EVENT_CONNECTED as usual.
+ *
+ * @param race The race
+ * @param at The attempt that connected
+ */
+static void dns_race_won(struct dns_race *race, struct dns_attempt *at)
+{
+	evutil_socket_t fd = at->fd;
+
+	dns_remember(race->name, (struct sockaddr *)&race->addrs[at - race->attempts]);
+	dns_attempt_close(at, 1);
+	bufferevent_setfd(race->bev, fd);
+	if (bufferevent_socket_connect(race->bev, NULL, 0) < 0) {
+		bufferevent_trigger_event(race->bev, BEV_EVENT_ERROR, BEV_OPT_DEFER_CALLBACKS);
+	}
+	dns_race_free(race);
+}
+
+/**
+ * @brief Ends a race once all its attempts failed
+ *
+ * @param race The race
+ */
+static void dns_race_lost(struct dns_race *race)
+{
+	errno = race->error;
+	bufferevent_trigger_event(race->bev, BEV_EVENT_ERROR, BEV_OPT_DEFER_CALLBACKS);
+	dns_race_free(race);
+}
+
+/**
+ * @brief Write event of an attempt: its connect completed or failed
+ *
+ * @param fd Socket of the attempt
+ * @param what Unused
+ * @param arg The dns_attempt
+ */
+static void dns_attempt_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct dns_attempt *at = arg;
+	struct dns_race *race = at->race;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (dns_bev_abandoned(race->bev)) {
+		dns_race_free(race);
+		return;
+	}
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+		err = errno;
+	}
+	if (err == 0) {
+		dns_race_won(race, at);
+		return;
+	}
+
+	race->error = err;
+	dns_attempt_close(at, 0);
+
+	// No need to wait for the delay once an attempt failed
+	dns_race_next(race);
+}
+
+/**
+ * @brief Timer of a race: the next attempt is due
+ *
+ * Once all attempts started it keeps checking whether the owner gave up,
+ * connects to unreachable addresses may take minutes to fail.
+ *
+ * @param fd Unused
+ * @param what Unused
+ * @param arg The dns_race
+ */
+static void dns_race_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct dns_race *race = arg;
+
+	if (dns_bev_abandoned(race->bev)) {
+		dns_race_free(race);
+		return;
+	}
+
+	if (race->next < race->naddrs) {
+		dns_race_next(race);
+	} else {
+		struct timeval tv = { 1, 0 };
+		evtimer_add(race->timer, &tv);
+	}
+}
+
+/**
+ * @brief Starts the next attempt of a race
+ *
+ * Addresses that fail right away are skipped. A connect that completes
+ * at once wins; one in progress is watched and the delay timer armed.
+ * The race is lost when nothing is left to try or running.
+ *
+ * @param race The race
+ */
+static void dns_race_next(struct dns_race *race)
+{
+	while (race->next < race->naddrs) {
+		int i = race->next++;
+		struct dns_attempt *at = &race->attempts[i];
+		struct sockaddr *sa = (struct sockaddr *)&race->addrs[i];
+
+		at->race = race;
+		at->fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (at->fd < 0) {
+			race->error = errno;
+			continue;
+		}
+		race->running++;
+
+		if (connect(at->fd, sa, race->lens[i]) == 0) {
+			dns_race_won(race, at);
+			return;
+		}
+		if (errno != EINPROGRESS) {
+			race->error = errno;
+			dns_attempt_close(at, 0);
+			continue;
+		}
+
+		at->ev = event_new(bufferevent_get_base(race->bev), at->fd, EV_WRITE,
+						   dns_attempt_cb, at);
+		if (!at->ev || event_add(at->ev, NULL) < 0) {
+			race->error = ENOMEM;
+			dns_attempt_close(at, 0);
+			continue;
+		}
+
+		struct timeval tv = { 0, DNS_ATTEMPT_DELAY_MS * 1000 };
+		evtimer_add(race->timer, &tv);
+		return;
+	}
+
+	if (race->running == 0) {
+		dns_race_lost(race);
+	}
+}
+
+/**
+ * @brief Starts connecting a bufferevent to the resolved addresses
+ *
+ * A single address is connected directly. Several are raced, alternating
+ * families and starting with the one that connected last, or with IPv4
+ * like the AF_INET only lookups used before. A dead address then only
+ * delays the connect by DNS_ATTEMPT_DELAY_MS, once.
+ *
+ * @param bev Bufferevent created with no socket
+ * @param a Addresses to connect to
+ * @param port Port to connect to
+ * @param name Cached name the addresses are of, NULL if none
+ * @return 0 if connecting, -1 on failure
+ */
+static int dns_connect_addrs(struct bufferevent *bev, const struct dns_addrs *a, int port,
+							 const char *name)
+{
+	struct dns_race *race = calloc(1, sizeof(struct dns_race));
+	if (!race) {
+		debug(LOG_ERR, "Failed to allocate connection race");
+		return -1;
+	}
+
+	for (int i = 0; i < a->n4 || i < a->n6; i++) {
+		for (int j = 0; j < 2; j++) {
+			int v6 = j ^ a->prefer6;
+			if (v6 && i < a->n6) {
+				struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&race->addrs[race->naddrs];
+				sin6->sin6_family = AF_INET6;
+				sin6->sin6_port = htons(port);
+				sin6->sin6_addr = a->v6[i];
+				race->lens[race->naddrs++] = sizeof(*sin6);
+			} else if (!v6 && i < a->n4) {
+				struct sockaddr_in *sin = (struct sockaddr_in *)&race->addrs[race->naddrs];
+				sin->sin_family = AF_INET;
+				sin->sin_port = htons(port);
+				sin->sin_addr = a->v4[i];
+				race->lens[race->naddrs++] = sizeof(*sin);
+			}
+		}
+	}
+
+	if (race->naddrs <= 1) {
+		int ret = race->naddrs ? bufferevent_socket_connect(bev,
+			(struct sockaddr *)&race->addrs[0], race->lens[0]) : -1;
+		free(race);
+		return ret;
+	}
+
+	race->timer = evtimer_new(bufferevent_get_base(bev), dns_race_timer_cb, race);
+	if (!race->timer) {
+		debug(LOG_ERR, "Failed to allocate connection race");
+		free(race);
+		return -1;
+	}
+	snprintf(race->name, sizeof(race->name), "%s", name ? name : "");
+	race->bev = bev;
+	bufferevent_incref(bev);
+
+	// A race lost before returning is reported like a failed connect
+	dns_race_next(race);
+	return 0;
+}
+
+/**
+ * @brief Frees a cache entry that has no lookup in flight
+ *
+ * @param e The entry
+ */
+static void dns_entry_free(struct dns_entry *e)
+{
+	HASH_DEL(dns_cache, e);
+	dns_cache_count--;
+	free(e->name);
+	free(e);
+}
+
+/**
+ * @brief Makes room in a full cache
+ *
+ * Expired entries go first; if there are none, the oldest entry without
+ * a lookup in flight does.
+ */
+static void dns_cache_evict(void)
+{
+	struct dns_entry *e, *tmp, *oldest = NULL;
+	time_t now = time(NULL);
+	int freed = 0;
+
+	HASH_ITER(hh, dns_cache, e, tmp) {
+		if (e->pending) {
+			continue;
+		}
+		if (e->expires <= now) {
+			dns_entry_free(e);
+			freed++;
+		} else if (!oldest) {
+			oldest = e;
+		}
+	}
+
+	if (!freed && oldest) {
+		dns_entry_free(oldest);
+	}
+}
+
+/**
+ * @brief Runs the connections that waited for an entry
+ *
+ * A waiter whose owner freed its bufferevent in the meantime has no
+ * event callback left and is only released. The others connect, or get
+ * BEV_EVENT_ERROR when the name did not resolve.
+ *
+ * @param e The entry
+ */
+static void dns_entry_wake(struct dns_entry *e)
+{
+	struct dns_waiter *w = e->waiters;
+	struct dns_addrs addrs = e->addrs;
+	int usable = e->valid && !e->negative;
+	char name[256];
+
+	// Callbacks may queue new waiters, or connect elsewhere and evict e
+	snprintf(name, sizeof(name), "%s", e->name);
+	e->waiters = NULL;
+	while (w) {
+		struct dns_waiter *next = w->next;
+		if (!dns_bev_abandoned(w->bev)) {
+			if (!usable || dns_connect_addrs(w->bev, &addrs, w->port, name) < 0) {
+				debug(LOG_ERR, "Failed to resolve or connect to %s:%d", name, w->port);
+				bufferevent_trigger_event(w->bev, BEV_EVENT_ERROR, 0);
+			}
+		}
+		bufferevent_decref(w->bev);
+		free(w);
+		w = next;
+	}
+}
+
+/**
+ * @brief Caches the answers once both lookups of an entry completed
+ *
+ * A failed refresh of a known name, e.g. a timeout, keeps serving the
+ * previous addresses for DNS_MIN_TTL; a failed first lookup caches
+ * nothing so the next connection asks again.
+ *
+ * @param e The entry
+ */
+static void dns_entry_complete(struct dns_entry *e)
+{
+	time_t now = time(NULL);
+
+	if (e->fresh.n4 > 0 || e->fresh.n6 > 0) {
+		int ttl = e->fresh_ttl;
+		if (ttl < DNS_MIN_TTL) ttl = DNS_MIN_TTL;
+		if (ttl > DNS_MAX_TTL) ttl = DNS_MAX_TTL;
+
+		e->addrs = e->fresh;
+		e->valid = 1;
+		e->negative = 0;
+		e->ttl = ttl;
+		e->expires = now + ttl;
+		debug(LOG_DEBUG, "DNS %s: %d IPv4, %d IPv6 addresses for %ds",
+			  e->name, e->addrs.n4, e->addrs.n6, ttl);
+	} else if (e->fresh_nxdomain || !e->fresh_failed) {
+		e->valid = 1;
+		e->negative = 1;
+		e->ttl = DNS_NEGATIVE_TTL;
+		e->expires = now + DNS_NEGATIVE_TTL;
+		debug(LOG_DEBUG, "DNS %s: no such name, cached for %ds", e->name, DNS_NEGATIVE_TTL);
+	} else if (e->valid && !e->negative) {
+		e->expires = now + DNS_MIN_TTL;
+		debug(LOG_INFO, "DNS %s: refresh failed, keeping previous addresses", e->name);
+	} else {
+		e->valid = 0;
+		e->expires = 0;
+		debug(LOG_ERR, "DNS %s: lookup failed", e->name);
+	}
+
+	dns_entry_wake(e);
+}
+
+/**
+ * @brief evdns callback of the A or AAAA lookup of an entry
+ *
+ * @param result DNS_ERR_NONE or the error
+ * @param type DNS_IPv4_A or DNS_IPv6_AAAA
+ * @param count Number of addresses
+ * @param ttl TTL of the answer in seconds
+ * @param addresses Array of struct in_addr or struct in6_addr
+ * @param arg The dns_entry
+ */
+static void dns_answer_cb(int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+	struct dns_entry *e = arg;
+
+	if (result == DNS_ERR_NONE) {
+		int af = type == DNS_IPv6_AAAA ? AF_INET6 : AF_INET;
+		size_t size = af == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+
+		for (int i = 0; i < count; i++) {
+			dns_addrs_add(&e->fresh, af, (const char *)addresses + i * size);
+		}
+		if (count > 0 && (e->fresh_ttl == 0 || ttl < e->fresh_ttl)) {
+			e->fresh_ttl = ttl;
+		}
+	} else if (result == DNS_ERR_NOTEXIST) {
+		e->fresh_nxdomain = 1;
+	} else if (result != DNS_ERR_NODATA) {
+		e->fresh_failed = 1;
+	}
+
+	if (--e->pending == 0) {
+		dns_entry_complete(e);
+	}
+}
+
+/**
+ * @brief Starts the A and AAAA lookups of an entry
+ *
+ * @param e The entry, with no lookup in flight
+ * @param dnsbase Resolver of the calling loop
+ */
+static void dns_entry_lookup(struct dns_entry *e, struct evdns_base *dnsbase)
+{
+	memset(&e->fresh, 0, sizeof(e->fresh));
+	e->fresh_ttl = 0;
+	e->fresh_failed = 0;
+	e->fresh_nxdomain = 0;
+
+	// Both count before either is sent, answers are delivered from the loop
+	e->pending = 2;
+	if (!evdns_base_resolve_ipv4(dnsbase, e->name, 0, dns_answer_cb, e)) {
+		e->fresh_failed = 1;
+		e->pending--;
+	}
+	if (!evdns_base_resolve_ipv6(dnsbase, e->name, 0, dns_answer_cb, e)) {
+		e->fresh_failed = 1;
+		e->pending--;
+	}
+
+	if (e->pending == 0) {
+		dns_entry_complete(e);
+	}
+}
+
+/**
+ * @brief Connects a bufferevent to a host name through the resolver cache
+ *
+ * Literal addresses and /etc/hosts names connect right away, as do cached
+ * names; a name in the last tenth of its TTL is refreshed in the
+ * background meanwhile. Otherwise the connection waits for the lookup,
+ * shared with any other connection to the same name, and reports a
+ * failed lookup as BEV_EVENT_ERROR like bufferevent_socket_connect_hostname().
+ *
+ * @param bev Bufferevent created with no socket; its event callback must
+ *            be set before the loop runs again
+ * @param name Host name or literal address
+ * @param port Port to connect to
+ * @return 0 if connecting or waiting for the lookup, -1 on failure
+ */
+int dns_connect(struct bufferevent *bev, const char *name, int port)
+{
+	struct dns_addrs literal = {0};
+	struct in6_addr addr;
+
+	if (inet_pton(AF_INET, name, &addr) == 1) {
+		dns_addrs_add(&literal, AF_INET, &addr);
+		return dns_connect_addrs(bev, &literal, port, NULL);
+	}
+	if (inet_pton(AF_INET6, name, &addr) == 1) {
+		dns_addrs_add(&literal, AF_INET6, &addr);
+		return dns_connect_addrs(bev, &literal, port, NULL);
+	}
+
+	char key[256];
+	if (dns_normalize(key, name) < 0) {
+		debug(LOG_ERR, "Invalid host name: %s", name);
+		return -1;
+	}
+
+	struct dns_entry *e = NULL;
+	pthread_once(&dns_hosts_once, dns_load_hosts);
+	HASH_FIND_STR(dns_hosts, key, e);
+	if (e) {
+		return dns_connect_addrs(bev, &e->addrs, port, NULL);
+	}
+
+	struct evdns_base *dnsbase = get_dns_base(bufferevent_get_base(bev));
+	if (!dnsbase) {
+		debug(LOG_ERR, "No DNS base available for hostname resolution");
+		return -1;
+	}
+
+	time_t now = time(NULL);
+	HASH_FIND_STR(dns_cache, key, e);
+
+	if (e && e->valid && e->expires > now) {
+		if (!e->pending && (e->expires - now) * 10 <= e->ttl) {
+			dns_entry_lookup(e, dnsbase);
+		}
+		if (e->negative) {
+			debug(LOG_DEBUG, "DNS %s: no such name (cached)", key);
+			return -1;
+		}
+		return dns_connect_addrs(bev, &e->addrs, port, e->name);
+	}
+
+	if (!e) {
+		if (dns_cache_count >= DNS_CACHE_MAX) {
+			dns_cache_evict();
+		}
+
+		e = calloc(1, sizeof(struct dns_entry));
+		if (!e || !(e->name = strdup(key))) {
+			debug(LOG_ERR, "Failed to allocate DNS cache entry");
+			free(e);
+			return -1;
+		}
+		HASH_ADD_KEYPTR(hh, dns_cache, e->name, strlen(e->name), e);
+		dns_cache_count++;
+	}
+
+	// Lookups that cannot be sent complete before the caller set its
+	// callbacks, so the bufferevent only waits once one is in flight
+	if (!e->pending) {
+		dns_entry_lookup(e, dnsbase);
+		if (!e->pending) {
+			return -1;
+		}
+	}
+
+	struct dns_waiter *w = calloc(1, sizeof(struct dns_waiter));
+	if (!w) {
+		debug(LOG_ERR, "Failed to allocate DNS waiter");
+		return -1;
+	}
+	bufferevent_incref(bev);
+	w->bev = bev;
+	w->port = port;
+	w->next = e->waiters;
+	e->waiters = w;
+	return 0;
+}
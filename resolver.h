@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * Copyright (c) 2023 Dengfeng Liu <liudf0716@gmail.com>
+ */
+
+#ifndef XFRPC_RESOLVER_H
+#define XFRPC_RESOLVER_H
+
+#include <netinet/in.h>
+#include <event2/bufferevent.h>
+
+// Addresses of each family kept per name
+#define DNS_MAX_ADDRS       4
+
+// Names cached per event loop
+#define DNS_CACHE_MAX       512
+
+// Bounds applied to record TTLs, in seconds
+#define DNS_MIN_TTL         5
+#define DNS_MAX_TTL         3600
+
+// Seconds a name that does not exist stays cached
+#define DNS_NEGATIVE_TTL    30
+
+// Milliseconds between connection attempts to the addresses of a name
+#define DNS_ATTEMPT_DELAY_MS 250
+
+/**
+ * @brief Addresses a name resolved to
+ *
+ * The address of each family that connected last is kept first.
+ */
+struct dns_addrs {
+	int             n4;
+	int             n6;
+	int             prefer6;    /* IPv6 connected last, try it first */
+	struct in_addr  v4[DNS_MAX_ADDRS];
+	struct in6_addr v6[DNS_MAX_ADDRS];
+};
+
+int dns_connect(struct bufferevent *bev, const char *name, int port);
+
+#endif // XFRPC_RESOLVER_H
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "client.h"
 #include "common.h"
@@ -15,6 +16,7 @@
 #include "debug.h"
 #include "proxy.h"
 #include "tcpmux.h"
+#include "zip.h"
 
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -33,16 +35,145 @@ static uint8_t local_go_away = 0;     /* Flag indicating local end wants to clos
 static uint32_t g_session_id = 1;     /* Global session ID counter (starts at 1) */
 
 /**
- * @brief Stream management variables
+ * @brief Stream table
+ *
+ * Streams opened by xfrpc carry the odd IDs handed out by
+ * get_next_session_id(), so ID >> 1 indexes them densely. The index space
+ * is cut into pages of STREAM_PAGE_SLOTS slots; a page exists only while
+ * one of its streams is open. Pages are found through a small directory
+ * keyed by page number. Live IDs sit in one or two pages next to each
+ * other, so each directory entry almost always holds a single page. A slot
+ * keeps the stream together with its owner, the proxy client, so one
+ * lookup answers both. Every event loop thread has a table of its own.
  */
-static struct tmux_stream *cur_stream = NULL;  /* Currently active stream */
-static struct tmux_stream *all_stream = NULL;  /* Hash table of all streams */
+#define STREAM_PAGE_BITS  8
+#define STREAM_PAGE_SLOTS (1U << STREAM_PAGE_BITS)
+#define STREAM_DIR_SIZE   64              /* power of two */
+
+struct stream_slot {
+    struct tmux_stream *stream;
+    void *owner;
+};
+
+struct stream_page {
+    uint32_t pn;                          /* page number, (id >> 1) >> STREAM_PAGE_BITS */
+    uint32_t used;                        /* occupied slots */
+    struct stream_page *next;             /* next page in the same directory entry */
+    struct stream_slot slots[STREAM_PAGE_SLOTS];
+};
+
+static __thread struct stream_page *stream_dir[STREAM_DIR_SIZE];
+
+/**
+ * @brief Ring buffer block pool
+ *
+ * Blocks come in power-of-two sizes starting at RING_BLOCK_MIN. Released
+ * blocks are kept on a free list per size, at most RING_POOL_MAX_IDLE each,
+ * so streams that keep cycling between busy and idle do not hit malloc.
+ */
+#define RING_BLOCK_MIN     (4 * 1024)
+#define RING_BLOCK_CLASSES 4            /* 4, 8, 16 and 32 KiB */
+#define RING_POOL_MAX_IDLE 64
+
+struct ring_block {
+    struct ring_block *next;
+};
+
+static struct ring_block *ring_pool[RING_BLOCK_CLASSES];  /* Free blocks per size */
+static uint32_t ring_pool_idle[RING_BLOCK_CLASSES];       /* Free list lengths */
+
+/**
+ * @brief Receive window tuning state
+ *
+ * Windows above MAX_STREAM_WINDOW_SIZE are charged to a global budget so
+ * the credit handed out to frps stays bounded however many streams exist.
+ * The session RTT comes from PING round trips and drives auto-tuning.
+ */
+static uint64_t window_budget_used = 0; /* Window bytes granted beyond the initial window */
+static uint32_t srtt_us = 0;            /* Smoothed RTT to frps, 0 until measured */
+
+/**
+ * @brief Registered mux sessions
+ *
+ * Frames for a session are appended to its tx_batch and handed to the
+ * session bufferevent in one piece once the event loop has run the current
+ * round of callbacks. Plain window updates are not queued as frames at all:
+ * their credit is summed per stream and emitted at flush time, so a stream
+ * returning credit several times per round costs a single frame.
+ */
+static struct tmux_session *all_sessions = NULL;
 
 /**
- * @brief Adds a stream to the hash table of all streams.
+ * @brief Finds the table page holding a stream slot index.
  *
- * This function adds the given stream to the global hash table `all_stream`
- * using the stream's `id` as the key.
+ * @param idx    Slot index, the stream ID shifted right by one
+ * @param create Whether to allocate the page when it does not exist
+ * @return The page, NULL if absent or out of memory
+ */
+static struct stream_page *stream_page_of(uint32_t idx, bool create) {
+    uint32_t pn = idx >> STREAM_PAGE_BITS;
+    struct stream_page **head = &stream_dir[pn & (STREAM_DIR_SIZE - 1)];
+
+    for (struct stream_page *page = *head; page; page = page->next) {
+        if (page->pn == pn) {
+            return page;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    struct stream_page *page = calloc(1, sizeof(struct stream_page));
+    if (!page) {
+        debug(LOG_ERR, "Failed to allocate stream table page");
+        return NULL;
+    }
+    page->pn = pn;
+    page->next = *head;
+    *head = page;
+    return page;
+}
+
+/**
+ * @brief Unlinks and frees an empty table page.
+ *
+ * @param page The page, must hold no streams
+ */
+static void stream_page_free(struct stream_page *page) {
+    struct stream_page **link = &stream_dir[page->pn & (STREAM_DIR_SIZE - 1)];
+
+    while (*link != page) {
+        link = &(*link)->next;
+    }
+    *link = page->next;
+    free(page);
+}
+
+/**
+ * @brief Looks up the table slot of a stream ID.
+ *
+ * @param id The stream ID
+ * @return The slot holding that stream, NULL if the stream is not in the table
+ */
+static struct stream_slot *stream_slot_of(uint32_t id) {
+    uint32_t idx = id >> 1;
+    struct stream_page *page = stream_page_of(idx, false);
+    if (!page) {
+        return NULL;
+    }
+
+    struct stream_slot *slot = &page->slots[idx & (STREAM_PAGE_SLOTS - 1)];
+    if (!slot->stream || slot->stream->id != id) {
+        return NULL;
+    }
+    return slot;
+}
+
+/**
+ * @brief Adds a stream to the stream table.
+ *
+ * The stream has no owner until set_stream_owner() is called.
  *
  * @param stream A pointer to the `tmux_stream` structure to be added.
  */
@@ -53,122 +184,354 @@ void add_stream(struct tmux_stream *stream) {
         return;
     }
 
-    // Check if stream already exists
-    struct tmux_stream *existing = NULL;
-    HASH_FIND_INT(all_stream, &stream->id, existing);
-    if (existing) {
-        debug(LOG_WARNING, "Stream %u already exists in hash table", stream->id);
+    // Only client initiated (odd) IDs are indexed
+    if (!(stream->id & 1)) {
+        debug(LOG_WARNING, "Stream %u is not a client stream", stream->id);
+        return;
+    }
+
+    uint32_t idx = stream->id >> 1;
+    struct stream_page *page = stream_page_of(idx, true);
+    if (!page) {
+        return;
+    }
+
+    struct stream_slot *slot = &page->slots[idx & (STREAM_PAGE_SLOTS - 1)];
+    if (slot->stream) {
+        debug(LOG_WARNING, "Stream %u already exists in stream table", stream->id);
         return;
     }
 
-    // Add stream to hash table
-    HASH_ADD_INT(all_stream, id, stream);
-    debug(LOG_DEBUG, "Added stream %u to hash table", stream->id);
+    slot->stream = stream;
+    slot->owner = NULL;
+    page->used++;
+    debug(LOG_DEBUG, "Added stream %u to stream table", stream->id);
+}
+
+/**
+ * @brief Records the owner of a stream in the stream table.
+ *
+ * @param stream The stream, already added with add_stream()
+ * @param owner  Owner of the stream, the proxy client for work connections
+ */
+void set_stream_owner(struct tmux_stream *stream, void *owner) {
+    struct stream_slot *slot = stream ? stream_slot_of(stream->id) : NULL;
+    if (slot && slot->stream == stream) {
+        slot->owner = owner;
+    }
 }
 
 /**
- * @brief Deletes a stream with the specified ID from the hash table.
+ * @brief Deletes a stream with the specified ID from the stream table.
  *
- * This function removes a stream identified by the given ID from the global
- * hash table `all_stream`. If the stream is found, it is deleted from the
- * hash table. Note that the stream itself is not freed in this function; it
- * will be freed when the associated proxy client is freed.
+ * The table page is released once its last stream is gone. Note that the
+ * stream itself is not freed in this function; it will be freed when the
+ * associated proxy client is freed.
  *
  * @param id The ID of the stream to be deleted.
  */
 void del_stream(uint32_t id) {
-    // Early return if hash table is not initialized
-    if (!all_stream) {
-        debug(LOG_DEBUG, "Stream hash table not initialized");
+    uint32_t idx = id >> 1;
+    struct stream_page *page = stream_page_of(idx, false);
+    struct stream_slot *slot = page ? &page->slots[idx & (STREAM_PAGE_SLOTS - 1)] : NULL;
+
+    if (!slot || !slot->stream || slot->stream->id != id) {
+        debug(LOG_DEBUG, "Stream %u not found in stream table", id);
         return;
     }
 
-    // Find stream in hash table
-    struct tmux_stream *stream = NULL;
-    HASH_FIND_INT(all_stream, &id, stream);
-
-    // Delete stream if found
-    if (stream) {
-        HASH_DEL(all_stream, stream);
-        debug(LOG_DEBUG, "Stream %u removed from hash table", id);
-    } else {
-        debug(LOG_DEBUG, "Stream %u not found in hash table", id);
+    slot->stream = NULL;
+    slot->owner = NULL;
+    if (--page->used == 0) {
+        stream_page_free(page);
     }
-    
-    // Note: Stream memory is freed when associated proxy client is freed
+    debug(LOG_DEBUG, "Stream %u removed from stream table", id);
 }
 
 /**
- * @brief Clears all streams from the global hash table.
+ * @brief Clears all streams from the stream table.
  *
- * This function performs a complete cleanup of the global stream hash table.
- * It safely handles the case where the hash table is already empty.
- * After clearing, the global pointer is set to NULL to prevent dangling references.
+ * This function performs a complete cleanup of the stream table of the
+ * calling thread and releases all of its pages.
  *
  * @note This function should be called during shutdown or when a complete reset is needed.
  * @note This is a destructive operation - all stream entries will be removed.
  */
 void clear_stream(void) {
-    if (all_stream) {
-        HASH_CLEAR(hh, all_stream);
-        all_stream = NULL;
-        debug(LOG_DEBUG, "Cleared all streams from hash table");
+    for (int i = 0; i < STREAM_DIR_SIZE; i++) {
+        while (stream_dir[i]) {
+            struct stream_page *page = stream_dir[i];
+            stream_dir[i] = page->next;
+            free(page);
+        }
     }
+    debug(LOG_DEBUG, "Cleared all streams from stream table");
 }
 
 /**
- * @brief Retrieves a stream from the global hash table by its ID.
+ * @brief Retrieves a stream from the stream table by its ID.
  *
  * @param id The unique identifier of the stream to find
  * @return struct tmux_stream* Pointer to the found stream, or NULL if not found
- * 
- * @note This function is thread-safe since the hash table operations are atomic
- * @note Returns NULL if the global hash table is not initialized
  */
 struct tmux_stream *get_stream_by_id(uint32_t id) {
-    // Early return if hash table is not initialized
-    if (!all_stream) {
-        debug(LOG_DEBUG, "Stream hash table not initialized");
+    struct stream_slot *slot = stream_slot_of(id);
+    if (!slot) {
+        debug(LOG_DEBUG, "Stream %u not found", id);
         return NULL;
     }
+    return slot->stream;
+}
 
-    // Look up stream in hash table
-    struct tmux_stream *stream = NULL;
-    HASH_FIND_INT(all_stream, &id, stream);
+/**
+ * @brief Retrieves the owner of a stream from the stream table.
+ *
+ * @param id The stream ID
+ * @return The owner recorded with set_stream_owner(), NULL if none
+ */
+void *get_stream_owner(uint32_t id) {
+    struct stream_slot *slot = stream_slot_of(id);
+    return slot ? slot->owner : NULL;
+}
 
-    if (!stream) {
-        debug(LOG_DEBUG, "Stream %u not found", id);
+/**
+ * @brief Retrieves a stream and its owner with a single table lookup.
+ *
+ * @param id    The stream ID
+ * @param owner Set to the owner of the stream, NULL if none or not found
+ * @return The stream, NULL if not found
+ */
+static struct tmux_stream *get_stream_and_owner(uint32_t id, void **owner) {
+    struct stream_slot *slot = stream_slot_of(id);
+    *owner = slot ? slot->owner : NULL;
+    return slot ? slot->stream : NULL;
+}
+
+/**
+ * @brief Calls a function for every owned stream in the stream table.
+ *
+ * @param fn  Callback, invoked with the owner and arg. It may delete the
+ *            stream it was called for, but no other stream.
+ * @param arg Argument passed to fn
+ */
+void foreach_stream_owner(void (*fn)(void *owner, void *arg), void *arg) {
+    for (int i = 0; i < STREAM_DIR_SIZE; i++) {
+        struct stream_page *page = stream_dir[i];
+        while (page) {
+            struct stream_page *next = page->next;
+            uint32_t pn = page->pn;
+
+            for (uint32_t n = 0; n < STREAM_PAGE_SLOTS; n++) {
+                void *owner = page->slots[n].owner;
+                if (!owner) {
+                    continue;
+                }
+
+                fn(owner, arg);
+                // The page goes away with its last stream
+                page = stream_page_of(pn << STREAM_PAGE_BITS, false);
+                if (!page) {
+                    break;
+                }
+            }
+            page = next;
+        }
     }
+}
 
-    return stream;
+/**
+ * @brief Maps a ring block capacity to its pool size class.
+ *
+ * @param cap Block capacity, a power of two not below RING_BLOCK_MIN
+ * @return Index of the size class, RING_BLOCK_CLASSES or above if unpooled
+ */
+static int ring_block_class(uint32_t cap) {
+    int cls = 0;
+    for (uint32_t sz = RING_BLOCK_MIN; sz < cap; sz <<= 1) {
+        cls++;
+    }
+    return cls;
 }
 
 /**
- * @brief Retrieves the current tmux stream.
+ * @brief Takes a ring block of the given capacity from the pool.
  *
- * Returns a pointer to the current multiplexed TCP stream that is being processed.
- * This stream represents the active connection being handled by the TCP multiplexer.
+ * @param cap Block capacity in bytes
+ * @return Pointer to the block, or NULL on allocation failure
+ */
+static uint8_t *ring_block_alloc(uint32_t cap) {
+    int cls = ring_block_class(cap);
+    if (cls < RING_BLOCK_CLASSES && ring_pool[cls]) {
+        struct ring_block *blk = ring_pool[cls];
+        ring_pool[cls] = blk->next;
+        ring_pool_idle[cls]--;
+        return (uint8_t *)blk;
+    }
+    return malloc(cap);
+}
+
+/**
+ * @brief Hands a ring block back to the pool.
  *
- * @return Pointer to the current tmux_stream structure, or NULL if no stream is active
+ * @param data Block returned by ring_block_alloc()
+ * @param cap  Capacity the block was allocated with
  */
-struct tmux_stream *get_cur_stream() {
-    return cur_stream;
+static void ring_block_free(uint8_t *data, uint32_t cap) {
+    int cls = ring_block_class(cap);
+    if (cls < RING_BLOCK_CLASSES && ring_pool_idle[cls] < RING_POOL_MAX_IDLE) {
+        struct ring_block *blk = (struct ring_block *)data;
+        blk->next = ring_pool[cls];
+        ring_pool[cls] = blk;
+        ring_pool_idle[cls]++;
+        return;
+    }
+    free(data);
 }
 
 /**
- * @brief Sets the current tmux stream.
+ * @brief Makes room for len more bytes in a ring buffer.
  *
- * Sets the global current stream pointer. This function performs validation
- * to ensure we don't set an invalid stream pointer.
+ * Grows the ring to the next power of two that fits, but never beyond
+ * limit. Buffered bytes are moved to the start of the new block.
  *
- * @param stream Pointer to the tmux stream to set as current. Can be NULL to clear.
+ * @param ring  Pointer to the ring buffer structure
+ * @param len   Number of bytes the caller wants to add
+ * @param limit Maximum capacity of this ring
+ * @return Free space in the ring afterwards, which may be less than len
  */
-void set_cur_stream(struct tmux_stream *stream) {
-    // No validation needed since NULL is valid to clear current stream
-    cur_stream = stream;
-    
-    debug(LOG_DEBUG, "Current stream %s", 
-          stream ? "updated" : "cleared");
+static uint32_t ring_buffer_reserve(struct ring_buffer *ring, uint32_t len,
+                                    uint32_t limit) {
+    if (ring->cap - ring->sz >= len) {
+        return ring->cap - ring->sz;
+    }
+
+    uint32_t want = MIN(ring->sz + len, limit);
+    uint32_t cap = ring->cap ? ring->cap : RING_BLOCK_MIN;
+    while (cap < want) {
+        cap <<= 1;
+    }
+    cap = MIN(cap, limit);
+    if (cap <= ring->cap) {
+        return ring->cap - ring->sz;
+    }
+
+    uint8_t *data = ring_block_alloc(cap);
+    if (!data) {
+        debug(LOG_ERR, "Failed to allocate %u bytes ring buffer", cap);
+        return ring->cap - ring->sz;
+    }
+
+    if (ring->sz > 0) {
+        uint32_t first = MIN(ring->sz, ring->cap - ring->cur);
+        memcpy(data, &ring->data[ring->cur], first);
+        memcpy(data + first, ring->data, ring->sz - first);
+    }
+    if (ring->data) {
+        ring_block_free(ring->data, ring->cap);
+    }
+
+    ring->data = data;
+    ring->cap = cap;
+    ring->cur = 0;
+    ring->end = ring->sz;
+    return cap - ring->sz;
+}
+
+/**
+ * @brief Gives the storage of an empty ring buffer back to the pool.
+ *
+ * @param ring Pointer to the ring buffer structure
+ */
+static void ring_buffer_trim(struct ring_buffer *ring) {
+    if (ring->sz > 0 || !ring->data) {
+        return;
+    }
+
+    ring_block_free(ring->data, ring->cap);
+    memset(ring, 0, sizeof(*ring));
+}
+
+/**
+ * @brief Returns the monotonic clock in microseconds
+ */
+static uint64_t tmux_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Takes window growth from the global window budget
+ *
+ * @param window Current window of the stream
+ * @param want   Requested window
+ * @return The new window, between window and want
+ */
+static uint32_t window_budget_take(uint32_t window, uint32_t want) {
+    struct common_conf *c_conf = get_common_config();
+    uint64_t budget = c_conf ? c_conf->tcp_mux_window_budget : 0;
+
+    if (want <= window || window_budget_used >= budget) {
+        return window;
+    }
+
+    uint32_t grow = (uint32_t)MIN((uint64_t)(want - window), budget - window_budget_used);
+    window_budget_used += grow;
+    return window + grow;
+}
+
+/**
+ * @brief Shrinks the window of a stream and returns the excess to the budget
+ *
+ * @param stream Pointer to the tmux_stream structure
+ * @param window New window, never below MAX_STREAM_WINDOW_SIZE
+ */
+static void window_budget_put(struct tmux_stream *stream, uint32_t window) {
+    if (window < MAX_STREAM_WINDOW_SIZE) {
+        window = MAX_STREAM_WINDOW_SIZE;
+    }
+    if (stream->max_window <= window) {
+        return;
+    }
+
+    window_budget_used -= stream->max_window - window;
+    stream->max_window = window;
+}
+
+static void tmux_sched_dequeue(struct tmux_stream *stream);
+
+/**
+ * @brief Releases the buffers of a tmux stream.
+ *
+ * Any data still queued is dropped, the window budget held by the stream
+ * is returned and the stream leaves its session. The stream itself is
+ * left in place.
+ *
+ * @param stream Pointer to the tmux_stream structure
+ */
+void release_tmux_stream(struct tmux_stream *stream) {
+    if (!stream) {
+        return;
+    }
+
+    if (stream->session) {
+        tmux_sched_dequeue(stream);
+    }
+    if (stream->txq) {
+        evbuffer_free(stream->txq);
+        stream->txq = NULL;
+    }
+    stream->deficit = 0;
+    stream->fin_pending = false;
+    stream->rx_ring.sz = 0;
+    ring_buffer_trim(&stream->rx_ring);
+    window_budget_put(stream, MAX_STREAM_WINDOW_SIZE);
+    stream->pending_window = 0;
+    if (stream->session) {
+        stream->session->nstreams--;
+        stream->session = NULL;
+    }
 }
 
 /**
@@ -199,9 +562,24 @@ void init_tmux_stream(struct tmux_stream *stream, uint32_t id, enum tcp_mux_stat
     stream->state = state;
     stream->recv_window = MAX_STREAM_WINDOW_SIZE;
     stream->send_window = MAX_STREAM_WINDOW_SIZE;
+    stream->window_epoch = tmux_now_us();
+    stream->pending_window = 0;
+    stream->read_paused = false;
+    stream->fin_pending = false;
+    stream->txq = NULL;
+    stream->weight = 1;
+    stream->deficit = 0;
+    stream->scheduled = false;
+    stream->sched_next = stream->sched_prev = NULL;
+
+    // Anything above the initial window is announced with the first update
+    struct common_conf *c_conf = get_common_config();
+    stream->max_window = MAX_STREAM_WINDOW_SIZE;
+    if (c_conf && c_conf->tcp_mux) {
+        stream->max_window = window_budget_take(MAX_STREAM_WINDOW_SIZE, c_conf->tcp_mux_window);
+    }
 
-    // Clear ring buffers
-    memset(&stream->tx_ring, 0, sizeof(struct ring_buffer));
+    // Buffers stay empty until the stream has data to hold
     memset(&stream->rx_ring, 0, sizeof(struct ring_buffer));
 
     // Add stream to global tracking
@@ -315,6 +693,247 @@ uint32_t get_next_session_id() {
     return current_id;
 }
 
+/**
+ * @brief Emits the deferred window updates into the session batch
+ *
+ * @param session Pointer to the tmux_session structure
+ */
+static void tmux_flush_window_updates(struct tmux_session *session) {
+    for (uint32_t i = 0; i < session->wnd_pending_cnt; i++) {
+        struct tmux_stream *stream = get_stream_by_id(session->wnd_pending[i]);
+        if (!stream || stream->session != session || stream->pending_window == 0) {
+            continue;
+        }
+
+        struct tcp_mux_header tmux_hdr;
+        tcp_mux_encode(WINDOW_UPDATE, 0, stream->id, stream->pending_window, &tmux_hdr);
+        evbuffer_add(session->tx_batch, &tmux_hdr, sizeof(tmux_hdr));
+        debug(LOG_DEBUG, "Sent window update: stream=%u, delta=%u, flags=0",
+              stream->id, stream->pending_window);
+        stream->pending_window = 0;
+    }
+    session->wnd_pending_cnt = 0;
+}
+
+/**
+ * @brief Hands everything batched during this loop round to the session
+ *
+ * @param fd   Unused
+ * @param what Unused
+ * @param arg  The tmux_session to flush
+ */
+static void tmux_flush_cb(evutil_socket_t fd, short what, void *arg) {
+    struct tmux_session *session = arg;
+
+    session->flush_scheduled = false;
+    if (!session->bev || !session->tx_batch) {
+        return;
+    }
+
+    tmux_flush_window_updates(session);
+    if (evbuffer_get_length(session->tx_batch) > 0 &&
+        bufferevent_write_buffer(session->bev, session->tx_batch) < 0) {
+        debug(LOG_ERR, "Failed to flush %zu batched bytes",
+              evbuffer_get_length(session->tx_batch));
+    }
+}
+
+/**
+ * @brief Starts a mux session on a connected bufferevent
+ *
+ * @param session Pointer to the tmux_session structure
+ * @param bev     The bufferevent connected to frps
+ */
+void tmux_session_init(struct tmux_session *session, struct bufferevent *bev) {
+    tmux_session_reset(session);
+
+    if (!session->tx_batch) {
+        session->tx_batch = evbuffer_new();
+    }
+    session->flush_ev = event_new(bufferevent_get_base(bev), -1, 0, tmux_flush_cb, session);
+    if (!session->tx_batch || !session->flush_ev) {
+        debug(LOG_ERR, "Failed to set up tcp mux write batching");
+    }
+
+    // The write callback runs the scheduler once the backlog is below its limit
+    bufferevent_setwatermark(bev, EV_WRITE, TX_SCHED_LIMIT, 0);
+
+    session->bev = bev;
+    session->last_ack = time(NULL);
+    session->next = all_sessions;
+    all_sessions = session;
+}
+
+/**
+ * @brief Stops a mux session and drops everything batched for it
+ *
+ * @param session Pointer to the tmux_session structure
+ */
+void tmux_session_reset(struct tmux_session *session) {
+    for (struct tmux_session **pp = &all_sessions; *pp; pp = &(*pp)->next) {
+        if (*pp == session) {
+            *pp = session->next;
+            break;
+        }
+    }
+
+    if (session->tx_batch) {
+        evbuffer_drain(session->tx_batch, evbuffer_get_length(session->tx_batch));
+    }
+    if (session->flush_ev) {
+        event_free(session->flush_ev);
+        session->flush_ev = NULL;
+    }
+    while (session->sched_head) {
+        tmux_sched_dequeue(session->sched_head);
+    }
+    session->flush_scheduled = false;
+    session->throttled = false;
+    session->wnd_pending_cnt = 0;
+    session->ping_sent = 0;
+    session->bev = NULL;
+    session->next = NULL;
+    tmux_decoder_init(&session->decoder);
+}
+
+/**
+ * @brief Finds the mux session running on a bufferevent
+ *
+ * @param bev The bufferevent to look up
+ * @return The session, or NULL if none is registered for bev
+ */
+struct tmux_session *tmux_session_of(struct bufferevent *bev) {
+    for (struct tmux_session *session = all_sessions; session; session = session->next) {
+        if (session->bev == bev) {
+            return session;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Attaches a stream to the session that will carry it
+ *
+ * @param stream  Pointer to the tmux_stream structure
+ * @param session Pointer to the tmux_session structure
+ */
+void tmux_stream_attach(struct tmux_stream *stream, struct tmux_session *session) {
+    if (stream->session) {
+        tmux_sched_dequeue(stream);
+        stream->session->nstreams--;
+    }
+    stream->session = session;
+    if (session) {
+        session->nstreams++;
+    }
+}
+
+/**
+ * @brief Returns the bytes a mux session has not yet written to the socket
+ *
+ * @param session Pointer to the tmux_session structure
+ * @return Batched plus buffered output bytes
+ */
+size_t tmux_session_backlog(struct tmux_session *session) {
+    if (!session->bev) {
+        return 0;
+    }
+
+    size_t backlog = evbuffer_get_length(bufferevent_get_output(session->bev));
+    if (session->tx_batch) {
+        backlog += evbuffer_get_length(session->tx_batch);
+    }
+    return backlog;
+}
+
+/**
+ * @brief Returns the bufferevent frames of a stream are sent on
+ *
+ * Streams not attached to a session belong to the main control connection.
+ *
+ * @param stream Pointer to the tmux_stream structure
+ * @return The session bufferevent
+ */
+static struct bufferevent *tmux_stream_bev(struct tmux_stream *stream) {
+    if (stream && stream->session && stream->session->bev) {
+        return stream->session->bev;
+    }
+    return get_main_control()->connect_bev;
+}
+
+/**
+ * @brief Returns the buffer frames for a mux session are appended to
+ *
+ * Makes sure a flush is scheduled. For a bufferevent without a session, or
+ * if batching could not be set up, the bufferevent output buffer is
+ * returned, so frames still go out, just without coalescing.
+ *
+ * @param bout The bufferevent of the mux session
+ * @return The evbuffer to append frames to
+ */
+static struct evbuffer *tmux_tx_buffer(struct bufferevent *bout) {
+    struct tmux_session *session = tmux_session_of(bout);
+
+    if (!session || !session->tx_batch || !session->flush_ev) {
+        return bufferevent_get_output(bout);
+    }
+
+    if (!session->flush_scheduled) {
+        session->flush_scheduled = true;
+        event_active(session->flush_ev, EV_WRITE, 0);
+    }
+
+    return session->tx_batch;
+}
+
+/**
+ * @brief Appends a frame header to the session batch
+ *
+ * @param bout     The bufferevent of the mux session
+ * @param tmux_hdr Encoded header
+ * @return 0 on success, -1 on failure
+ */
+static int tmux_tx_header(struct bufferevent *bout, struct tcp_mux_header *tmux_hdr) {
+    return evbuffer_add(tmux_tx_buffer(bout), tmux_hdr, sizeof(*tmux_hdr));
+}
+
+/**
+ * @brief Defers plain window credit for a stream to the next flush
+ *
+ * @param bout   The bufferevent of the mux session
+ * @param stream Pointer to the tmux stream
+ * @param delta  Window credit to grant
+ */
+static void tmux_defer_window_update(struct bufferevent *bout, struct tmux_stream *stream,
+                                     uint32_t delta) {
+    struct evbuffer *batch = tmux_tx_buffer(bout);
+    struct tmux_session *session = tmux_session_of(bout);
+
+    if (stream->pending_window == 0) {
+        bool batched = session && batch == session->tx_batch && stream->session == session;
+
+        if (batched && session->wnd_pending_cnt == session->wnd_pending_cap) {
+            uint32_t cap = session->wnd_pending_cap ? session->wnd_pending_cap * 2 : 64;
+            uint32_t *ids = realloc(session->wnd_pending, cap * sizeof(*ids));
+            if (ids) {
+                session->wnd_pending = ids;
+                session->wnd_pending_cap = cap;
+            }
+        }
+
+        // No batching possible, send the update as a frame of its own
+        if (!batched || session->wnd_pending_cnt == session->wnd_pending_cap) {
+            struct tcp_mux_header tmux_hdr;
+            tcp_mux_encode(WINDOW_UPDATE, 0, stream->id, delta, &tmux_hdr);
+            evbuffer_add(batch, &tmux_hdr, sizeof(tmux_hdr));
+            return;
+        }
+        session->wnd_pending[session->wnd_pending_cnt++] = stream->id;
+    }
+
+    stream->pending_window += delta;
+}
+
 /**
  * @brief Sends a TCP multiplexer window update message
  *
@@ -344,7 +963,7 @@ static void tcp_mux_send_win_update(struct bufferevent *bout,
     tcp_mux_encode(WINDOW_UPDATE, flags, stream_id, delta, &tmux_hdr);
 
     // Send window update
-    if (bufferevent_write(bout, &tmux_hdr, sizeof(tmux_hdr)) < 0) {
+    if (tmux_tx_header(bout, &tmux_hdr) < 0) {
         debug(LOG_ERR, "Failed to send window update for stream %u", stream_id);
         return;
     }
@@ -503,7 +1122,7 @@ void tcp_mux_send_data(struct bufferevent *bout, uint16_t flags,
     memset(&tmux_hdr, 0, sizeof(tmux_hdr));
     tcp_mux_encode(DATA, flags, stream_id, length, &tmux_hdr);
     
-    if (bufferevent_write(bout, &tmux_hdr, sizeof(tmux_hdr)) < 0) {
+    if (tmux_tx_header(bout, &tmux_hdr) < 0) {
         debug(LOG_ERR, "Failed to send data header for stream %u", stream_id);
     }
 }
@@ -539,11 +1158,72 @@ void tcp_mux_send_ping(struct bufferevent *bout, uint32_t ping_id) {
     memset(&tmux_hdr, 0, sizeof(tmux_hdr));
     tcp_mux_encode(PING, SYN, 0, ping_id, &tmux_hdr);
     
-    if (bufferevent_write(bout, &tmux_hdr, sizeof(tmux_hdr)) < 0) {
+    if (tmux_tx_header(bout, &tmux_hdr) < 0) {
         debug(LOG_ERR, "Failed to send ping message");
     }
 }
 
+/**
+ * @brief Sends a keepalive PING on a mux session
+ *
+ * At most one PING is outstanding. One that was never answered is
+ * replaced by the next.
+ *
+ * @param session Pointer to the tmux_session structure
+ */
+void tmux_session_ping(struct tmux_session *session) {
+    if (!session || !session->bev) {
+        return;
+    }
+
+    session->ping_id++;
+    session->ping_sent = tmux_now_us();
+    tcp_mux_send_ping(session->bev, session->ping_id);
+}
+
+/**
+ * @brief Sends a PING to measure the round trip time of the mux session
+ *
+ * @param bout The bufferevent of the mux session
+ */
+void tcp_mux_probe_rtt(struct bufferevent *bout) {
+    struct common_conf *c_conf = get_common_config();
+    if (!c_conf || !c_conf->tcp_mux || !c_conf->tcp_mux_autotune || !bout) {
+        return;
+    }
+
+    tmux_session_ping(tmux_session_of(bout));
+}
+
+/**
+ * @brief Handles the acknowledgment of a session PING
+ *
+ * Refreshes the session keepalive and updates the smoothed RTT.
+ *
+ * @param session Pointer to the tmux_session the acknowledgment arrived on
+ * @param ping_id ID carried by the acknowledgment
+ */
+static void tcp_mux_ping_acked(struct tmux_session *session, uint32_t ping_id) {
+    if (!session || !session->ping_sent || ping_id != session->ping_id) {
+        return;
+    }
+
+    uint64_t sample = tmux_now_us() - session->ping_sent;
+    session->ping_sent = 0;
+    session->last_ack = time(NULL);
+    if (sample == 0) {
+        sample = 1;
+    }
+    if (sample > UINT32_MAX) {
+        sample = UINT32_MAX;
+    }
+
+    // Same smoothing as TCP: srtt = 7/8 srtt + 1/8 sample
+    srtt_us = srtt_us ? (uint32_t)((7ULL * srtt_us + sample) / 8) : (uint32_t)sample;
+    debug(LOG_DEBUG, "mux session rtt sample %lu us, srtt %u us",
+          (unsigned long)sample, srtt_us);
+}
+
 /**
  * @brief Handles TCP multiplexer ping messages by sending an acknowledgment.
  *
@@ -575,7 +1255,7 @@ static void tcp_mux_handle_ping(struct bufferevent *bout, uint32_t ping_id) {
     memset(&tmux_hdr, 0, sizeof(tmux_hdr));
     tcp_mux_encode(PING, ACK, 0, ping_id, &tmux_hdr);
     
-    if (bufferevent_write(bout, &tmux_hdr, sizeof(tmux_hdr)) < 0) {
+    if (tmux_tx_header(bout, &tmux_hdr) < 0) {
         debug(LOG_ERR, "Failed to send ping acknowledgment");
     }
 }
@@ -607,7 +1287,7 @@ static void tcp_mux_send_go_away(struct bufferevent *bout, uint32_t reason) {
     memset(&tmux_hdr, 0, sizeof(tmux_hdr));
     tcp_mux_encode(GO_AWAY, 0, 0, reason, &tmux_hdr);
     
-    if (bufferevent_write(bout, &tmux_hdr, sizeof(tmux_hdr)) < 0) {
+    if (tmux_tx_header(bout, &tmux_hdr) < 0) {
         debug(LOG_ERR, "Failed to send GO_AWAY message");
     }
 }
@@ -641,7 +1321,8 @@ static int process_flags(uint16_t flags, struct tmux_stream *stream) {
                 break;
             case LOCAL_CLOSE:
                 stream->state = CLOSED;
-                should_close = true;
+                // With our FIN still queued the stream goes once it is sent
+                should_close = !stream->fin_pending;
                 break;
             default:
                 debug(LOG_ERR, "unexpected FIN flag in state %d", stream->state);
@@ -695,18 +1376,61 @@ static uint16_t get_send_flags(struct tmux_stream *stream) {
     return flags;
 }
 
+/**
+ * @brief Grows the receive window of a stream that is limited by it.
+ *
+ * Works like the receive buffer auto-tuning of TCP. The peer used
+ * @p consumed bytes of credit since the previous window update; when that
+ * pace would use up the whole window in less than two round trips, the
+ * window rather than the path or the local reader limits the stream, so
+ * it is doubled up to tcp_mux_window_max, as far as the budget allows.
+ *
+ * @param stream   Pointer to the tmux stream.
+ * @param consumed Credit returned by the window update being sent.
+ * @return Number of bytes the window grew by.
+ */
+static uint32_t tmux_stream_autotune(struct tmux_stream *stream, uint32_t consumed) {
+    struct common_conf *c_conf = get_common_config();
+    uint64_t now = tmux_now_us();
+    uint64_t elapsed = now - stream->window_epoch;
+
+    stream->window_epoch = now;
+    if (!c_conf || !c_conf->tcp_mux_autotune || srtt_us == 0 ||
+        stream->max_window >= c_conf->tcp_mux_window_max) {
+        return 0;
+    }
+
+    // elapsed < 4 * (consumed / max_window) * srtt, i.e. the window lasts < 2 RTTs
+    if (elapsed >= 4ULL * srtt_us ||
+        elapsed * stream->max_window >= 4ULL * consumed * srtt_us) {
+        return 0;
+    }
+
+    uint32_t old_window = stream->max_window;
+    uint32_t want = (uint32_t)MIN(2ULL * old_window, (uint64_t)c_conf->tcp_mux_window_max);
+    stream->max_window = window_budget_take(old_window, want);
+    if (stream->max_window != old_window) {
+        debug(LOG_DEBUG, "stream %u window %u -> %u", stream->id, old_window,
+              stream->max_window);
+    }
+
+    return stream->max_window - old_window;
+}
+
 /**
  * @brief Sends a window update message for stream flow control.
  *
  * Updates the receive window for a stream and sends a window update message
- * if the delta exceeds half of the maximum window size or if there are flags to send.
+ * if the delta exceeds half of the stream's window or if there are flags to
+ * send. Plain updates give auto-tuning a chance to grow the window and are
+ * merged into the next batch flush.
  *
  * @param bout Buffered output event for sending data.
  * @param stream Pointer to the tmux stream to update.
  * @param length Current receive buffer length.
  */
 void send_window_update(struct bufferevent *bout, struct tmux_stream *stream, uint32_t length) {
-    const uint32_t max_window = MAX_STREAM_WINDOW_SIZE;
+    const uint32_t max_window = stream->max_window;
     const uint32_t half_max_window = max_window / 2;
     uint32_t delta = max_window > (length + stream->recv_window) 
                      ? max_window - length - stream->recv_window 
@@ -717,10 +1441,50 @@ void send_window_update(struct bufferevent *bout, struct tmux_stream *stream, ui
         return;
     }
 
-    stream->recv_window = MIN(stream->recv_window + delta, max_window);
+    if (flags == 0) {
+        delta += tmux_stream_autotune(stream, delta);
+    }
+
+    stream->recv_window += delta;
+    if (flags == 0) {
+        // Plain credit can wait for the batch flush and merge with later updates
+        tmux_defer_window_update(bout, stream, delta);
+        return;
+    }
+
     tcp_mux_send_win_update(bout, flags, stream->id, delta);
 }
 
+/**
+ * @brief Changes the receive window granted to a TCP MUX stream
+ *
+ * @param bout   The bufferevent to send the window update message
+ * @param stream Pointer to the tmux_stream structure
+ * @param window Requested receive window in bytes
+ */
+void tmux_stream_set_window(struct bufferevent *bout, struct tmux_stream *stream,
+                            uint32_t window) {
+    if (!stream || window == 0) {
+        return;
+    }
+
+    if (window <= stream->max_window) {
+        // Credit already granted cannot be taken back, it simply is not renewed
+        window_budget_put(stream, window);
+        return;
+    }
+
+    uint32_t old_window = stream->max_window;
+    stream->max_window = window_budget_take(old_window, window);
+    if (stream->max_window == old_window || !bout) {
+        return;
+    }
+
+    stream->recv_window += stream->max_window - old_window;
+    tcp_mux_send_win_update(bout, get_send_flags(stream), stream->id,
+                            stream->max_window - old_window);
+}
+
 /**
  * Pops data from a ring buffer.
  * 
@@ -746,17 +1510,78 @@ int rx_ring_buffer_pop(struct ring_buffer *ring, uint8_t *data, uint32_t len) {
     uint8_t *dst = data;
 
     while (remaining > 0) {
-        uint32_t chunk = MIN(remaining, RBUF_SIZE - ring->cur);
+        uint32_t chunk = MIN(remaining, ring->cap - ring->cur);
         memcpy(dst, &ring->data[ring->cur], chunk);
         dst += chunk;
-        ring->cur = (ring->cur + chunk) % RBUF_SIZE;
+        ring->cur = (ring->cur + chunk) % ring->cap;
         ring->sz -= chunk;
         remaining -= chunk;
     }
 
+    ring_buffer_trim(ring);
     return len;
 }
 
+/**
+ * @brief Returns the content of a ring buffer as a NUL terminated message
+ *
+ * Lets callers consume a complete message straight out of the ring instead
+ * of popping it into a temporary buffer first. This only works when the
+ * message is all the ring holds, does not wrap, and leaves a spare byte for
+ * the terminator the JSON decoders rely on.
+ *
+ * @param ring Pointer to the ring buffer structure
+ * @param len  Length of the message the caller wants to consume
+ * @return Pointer into the ring data, or NULL if the message must be copied
+ */
+static uint8_t *rx_ring_buffer_peek(struct ring_buffer *ring, uint32_t len) {
+    if (len == 0 || ring->sz != len || ring->cur + len >= ring->cap) {
+        return NULL;
+    }
+
+    ring->data[ring->cur + len] = '\0';
+    return &ring->data[ring->cur];
+}
+
+/**
+ * @brief Discards len bytes from the head of a ring buffer
+ *
+ * @param ring Pointer to the ring buffer structure
+ * @param len  Number of bytes to discard
+ */
+static void rx_ring_buffer_drain(struct ring_buffer *ring, uint32_t len) {
+    len = MIN(len, ring->sz);
+    if (len == 0) {
+        return;
+    }
+
+    ring->cur = (ring->cur + len) % ring->cap;
+    ring->sz -= len;
+    ring_buffer_trim(ring);
+}
+
+/**
+ * @brief Returns the buffer stream payload is staged in before decoding
+ *
+ * Compressed and UDP payload is moved here for its decoder, which drains
+ * it on every call, so one per thread is enough.
+ *
+ * @return The scratch evbuffer, NULL on allocation failure
+ */
+static struct evbuffer *rx_scratch(void) {
+    static __thread struct evbuffer *scratch;
+
+    if (!scratch) {
+        scratch = evbuffer_new();
+    }
+    return scratch;
+}
+
+static uint32_t tx_ring_buffer_move(struct evbuffer *dst, struct ring_buffer *ring,
+                                    uint32_t len);
+static long tx_ring_buffer_unzip(struct proxy_client *pc, struct ring_buffer *ring,
+                                 uint32_t len);
+
 /**
  * @brief Processes data received from a tmux stream
  *
@@ -769,7 +1594,7 @@ int rx_ring_buffer_pop(struct ring_buffer *ring, uint8_t *data, uint32_t len) {
  * @param fn Callback function to handle processed data
  * @param param Additional parameters (typically proxy client structure)
  *
- * @return Returns length of processed data on success, 0 on failure
+ * @return Returns 1 when the frame was consumed, 0 on protocol failure
  *
  * The function performs the following operations:
  * - Validates stream and flags
@@ -798,49 +1623,306 @@ static int process_data(struct tmux_stream *stream, uint32_t length,
 
     if (!get_stream_by_id(stream_id)) {
         debug(LOG_DEBUG, "Stream %d no longer exists", stream_id);
-        return length;
+        return 1;
+    }
+
+    if (length > stream->recv_window) {
+        debug(LOG_ERR, "Receive window exceeded (available: %u, requested: %u)",
+              stream->recv_window, length);
+        return 0;
+    }
+
+    stream->recv_window -= length;
+
+    struct proxy_client *pc = (struct proxy_client *)param;
+    uint32_t bytes_processed = 0;
+
+    if (!pc || (!pc->local_proxy_bev && !pc->udp && !is_socks5_proxy(pc->ps))) {
+        if (length == 0) {
+            return 1;
+        }
+
+        // Hand the payload over in place when it does not wrap in the ring
+        uint8_t *copy = NULL;
+        uint8_t *data = rx_ring_buffer_peek(&stream->rx_ring, length);
+        if (!data) {
+            copy = calloc(length + 1, sizeof(uint8_t));
+            if (!copy) {
+                debug(LOG_ERR, "Memory allocation failed for data buffer");
+                return 0;
+            }
+            rx_ring_buffer_pop(&stream->rx_ring, copy, length);
+            data = copy;
+        }
+
+        handle_fn(data, length, pc);
+        if (copy) {
+            free(copy);
+        } else if (get_stream_by_id(stream_id) == stream) {
+            rx_ring_buffer_drain(&stream->rx_ring, length);
+        }
+
+        // The handler may have torn the stream down
+        if (get_stream_by_id(stream_id) != stream) {
+            return 1;
+        }
+        bytes_processed = length;
+    } 
+    else if (is_socks5_proxy(pc->ps)) {
+        bytes_processed = handle_ss5(pc, &stream->rx_ring, length);
+    } 
+    else if (is_udp_proxy(pc->ps)) {
+        struct evbuffer *scratch = rx_scratch();
+        if (!scratch) {
+            return 0;
+        }
+        tx_ring_buffer_move(scratch, &stream->rx_ring, length);
+        if (handle_udp_work_data(pc, scratch) < 0) {
+            debug(LOG_ERR, "stream %d: malformed udp messages, resetting", stream_id);
+            tcp_mux_send_win_update_rst(tmux_stream_bev(stream), stream_id);
+            del_proxy_client_by_stream_id(stream_id);
+            return 1;
+        }
+        bytes_processed = length;
+    }
+    else if (pc->zip_in) {
+        if (tx_ring_buffer_unzip(pc, &stream->rx_ring, length) < 0) {
+            debug(LOG_ERR, "stream %d: corrupt compressed data, resetting", stream_id);
+            tcp_mux_send_win_update_rst(tmux_stream_bev(stream), stream_id);
+            del_proxy_client_by_stream_id(stream_id);
+            return 1;
+        }
+        bytes_processed = length;
+    }
+    else {
+        bytes_processed = tx_ring_buffer_write(pc->local_proxy_bev, 
+                                              &stream->rx_ring, 
+                                              length);
+    }
+
+    if (bytes_processed != length) {
+        debug(LOG_INFO, "Incomplete data transfer - processed: %u, expected: %u",
+              bytes_processed, length);
+    }
+
+    send_window_update(tmux_stream_bev(stream), stream, bytes_processed);
+
+    return 1;
+}
+
+/**
+ * @brief Returns the number of bytes queued on a stream for the scheduler.
+ *
+ * @param stream Pointer to the tmux_stream structure
+ * @return Queued bytes
+ */
+static uint32_t tmux_stream_queued(struct tmux_stream *stream) {
+    return stream->txq ? evbuffer_get_length(stream->txq) : 0;
+}
+
+/**
+ * @brief Appends a stream to the send queue of its session.
+ *
+ * @param stream Pointer to the tmux_stream structure, attached to a session
+ */
+static void tmux_sched_enqueue(struct tmux_stream *stream) {
+    struct tmux_session *session = stream->session;
+
+    if (stream->scheduled) {
+        return;
+    }
+
+    stream->scheduled = true;
+    stream->sched_next = NULL;
+    stream->sched_prev = session->sched_tail;
+    if (session->sched_tail) {
+        session->sched_tail->sched_next = stream;
+    } else {
+        session->sched_head = stream;
+    }
+    session->sched_tail = stream;
+}
+
+/**
+ * @brief Takes a stream off the send queue of its session.
+ *
+ * @param stream Pointer to the tmux_stream structure
+ */
+static void tmux_sched_dequeue(struct tmux_stream *stream) {
+    struct tmux_session *session = stream->session;
+
+    if (!stream->scheduled) {
+        return;
+    }
+
+    if (stream->sched_prev) {
+        stream->sched_prev->sched_next = stream->sched_next;
+    } else {
+        session->sched_head = stream->sched_next;
+    }
+    if (stream->sched_next) {
+        stream->sched_next->sched_prev = stream->sched_prev;
+    } else {
+        session->sched_tail = stream->sched_prev;
+    }
+
+    stream->scheduled = false;
+    stream->sched_next = stream->sched_prev = NULL;
+}
+
+/**
+ * @brief Moves queued data of a stream into one DATA frame.
+ *
+ * @param stream Pointer to the tmux_stream structure
+ * @param quota  Most bytes to send, the send window limits it further
+ * @return Number of bytes sent
+ */
+static uint32_t tmux_stream_serve(struct tmux_stream *stream, uint32_t quota) {
+    uint32_t len = MIN(MIN(tmux_stream_queued(stream), stream->send_window), quota);
+    if (len == 0) {
+        return 0;
+    }
+
+    struct bufferevent *bout = tmux_stream_bev(stream);
+    tcp_mux_send_data(bout, get_send_flags(stream), stream->id, len);
+    evbuffer_remove_buffer(stream->txq, tmux_tx_buffer(bout), len);
+    stream->send_window -= len;
+    return len;
+}
+
+/**
+ * @brief Lets the local connection of a paused stream read again.
+ *
+ * Nothing happens while the stream is still blocked.
+ *
+ * @param stream Pointer to the tmux_stream structure
+ */
+static void tmux_stream_resume(struct tmux_stream *stream) {
+    if (!stream->read_paused || tmux_stream_blocked(stream)) {
+        return;
+    }
+
+    stream->read_paused = false;
+    struct proxy_client *pc = get_stream_owner(stream->id);
+    if (!pc || (!pc->local_proxy_bev && !pc->udp)) {
+        return;
+    }
+
+    debug(LOG_DEBUG, "stream %d: resuming local reads", stream->id);
+    if (pc->udp) {
+        udp_tunnel_resume(pc);
+    } else {
+        bufferevent_enable(pc->local_proxy_bev, EV_READ);
+    }
+}
+
+/**
+ * @brief Follows up on a stream the scheduler has sent data for.
+ *
+ * Once the queue is empty, a FIN held back by tmux_stream_close() is sent,
+ * and the stream is freed if the remote side had closed too. Otherwise the
+ * local connection may resume reading.
+ *
+ * @param stream Pointer to the tmux_stream structure, off the send queue
+ */
+static void tmux_stream_served(struct tmux_stream *stream) {
+    if (!stream->fin_pending || tmux_stream_queued(stream) > 0) {
+        tmux_stream_resume(stream);
+        return;
+    }
+
+    stream->fin_pending = false;
+    tcp_mux_send_win_update(tmux_stream_bev(stream), get_send_flags(stream) | FIN,
+                            stream->id, 0);
+    if (stream->state == CLOSED) {
+        debug(LOG_DEBUG, "del proxy client %d", stream->id);
+        del_proxy_client_by_stream_id(stream->id);
+    }
+}
+
+/**
+ * @brief Runs deficit round robin over the send queue of a session.
+ *
+ * Each visit adds TMUX_SCHED_QUANTUM times the stream weight to its
+ * deficit and sends up to the deficit. A stream leaves the queue when it
+ * has nothing more to send or its send window is exhausted; the next
+ * window update puts it back. The session backlog is kept near
+ * TX_SCHED_LIMIT, so a newly active stream waits for at most one round
+ * instead of behind everything bulk streams have queued.
+ *
+ * @param session Pointer to the tmux_session structure
+ */
+static void tmux_sched_run(struct tmux_session *session) {
+    while (session->sched_head && session->bev &&
+           tmux_session_backlog(session) < TX_SCHED_LIMIT) {
+        struct tmux_stream *stream = session->sched_head;
+
+        stream->deficit += TMUX_SCHED_QUANTUM * stream->weight;
+        stream->deficit -= tmux_stream_serve(stream, stream->deficit);
+
+        tmux_sched_dequeue(stream);
+        if (tmux_stream_queued(stream) > 0 && stream->send_window > 0) {
+            tmux_sched_enqueue(stream);
+            continue;
+        }
+
+        stream->deficit = 0;
+        tmux_stream_served(stream);
+    }
+}
+
+/**
+ * @brief Queues data of a stream and lets the scheduler send what it can.
+ *
+ * @param stream Pointer to the tmux_stream structure
+ */
+static void tmux_stream_kick(struct tmux_stream *stream) {
+    if (!stream->session) {
+        // Without a session there is no queue to share, send what the window allows
+        tmux_stream_serve(stream, UINT32_MAX);
+        return;
     }
 
-    if (length > stream->recv_window) {
-        debug(LOG_ERR, "Receive window exceeded (available: %u, requested: %u)",
-              stream->recv_window, length);
-        return 0;
+    if (stream->send_window > 0) {
+        tmux_sched_enqueue(stream);
     }
+    tmux_sched_run(stream->session);
+}
 
-    stream->recv_window -= length;
-
-    struct proxy_client *pc = (struct proxy_client *)param;
-    uint32_t bytes_processed = 0;
-
-    if (!pc || (!pc->local_proxy_bev && !is_socks5_proxy(pc->ps))) {
-        uint8_t *data = calloc(length, sizeof(uint8_t));
-        if (!data) {
-            debug(LOG_ERR, "Memory allocation failed for data buffer");
-            return 0;
-        }
+/**
+ * @brief Stream table visitor resuming the streams of one session
+ *
+ * @param owner The proxy client of a stream
+ * @param arg   The session that drained
+ */
+static void tmux_session_resume_stream(void *owner, void *arg) {
+    struct proxy_client *pc = owner;
 
-        bytes_processed = rx_ring_buffer_pop(&stream->rx_ring, data, length);
-        handle_fn(data, bytes_processed, pc);
-        free(data);
-    } 
-    else if (is_socks5_proxy(pc->ps)) {
-        bytes_processed = handle_ss5(pc, &stream->rx_ring, length);
-    } 
-    else {
-        bytes_processed = tx_ring_buffer_write(pc->local_proxy_bev, 
-                                              &stream->rx_ring, 
-                                              length);
+    if (pc->stream.session == arg) {
+        tmux_stream_resume(&pc->stream);
     }
+}
 
-    if (bytes_processed != length) {
-        debug(LOG_INFO, "Incomplete data transfer - processed: %u, expected: %u",
-              bytes_processed, length);
+/**
+ * @brief Write callback of a mux session connection
+ *
+ * @param bev The bufferevent of the connection
+ * @param ctx Unused
+ */
+void tmux_session_write_cb(struct bufferevent *bev, void *ctx) {
+    struct tmux_session *session = tmux_session_of(bev);
+    if (!session) {
+        return;
     }
 
-    struct bufferevent *bout = get_main_control()->connect_bev;
-    send_window_update(bout, stream, bytes_processed);
+    tmux_sched_run(session);
 
-    return length;
+    if (!session->throttled || tmux_session_backlog(session) > TX_LOW_WATERMARK) {
+        return;
+    }
+
+    session->throttled = false;
+    foreach_stream_owner(tmux_session_resume_stream, session);
 }
 
 /**
@@ -848,7 +1930,8 @@ static int process_data(struct tmux_stream *stream, uint32_t length,
  *
  * This function handles the send window increment for a TCP multiplexed stream.
  * It processes the flags, validates the stream exists, and updates its send window.
- * When the send window transitions from 0, it re-enables read events on the buffer.
+ * A stream with queued data goes back to the scheduler; otherwise its local
+ * connection resumes reading if it was paused.
  *
  * @param bev The bufferevent associated with the connection
  * @param tmux_hdr Pointer to the TCP multiplexer header containing length info
@@ -884,17 +1967,18 @@ static int incr_send_window(struct bufferevent *bev,
     // Get window increment size
     uint32_t increment = ntohl(tmux_hdr->length);
 
-    // Enable read events if window was previously full
-    if (stream->send_window == 0) {
-        debug(LOG_DEBUG, "Enabling read events for stream %d", stream_id);
-        bufferevent_enable(bev, EV_READ);
-    }
-
     // Update send window
     stream->send_window += increment;
     debug(LOG_DEBUG, "Stream %d send window increased by %u to %u", 
           stream_id, increment, stream->send_window);
 
+    // Queued data goes first, the scheduler resumes the stream once it is sent
+    if (tmux_stream_queued(stream) > 0) {
+        tmux_stream_kick(stream);
+    } else {
+        tmux_stream_resume(stream);
+    }
+
     return 1;
 }
 
@@ -939,29 +2023,35 @@ static int incoming_stream(uint32_t stream_id) {
  * Processes incoming TCP multiplexer ping messages and sends appropriate responses.
  * When a SYN flag is received in the ping message, it sends back a ping acknowledgment
  * to maintain connection liveliness.
+ * An acknowledgment of our own PING refreshes the session keepalive and RTT.
  *
+ * @param bev The bufferevent of the session the ping arrived on
  * @param tmux_hdr Pointer to the TCP multiplexer header containing ping information
  *
  * @note Only responds to pings with SYN flag set
  * @note Ping ID is converted from network byte order before processing
  */
-void handle_tcp_mux_ping(struct tcp_mux_header *tmux_hdr) {
+void handle_tcp_mux_ping(struct bufferevent *bev, struct tcp_mux_header *tmux_hdr) {
     if (!tmux_hdr) {
         debug(LOG_ERR, "Invalid TCP MUX header");
         return;
     }
 
-    struct bufferevent *bout = NULL;
     uint16_t flags = ntohs(tmux_hdr->flags);
     uint32_t ping_id = ntohl(tmux_hdr->length);
 
+    if (flags & ACK) {
+        tcp_mux_ping_acked(tmux_session_of(bev), ping_id);
+        return;
+    }
+
     // Only handle ping messages with SYN flag
     if ((flags & SYN) == SYN) {
-        if (!(bout = get_main_control()->connect_bev)) {
+        if (!bev) {
             debug(LOG_ERR, "No valid bufferevent for ping response");
             return;
         }
-        tcp_mux_handle_ping(bout, ping_id);
+        tcp_mux_handle_ping(bev, ping_id);
     }
 }
 
@@ -1026,6 +2116,7 @@ void handle_tcp_mux_go_away(struct tcp_mux_header *tmux_hdr) {
  * @param len Maximum number of bytes to read
  * @return The actual number of bytes read into the stream's ring buffer
  *
+ * @note The ring may grow up to the stream window
  * @note The function will assert if stream parameter is NULL
  */
 uint32_t tmux_stream_read(struct bufferevent *bev, struct tmux_stream *stream,
@@ -1043,6 +2134,13 @@ uint32_t tmux_stream_read(struct bufferevent *bev, struct tmux_stream *stream,
               stream->id, stream->state, len);
     }
 
+    // Payload within the window must fit, let the ring grow that far
+    uint32_t limit = RBUF_SIZE;
+    while (limit < stream->max_window && limit < (1U << 31)) {
+        limit <<= 1;
+    }
+    ring_buffer_reserve(&stream->rx_ring, len, limit);
+
     // Perform the actual read operation
     uint32_t bytes_read = rx_ring_buffer_read(bev, &stream->rx_ring, len);
 
@@ -1092,14 +2190,14 @@ int handle_tcp_mux_stream(struct tcp_mux_header *tmux_hdr,
     }
 
     // Validate stream exists
-    struct tmux_stream *stream = get_stream_by_id(stream_id);
+    struct proxy_client *pc = NULL;
+    struct tmux_stream *stream = get_stream_and_owner(stream_id, (void **)&pc);
     if (!stream) {
         debug(LOG_ERR, "Stream %d not found", stream_id);
         return 0;
     }
 
-    struct proxy_client *pc = get_proxy_client(stream_id);
-    struct bufferevent *bout = get_main_control()->connect_bev;
+    struct bufferevent *bout = tmux_stream_bev(stream);
 
     // Handle window updates
     if (tmux_hdr->type == WINDOW_UPDATE) {
@@ -1128,54 +2226,161 @@ int handle_tcp_mux_stream(struct tcp_mux_header *tmux_hdr,
 }
 
 /**
- * @brief Appends data to a ring buffer
- *
- * This function adds data to a ring buffer in a circular fashion. It handles buffer
- * wraparound when the end is reached. The function will stop appending if it catches
- * up with the current read position (cur).
+ * @brief Checks whether DATA payload for a proxy client may skip the rx ring
  *
- * @param ring Pointer to the ring buffer structure
- * @param data Pointer to the data to be appended
- * @param len Length of data to append
+ * Payload can be moved straight to the local connection once that connection
+ * exists and nothing older is still queued in the rx ring. SOCKS5 streams
+ * qualify after their handshake, UDP streams never do since their payload
+ * still needs to be decoded.
  *
- * @pre len must be less than or equal to available space (WBUF_SIZE - ring->sz)
- * 
- * @return Number of bytes actually appended to the ring buffer
+ * @param stream Pointer to the stream receiving the payload
+ * @param pc     Proxy client owning the stream, may be NULL
+ * @return 1 if the payload can be forwarded directly, 0 otherwise
  */
-static int tx_ring_buffer_append(struct ring_buffer *ring, uint8_t *data, uint32_t len) {
-    // Validate inputs and capacity
-    if (!ring || !data || len == 0) {
+static int can_forward_data(struct tmux_stream *stream, struct proxy_client *pc) {
+    if (!pc || !pc->local_proxy_bev || stream->rx_ring.sz > 0) {
         return 0;
     }
 
-    uint32_t available_space = WBUF_SIZE - ring->sz;
-    if (available_space < len) {
+    if (is_udp_proxy(pc->ps)) {
         return 0;
     }
 
-    uint32_t bytes_written = 0;
-    while (bytes_written < len) {
-        // Calculate contiguous space until buffer wrap
-        uint32_t contiguous_space = MIN(len - bytes_written, 
-                                      WBUF_SIZE - ring->end);
-        
-        // Copy block of data
-        memcpy(&ring->data[ring->end], 
-               &data[bytes_written], 
-               contiguous_space);
-        
-        // Update ring buffer state
-        ring->end = (ring->end + contiguous_space) % WBUF_SIZE;
-        ring->sz += contiguous_space;
-        bytes_written += contiguous_space;
+    if (is_socks5_proxy(pc->ps) && pc->state != SOCKS5_ESTABLISHED) {
+        return 0;
+    }
 
-        // Stop if we've caught up with read pointer
-        if (ring->cur == ring->end) {
-            break;
+    return 1;
+}
+
+/**
+ * @brief Starts processing of an incoming DATA frame
+ *
+ * Frames for control streams, streams that are not yet bound to a local
+ * connection and SOCKS5 handshakes keep going through the rx ring. Everything
+ * else is forwarded: flags and receive window are accounted for here, in the
+ * same order process_data() uses, so the payload can be streamed out as it
+ * arrives.
+ *
+ * @param tmux_hdr Pointer to the TCP MUX header of the DATA frame
+ * @return TMUX_FRAME_BUFFER, TMUX_FRAME_FORWARD or TMUX_FRAME_DISCARD,
+ *         -1 on a protocol error
+ */
+int tmux_stream_data_begin(struct tcp_mux_header *tmux_hdr) {
+    uint32_t stream_id = ntohl(tmux_hdr->stream_id);
+    uint32_t length = ntohl(tmux_hdr->length);
+    uint16_t flags = ntohs(tmux_hdr->flags);
+
+    struct proxy_client *pc = NULL;
+    struct tmux_stream *stream = get_stream_and_owner(stream_id, (void **)&pc);
+    if (!stream) {
+        debug(LOG_INFO, "Dropping %u bytes for unknown stream %u", length, stream_id);
+        return TMUX_FRAME_DISCARD;
+    }
+
+    if ((flags & SYN) == SYN || !can_forward_data(stream, pc)) {
+        // process_data() charges the window once the frame is complete
+        if (length > stream->recv_window) {
+            debug(LOG_ERR, "Receive window exceeded (available: %u, requested: %u)",
+                  stream->recv_window, length);
+            return -1;
         }
+        return TMUX_FRAME_BUFFER;
+    }
+
+    if (stream->state != ESTABLISHED) {
+        debug(LOG_ERR, "Stream %d not in ESTABLISHED state", stream_id);
+        return TMUX_FRAME_DISCARD;
+    }
+
+    if (!process_flags(flags, stream)) {
+        debug(LOG_ERR, "Failed to process flags for stream %d", stream_id);
+        return -1;
+    }
+
+    if (!get_stream_by_id(stream_id)) {
+        debug(LOG_DEBUG, "Stream %d no longer exists", stream_id);
+        return TMUX_FRAME_DISCARD;
+    }
+
+    if (length > stream->recv_window) {
+        debug(LOG_ERR, "Receive window exceeded (available: %u, requested: %u)",
+              stream->recv_window, length);
+        return -1;
+    }
+
+    stream->recv_window -= length;
+    return TMUX_FRAME_FORWARD;
+}
+
+/**
+ * @brief Moves forwarded DATA payload to the stream's local connection
+ *
+ * @param src       Input evbuffer of the control connection
+ * @param stream_id Stream ID the payload belongs to
+ * @param len       Number of payload bytes available in src
+ * @return Number of bytes handed to the local connection
+ */
+uint32_t tmux_stream_forward(struct evbuffer *src, uint32_t stream_id,
+                             uint32_t len) {
+    struct proxy_client *pc = NULL;
+    struct tmux_stream *stream = get_stream_and_owner(stream_id, (void **)&pc);
+
+    // The local side may have gone away while the frame was in flight
+    if (!pc || !pc->local_proxy_bev) {
+        evbuffer_drain(src, len);
+        return 0;
+    }
+
+    struct evbuffer *dst = pc->zip_in ? rx_scratch() : bufferevent_get_output(pc->local_proxy_bev);
+    int moved = dst ? evbuffer_remove_buffer(src, dst, len) : -1;
+    if (moved < 0) {
+        debug(LOG_ERR, "Failed to forward %u bytes for stream %u", len, stream_id);
+        evbuffer_drain(src, len);
+        return 0;
+    }
+
+    if (pc->zip_in &&
+        zip_decompress(pc->zip_in, dst, bufferevent_get_output(pc->local_proxy_bev)) < 0) {
+        debug(LOG_ERR, "stream %u: corrupt compressed data, resetting", stream_id);
+        tcp_mux_send_win_update_rst(tmux_stream_bev(stream), stream_id);
+        del_proxy_client_by_stream_id(stream_id);
+        return 0;
+    }
+
+    // Credit for what still sits in the local output comes back as it drains
+    struct bufferevent *local = pc->local_proxy_bev;
+    uint32_t unsent = evbuffer_get_length(bufferevent_get_output(local));
+    send_window_update(tmux_stream_bev(stream), stream, unsent);
+    if (unsent > 0) {
+        bufferevent_setwatermark(local, EV_WRITE, stream->max_window / 2, 0);
+    }
+    return moved;
+}
+
+/**
+ * @brief Write callback of the local connection of a proxy client
+ *
+ * Returns the receive window credit tmux_stream_forward() held back while
+ * the payload waited in the local output, once that has drained to half
+ * the stream window. Does nothing for streams that are not established.
+ *
+ * @param bev The local bufferevent of the proxy client
+ * @param ctx Pointer to the proxy client
+ */
+void tmux_stream_local_write_cb(struct bufferevent *bev, void *ctx) {
+    struct proxy_client *pc = ctx;
+    if (!pc || pc->local_proxy_bev != bev) {
+        return;
     }
 
-    return bytes_written;
+    struct tmux_stream *stream = &pc->stream;
+    if (stream->state != ESTABLISHED || get_stream_by_id(stream->id) != stream) {
+        return;
+    }
+
+    send_window_update(tmux_stream_bev(stream), stream,
+                       evbuffer_get_length(bufferevent_get_output(bev)));
 }
 
 /**
@@ -1192,32 +2397,31 @@ static int tx_ring_buffer_append(struct ring_buffer *ring, uint8_t *data, uint32
  *         Returns 0 if the ring buffer is already full
  *
  * @note Reading stops if the end pointer catches up to the current position (cur)
- *       The function handles wrap-around when end reaches RBUF_SIZE
+ *       The ring grows on demand up to RBUF_SIZE
  */
 uint32_t rx_ring_buffer_read(struct bufferevent *bev, struct ring_buffer *ring,
                              uint32_t len) {
-    // Check if buffer is full
-    if (ring->sz == RBUF_SIZE) {
+    // Grow the ring as far as needed and allowed
+    uint32_t available_space = ring_buffer_reserve(ring, len, RBUF_SIZE);
+    if (available_space == 0) {
         debug(LOG_ERR, "ring buffer is full");
         return 0;
     }
 
-    // Calculate available capacity and adjust length if needed
-    uint32_t available_space = RBUF_SIZE - ring->sz;
     uint32_t bytes_to_read = MIN(len, available_space);
     uint32_t bytes_read = 0;
 
     while (bytes_read < bytes_to_read) {
         // Calculate contiguous space until buffer wrap
         uint32_t contiguous_space = MIN(bytes_to_read - bytes_read, 
-                                      RBUF_SIZE - ring->end);
+                                      ring->cap - ring->end);
         
         // Read a block of contiguous data
         uint32_t n = bufferevent_read(bev, 
                                     &ring->data[ring->end], 
                                     contiguous_space);
         
-        ring->end = (ring->end + n) % RBUF_SIZE;
+        ring->end = (ring->end + n) % ring->cap;
         ring->sz += n;
         bytes_read += n;
 
@@ -1231,24 +2435,15 @@ uint32_t rx_ring_buffer_read(struct bufferevent *bev, struct ring_buffer *ring,
 }
 
 /**
- * @brief Writes data from a ring buffer to a bufferevent
+ * @brief Moves data from a ring buffer to an evbuffer
  *
- * This function writes up to 'len' bytes from the ring buffer to the specified bufferevent.
- * It handles buffer wrapping at WBUF_SIZE boundary and updates ring buffer state accordingly.
- *
- * @param bev The bufferevent to write data to
+ * @param dst  The evbuffer to append the data to
  * @param ring Pointer to the ring buffer structure containing the data
- * @param len Maximum number of bytes to write
- *
- * @return The actual number of bytes written. Returns 0 if the ring buffer is empty.
- *         Otherwise returns the number of bytes successfully written, which may be
- *         less than or equal to len depending on available data in ring buffer.
- *
- * @note The function writes one byte at a time and handles buffer wraparound.
- *       It will stop writing if it reaches the end marker of the ring buffer.
+ * @param len  Maximum number of bytes to move
+ * @return The number of bytes moved, 0 if the ring buffer is empty
  */
-uint32_t tx_ring_buffer_write(struct bufferevent *bev, struct ring_buffer *ring,
-                              uint32_t len) {
+static uint32_t tx_ring_buffer_move(struct evbuffer *dst, struct ring_buffer *ring,
+                                    uint32_t len) {
     // Check for empty buffer
     if (ring->sz == 0) {
         debug(LOG_ERR, "ring buffer is empty");
@@ -1263,13 +2458,13 @@ uint32_t tx_ring_buffer_write(struct bufferevent *bev, struct ring_buffer *ring,
 
     while (bytes_to_write > 0) {
         // Calculate contiguous bytes available until buffer wrap or end
-        contiguous_bytes = MIN(bytes_to_write, WBUF_SIZE - ring->cur);
+        contiguous_bytes = MIN(bytes_to_write, ring->cap - ring->cur);
         
         // Write contiguous block of data
-        bufferevent_write(bev, &ring->data[ring->cur], contiguous_bytes);
+        evbuffer_add(dst, &ring->data[ring->cur], contiguous_bytes);
         
         // Update ring buffer state
-        ring->cur = (ring->cur + contiguous_bytes) % WBUF_SIZE;
+        ring->cur = (ring->cur + contiguous_bytes) % ring->cap;
         ring->sz -= contiguous_bytes;
         bytes_to_write -= contiguous_bytes;
 
@@ -1280,31 +2475,95 @@ uint32_t tx_ring_buffer_write(struct bufferevent *bev, struct ring_buffer *ring,
         }
     }
 
+    ring_buffer_trim(ring);
     return len - bytes_to_write;
 }
 
+/**
+ * @brief Decompresses data from a ring buffer into the local connection
+ *
+ * @param pc   Proxy client of a stream with use_compression
+ * @param ring Pointer to the ring buffer structure containing the data
+ * @param len  Number of compressed bytes to consume
+ * @return Number of bytes written to the local connection, -1 if corrupt
+ */
+static long tx_ring_buffer_unzip(struct proxy_client *pc, struct ring_buffer *ring,
+                                 uint32_t len) {
+    struct evbuffer *scratch = rx_scratch();
+    if (!scratch) {
+        return -1;
+    }
+
+    tx_ring_buffer_move(scratch, ring, len);
+    return zip_decompress(pc->zip_in, scratch, bufferevent_get_output(pc->local_proxy_bev));
+}
+
+/**
+ * @brief Writes data from a ring buffer to a bufferevent
+ *
+ * This function writes up to 'len' bytes from the ring buffer to the specified bufferevent.
+ * It handles buffer wrapping at the ring capacity and updates ring buffer state accordingly.
+ *
+ * @param bev The bufferevent to write data to
+ * @param ring Pointer to the ring buffer structure containing the data
+ * @param len Maximum number of bytes to write
+ *
+ * @return The actual number of bytes written. Returns 0 if the ring buffer is empty.
+ *         Otherwise returns the number of bytes successfully written, which may be
+ *         less than or equal to len depending on available data in ring buffer.
+ *
+ * @note The function writes one byte at a time and handles buffer wraparound.
+ *       It will stop writing if it reaches the end marker of the ring buffer.
+ */
+uint32_t tx_ring_buffer_write(struct bufferevent *bev, struct ring_buffer *ring,
+                              uint32_t len) {
+    return tx_ring_buffer_move(bufferevent_get_output(bev), ring, len);
+}
+
+/**
+ * @brief Returns the send queue of a stream, creating it on first use
+ *
+ * @param stream Pointer to the tmux_stream structure
+ * @return The queue, NULL if it could not be allocated
+ */
+static struct evbuffer *tmux_stream_txq(struct tmux_stream *stream) {
+    if (!stream->txq) {
+        stream->txq = evbuffer_new();
+        if (!stream->txq) {
+            debug(LOG_ERR, "Failed to allocate send queue of stream %d", stream->id);
+        }
+    }
+    return stream->txq;
+}
+
+/**
+ * @brief Tells whether a write may bypass the send queue of its session
+ *
+ * @param stream Pointer to the tmux_stream structure
+ * @param length Bytes to send
+ * @return true if nothing is queued anywhere on the session and the window
+ *         covers length
+ */
+static bool tmux_stream_direct(struct tmux_stream *stream, size_t length) {
+    return tmux_stream_queued(stream) == 0 && length <= stream->send_window &&
+           stream->session && !stream->session->sched_head &&
+           tmux_session_backlog(stream->session) < TX_SCHED_LIMIT;
+}
+
 /**
  * @brief Writes data to a TCP multiplexing stream with flow control
  *
- * This function handles writing data to a TCP multiplexing stream while managing
- * flow control through send windows and buffering. It handles different stream
- * states and buffer conditions.
+ * When the session is idle and the send window allows, the data goes out
+ * at once. Otherwise it is queued on the stream and the transmit scheduler
+ * sends it as the window and the session backlog allow, fairly among the
+ * streams of the session.
  *
  * @param bev The bufferevent structure for writing data
  * @param data Pointer to the data buffer to be written
  * @param length Length of the data to be written
  * @param stream Pointer to the tmux_stream structure containing stream state and buffers
  *
- * @return uint32_t Number of bytes processed (may be 0 if stream is closed or window is full)
- *
- * The function handles several cases:
- * - Returns 0 if stream is in CLOSED, LOCAL_CLOSE, or RESET state
- * - Buffers data if send window is 0
- * - Manages partial writes based on available send window size
- * - Handles buffered data in tx_ring along with new data
- *
- * Flow control is maintained through the stream's send_window, which is decremented
- * by the number of bytes processed.
+ * @return Number of bytes sent or queued, 0 if the stream is closed
  */
 uint32_t tmux_stream_write(struct bufferevent *bev, uint8_t *data,
                            uint32_t length, struct tmux_stream *stream) {
@@ -1314,49 +2573,106 @@ uint32_t tmux_stream_write(struct bufferevent *bev, uint8_t *data,
         return 0;
     }
 
-    struct ring_buffer *tx_ring = &stream->tx_ring;
-    uint32_t available_window = stream->send_window;
-    uint32_t buffered_size = tx_ring->sz;
-    uint32_t total_data_size = buffered_size + length;
+    if (length == 0) {
+        return 0;
+    }
+
+    if (tmux_stream_direct(stream, length)) {
+        // Send data header, the payload follows it into the same batch
+        struct bufferevent *bout = tmux_stream_bev(stream);
+        tcp_mux_send_data(bout, get_send_flags(stream), stream->id, length);
+        evbuffer_add(tmux_tx_buffer(bout), data, length);
+        stream->send_window -= length;
+        return length;
+    }
 
-    // If send window is zero, buffer the data
-    if (available_window == 0) {
-        debug(LOG_INFO, "stream %d send_window is zero, buffering data", stream->id);
-        tx_ring_buffer_append(tx_ring, data, length);
+    struct evbuffer *txq = tmux_stream_txq(stream);
+    if (!txq || evbuffer_add(txq, data, length) < 0) {
+        debug(LOG_ERR, "stream %d: failed to queue %u bytes", stream->id, length);
         return 0;
     }
 
-    uint16_t flags = get_send_flags(stream);
-    struct bufferevent *bout = get_main_control()->connect_bev;
+    tmux_stream_kick(stream);
+    return length;
+}
 
-    // Determine how much data we can send
-    uint32_t max_send = (available_window < total_data_size) ? available_window : total_data_size;
+/**
+ * @brief Writes the content of an evbuffer to a TCP multiplexing stream
+ *
+ * Works like tmux_stream_write(), but moves the chains of src instead of
+ * copying them.
+ *
+ * @param bev    The bufferevent of the control connection
+ * @param src    Evbuffer holding the data to send, drained on return
+ * @param stream Pointer to the tmux_stream structure
+ * @return Number of bytes sent or queued, 0 if the stream is closed
+ */
+uint32_t tmux_stream_write_buffer(struct bufferevent *bev, struct evbuffer *src,
+                                  struct tmux_stream *stream) {
+    size_t length = evbuffer_get_length(src);
+    if (length == 0) {
+        return 0;
+    }
 
-    // Send data header
-    tcp_mux_send_data(bout, flags, stream->id, max_send);
+    if (stream->state == LOCAL_CLOSE || stream->state == CLOSED || stream->state == RESET) {
+        debug(LOG_INFO, "stream %d state is closed", stream->id);
+        evbuffer_drain(src, length);
+        return 0;
+    }
 
-    // Send data from tx_ring buffer if any
-    if (buffered_size > 0) {
-        uint32_t send_from_buffer = (max_send < buffered_size) ? max_send : buffered_size;
-        tx_ring_buffer_write(bev, tx_ring, send_from_buffer);
-        max_send -= send_from_buffer;
+    if (tmux_stream_direct(stream, length)) {
+        struct bufferevent *bout = tmux_stream_bev(stream);
+        tcp_mux_send_data(bout, get_send_flags(stream), stream->id, length);
+        evbuffer_remove_buffer(src, tmux_tx_buffer(bout), length);
+        stream->send_window -= length;
+        return length;
     }
 
-    // Send new data if there is remaining window
-    if (max_send > 0) {
-        bufferevent_write(bev, data, max_send);
+    struct evbuffer *txq = tmux_stream_txq(stream);
+    if (!txq || evbuffer_add_buffer(txq, src) < 0) {
+        debug(LOG_ERR, "stream %d: failed to queue %zu bytes", stream->id, length);
+        evbuffer_drain(src, length);
+        return 0;
     }
 
-    // Buffer any remaining new data
-    if (total_data_size > available_window) {
-        uint32_t remaining_data = total_data_size - available_window;
-        tx_ring_buffer_append(tx_ring, data + (length - remaining_data), remaining_data);
+    tmux_stream_kick(stream);
+    return length;
+}
+
+/**
+ * @brief Tells whether the producer of a tmux stream has to pause
+ *
+ * @param stream Pointer to the tmux_stream structure
+ * @return true if the stream cannot take more data right now
+ */
+bool tmux_stream_blocked(struct tmux_stream *stream) {
+    if (stream->send_window == 0 || tmux_stream_queued(stream) >= WBUF_SIZE) {
+        return true;
     }
+    return stream->session && tmux_session_backlog(stream->session) >= TX_HIGH_WATERMARK;
+}
 
-    // Update send window
-    stream->send_window -= (total_data_size - tx_ring->sz);
+/**
+ * @brief Pauses reading from the local connection of a tmux stream
+ *
+ * A session over its high watermark is marked throttled, so its write
+ * callback resumes the streams once the backlog drained.
+ *
+ * @param stream Pointer to the tmux_stream structure
+ * @param bev    The local connection feeding the stream, NULL if the caller
+ *               stops reading itself
+ */
+void tmux_stream_pause(struct tmux_stream *stream, struct bufferevent *bev) {
+    debug(LOG_DEBUG, "stream %d: pausing local reads (window %u, queued %u)",
+          stream->id, stream->send_window, tmux_stream_queued(stream));
+    if (bev) {
+        bufferevent_disable(bev, EV_READ);
+    }
+    stream->read_paused = true;
 
-    return (length - tx_ring->sz);
+    if (stream->session && tmux_session_backlog(stream->session) >= TX_HIGH_WATERMARK) {
+        stream->session->throttled = true;
+    }
 }
 
 /**
@@ -1372,7 +2688,8 @@ uint32_t tmux_stream_write(struct bufferevent *bev, uint8_t *data,
  *
  * @return Returns:
  *         - 0 if stream is already closed/reset or final closure is complete
- *         - 1 if stream entered LOCAL_CLOSE state but final closure is pending
+ *         - 1 if stream entered LOCAL_CLOSE state but final closure is pending,
+ *           which includes a FIN waiting behind queued data
  */
 int tmux_stream_close(struct bufferevent *bout, struct tmux_stream *stream) {
     uint8_t should_close = 0;
@@ -1394,6 +2711,12 @@ int tmux_stream_close(struct bufferevent *bout, struct tmux_stream *stream) {
             return 0;
     }
 
+    // Data still queued goes out first, the FIN follows when the queue drains
+    if (tmux_stream_queued(stream) > 0) {
+        stream->fin_pending = true;
+        return 1;
+    }
+
     uint16_t flags = get_send_flags(stream) | FIN;
     tcp_mux_send_win_update(bout, flags, stream->id, 0);
 
@@ -1405,3 +2728,164 @@ int tmux_stream_close(struct bufferevent *bout, struct tmux_stream *stream) {
     del_proxy_client_by_stream_id(stream->id);
     return 0;
 }
+
+/**
+ * @brief Resets a frame decoder to wait for the next frame header
+ *
+ * @param dec Pointer to the tmux_decoder structure
+ */
+void tmux_decoder_init(struct tmux_decoder *dec) {
+    memset(&dec->hdr, 0, sizeof(dec->hdr));
+    dec->remaining = 0;
+    dec->mode = TMUX_FRAME_HEADER;
+}
+
+/**
+ * @brief Consumes the payload of the current DATA frame
+ *
+ * Buffered payload that does not fit in the stream's rx ring is never
+ * dropped from the middle of the stream: the stream is reset instead, or
+ * the session if it is the control stream.
+ *
+ * @param dec Pointer to the decoder
+ * @param bev The bufferevent of the mux session
+ * @param len Number of payload bytes to consume, at most dec->remaining
+ * @return 0 on success, -1 if the session can not go on
+ */
+static int tmux_decoder_payload(struct tmux_decoder *dec, struct bufferevent *bev,
+                                uint32_t len) {
+    struct evbuffer *input = bufferevent_get_input(bev);
+    uint32_t stream_id = ntohl(dec->hdr.stream_id);
+
+    dec->remaining -= len;
+    switch (dec->mode) {
+        case TMUX_FRAME_FORWARD:
+            tmux_stream_forward(input, stream_id, len);
+            break;
+        case TMUX_FRAME_BUFFER: {
+            struct proxy_client *pc = NULL;
+            struct tmux_stream *stream = get_stream_and_owner(stream_id, (void **)&pc);
+            uint32_t nr = stream ? tmux_stream_read(bev, stream, len) : 0;
+            if (nr == len) {
+                break;
+            }
+
+            evbuffer_drain(input, len - nr);
+            dec->mode = TMUX_FRAME_DISCARD;
+            if (!stream) {
+                break;
+            }
+
+            debug(LOG_ERR, "Stream %u: no room for %u bytes of frame payload, resetting",
+                  stream_id, len - nr);
+            if (!pc) {
+                return -1;
+            }
+            tcp_mux_send_win_update_rst(bev, stream_id);
+            del_proxy_client_by_stream_id(stream_id);
+            break;
+        }
+        default:
+            evbuffer_drain(input, len);
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Ends a mux session with GO_AWAY
+ *
+ * The GO_AWAY is flushed right away, the caller drops the connection.
+ *
+ * @param bev    The bufferevent of the mux session
+ * @param reason PROTO_ERR or INTERNAL_ERR
+ */
+static void tmux_decoder_abort(struct bufferevent *bev, uint32_t reason) {
+    tcp_mux_send_go_away(bev, reason);
+    struct tmux_session *session = tmux_session_of(bev);
+    if (session) {
+        tmux_flush_cb(-1, 0, session);
+    }
+}
+
+/**
+ * @brief Decodes the frames available on a mux session connection
+ *
+ * Headers are copied out of the input buffer only once all 12 bytes have
+ * arrived. WINDOW_UPDATE, PING and GO_AWAY frames are handled right away.
+ * DATA payload is consumed chunk by chunk: streams bound to a local
+ * connection get it moved there as it arrives, only control traffic is
+ * collected in the stream rx ring and handed to @p fn once complete.
+ *
+ * @param dec Pointer to the decoder of the connection
+ * @param bev The bufferevent of the mux session
+ * @param fn  Handler for payload of streams without a local connection
+ * @return 0 on success, -1 on a protocol error
+ */
+int tmux_decoder_feed(struct tmux_decoder *dec, struct bufferevent *bev,
+                      handle_data_fn_t fn) {
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    for (;;) {
+        size_t len = evbuffer_get_length(input);
+
+        if (dec->mode == TMUX_FRAME_HEADER) {
+            if (len < sizeof(dec->hdr)) {
+                return 0;
+            }
+
+            evbuffer_copyout(input, &dec->hdr, sizeof(dec->hdr));
+            evbuffer_drain(input, sizeof(dec->hdr));
+            len -= sizeof(dec->hdr);
+
+            if (!validate_tcp_mux_protocol(&dec->hdr)) {
+                debug(LOG_ERR, "Invalid tcp mux frame: version %u, type %u",
+                      dec->hdr.version, dec->hdr.type);
+                tmux_decoder_abort(bev, PROTO_ERR);
+                return -1;
+            }
+
+            switch (dec->hdr.type) {
+                case WINDOW_UPDATE:
+                    handle_tcp_mux_stream(&dec->hdr, fn);
+                    continue;
+                case PING:
+                    handle_tcp_mux_ping(bev, &dec->hdr);
+                    continue;
+                case GO_AWAY:
+                    handle_tcp_mux_go_away(&dec->hdr);
+                    continue;
+                default:
+                    break;
+            }
+
+            int mode = tmux_stream_data_begin(&dec->hdr);
+            if (mode < 0) {
+                tmux_decoder_abort(bev, PROTO_ERR);
+                return -1;
+            }
+            dec->remaining = ntohl(dec->hdr.length);
+            dec->mode = mode;
+        }
+
+        if (dec->remaining > 0) {
+            if (len == 0) {
+                return 0;
+            }
+            if (tmux_decoder_payload(dec, bev,
+                                     (uint32_t)MIN(len, (size_t)dec->remaining)) < 0) {
+                tmux_decoder_abort(bev, INTERNAL_ERR);
+                return -1;
+            }
+            if (dec->remaining > 0) {
+                return 0;
+            }
+        }
+
+        if (dec->mode == TMUX_FRAME_BUFFER) {
+            handle_tcp_mux_stream(&dec->hdr, fn);
+        }
+        dec->mode = TMUX_FRAME_HEADER;
+    }
+}
@@ -7,18 +7,44 @@
 #ifndef XFRPC_TCPMUX_H
 #define XFRPC_TCPMUX_H
 
-#include "uthash.h"
 #include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
 
-#define MAX_STREAM_WINDOW_SIZE (256 * 1024)
-#define RBUF_SIZE (32 * 1024)
-#define WBUF_SIZE (32 * 1024)
+#define MAX_STREAM_WINDOW_SIZE (256 * 1024) /* initial window of every yamux stream */
+#define RBUF_SIZE (32 * 1024)   /* least capacity an rx ring may grow to */
+#define WBUF_SIZE (32 * 1024)   /* send queue length above which local reads pause */
 
+/*
+ * Backlog of a connection to frps, batched and unsent bytes, at which local
+ * reads feeding it pause, and the level it has to drain to before they resume.
+ */
+#define TX_HIGH_WATERMARK (1024 * 1024)
+#define TX_LOW_WATERMARK  (256 * 1024)
+
+/*
+ * Transmit scheduler. Stream data beyond what the session can take right
+ * away waits in a per stream queue; deficit round robin moves it to the
+ * session while its backlog is below TX_SCHED_LIMIT, TMUX_SCHED_QUANTUM
+ * bytes per round and unit of stream weight.
+ */
+#define TX_SCHED_LIMIT     (64 * 1024)
+#define TMUX_SCHED_QUANTUM (16 * 1024)
+#define TMUX_MAX_WEIGHT    64
+
+/*
+ * Stream ring buffer. The storage is taken from a shared block pool on first
+ * use, grows in powers of two and goes back to the pool as soon as the ring
+ * drains, so idle streams hold no buffer memory. An rx ring stops at the
+ * stream window rounded up to a power of two, at least RBUF_SIZE, so payload
+ * the peer sent within its credit always fits.
+ */
 struct ring_buffer {
     uint32_t cur;
     uint32_t end;
     uint32_t sz;
-    uint8_t data[RBUF_SIZE];
+    uint32_t cap;
+    uint8_t *data;
 };
 
 enum go_away_type {
@@ -55,6 +81,28 @@ struct __attribute__((__packed__)) tcp_mux_header {
     uint32_t length;
 };
 
+/**
+ * @brief How the payload of an incoming DATA frame is consumed.
+ */
+enum tmux_frame_mode {
+    TMUX_FRAME_BUFFER,  /* collect payload in the stream rx ring */
+    TMUX_FRAME_FORWARD, /* move payload straight to the local connection */
+    TMUX_FRAME_DISCARD, /* drop payload (unknown or rejected stream) */
+    TMUX_FRAME_HEADER,  /* between frames, waiting for the next header */
+};
+
+/**
+ * @brief Incremental decoder for the frames of one mux session.
+ *
+ * Keeps the frame being decoded across reads, so frames may arrive split at
+ * any byte. Each session connection owns one decoder.
+ */
+struct tmux_decoder {
+    struct tcp_mux_header hdr;  /* header of the current frame */
+    uint32_t remaining;         /* DATA payload bytes still to consume */
+    enum tmux_frame_mode mode;  /* how the current payload is consumed */
+};
+
 struct tcp_mux_flag_desc {
     enum tcp_mux_flag flag;
     char *desc;
@@ -71,20 +119,85 @@ enum tcp_mux_state {
     RESET
 };
 
+/**
+ * @brief One mux session, a TCP connection to frps carrying yamux streams.
+ *
+ * Besides the decoder, a session owns the batch its outgoing frames are
+ * collected in until the end of the event loop round, and the state of its
+ * PING keepalive.
+ */
+struct tmux_session {
+    struct bufferevent *bev;     /* connection to frps, NULL while down */
+    struct tmux_decoder decoder; /* decoder of incoming frames */
+    uint32_t nstreams;           /* streams attached to this session */
+
+    /* write coalescing */
+    struct evbuffer *tx_batch;   /* frames waiting for the flush */
+    struct event *flush_ev;      /* flush callback, activated manually */
+    bool flush_scheduled;
+    bool throttled;              /* local reads wait for the backlog to drain */
+
+    /* transmit scheduler */
+    struct tmux_stream *sched_head; /* streams with queued data, in DRR order */
+    struct tmux_stream *sched_tail;
+    uint32_t *wnd_pending;       /* streams with deferred window credit */
+    uint32_t wnd_pending_cnt;
+    uint32_t wnd_pending_cap;
+
+    /* keepalive */
+    uint32_t ping_id;            /* ID of the outstanding PING */
+    uint64_t ping_sent;          /* send time (us) of that PING, 0 if none */
+    time_t last_ack;             /* last PING acknowledgment */
+
+    struct tmux_session *next;   /* registered sessions */
+};
+
 struct tmux_stream {
+    struct tmux_session *session; /* session carrying the stream */
     uint32_t id;
     uint32_t recv_window;
     uint32_t send_window;
+    uint32_t max_window;    /* receive window we grant, >= MAX_STREAM_WINDOW_SIZE */
+    uint64_t window_epoch;  /* monotonic time (us) of the last window update */
+    uint32_t pending_window; /* credit waiting for the next batch flush */
     enum tcp_mux_state state;
-    struct ring_buffer tx_ring;
+    bool read_paused;       /* local reads stopped by backpressure */
+    bool fin_pending;       /* FIN waits for the send queue to drain */
     struct ring_buffer rx_ring;
 
-    // private arguments
-    UT_hash_handle hh;
+    /* transmit scheduler */
+    struct evbuffer *txq;   /* data waiting to be sent, NULL until needed */
+    uint32_t weight;        /* quanta per DRR round, mux_weight of the proxy */
+    uint32_t deficit;       /* bytes the stream may still send this round */
+    bool scheduled;         /* on the send queue of its session */
+    struct tmux_stream *sched_prev;
+    struct tmux_stream *sched_next;
 };
 
 typedef void (*handle_data_fn_t)(uint8_t *, int, void *);
 
+/**
+ * @brief Resets a frame decoder to wait for the next frame header.
+ *
+ * @param dec Pointer to the tmux_decoder structure.
+ */
+void tmux_decoder_init(struct tmux_decoder *dec);
+
+/**
+ * @brief Decodes the frames available on a mux session connection.
+ *
+ * Consumes complete headers and as much payload as has arrived, dispatching
+ * each frame to its handler. A partial header is left in the input buffer;
+ * partial DATA payload is consumed as it comes.
+ *
+ * @param dec Pointer to the decoder of the connection.
+ * @param bev The bufferevent of the mux session.
+ * @param fn  Handler for payload of streams without a local connection.
+ * @return 0 on success, -1 on a protocol error (GO_AWAY has been sent).
+ */
+int tmux_decoder_feed(struct tmux_decoder *dec, struct bufferevent *bev,
+                      handle_data_fn_t fn);
+
 /**
  * @brief Initializes TCP MUX stream.
  * 
@@ -95,6 +208,106 @@ typedef void (*handle_data_fn_t)(uint8_t *, int, void *);
 void init_tmux_stream(struct tmux_stream *stream, uint32_t id,
                       enum tcp_mux_state state);
 
+/**
+ * @brief Releases the buffers held by a TCP MUX stream.
+ *
+ * Must be called before the memory holding the stream is freed or the
+ * stream is initialized again.
+ *
+ * @param stream Pointer to the tmux_stream structure.
+ */
+void release_tmux_stream(struct tmux_stream *stream);
+
+/**
+ * @brief Changes the receive window granted to a TCP MUX stream.
+ *
+ * Growth beyond MAX_STREAM_WINDOW_SIZE is taken from the global window
+ * budget and may be cut short when the budget runs out. A larger window is
+ * advertised to the peer right away.
+ *
+ * @param bout   The bufferevent to send the window update message.
+ * @param stream Pointer to the tmux_stream structure.
+ * @param window Requested receive window in bytes.
+ */
+void tmux_stream_set_window(struct bufferevent *bout, struct tmux_stream *stream,
+                            uint32_t window);
+
+/**
+ * @brief Starts a mux session on a connected bufferevent.
+ *
+ * Registers the session so frames written to @p bev are batched and resets
+ * its decoder.
+ *
+ * @param session Pointer to the tmux_session structure.
+ * @param bev     The bufferevent connected to frps.
+ */
+void tmux_session_init(struct tmux_session *session, struct bufferevent *bev);
+
+/**
+ * @brief Stops a mux session and drops all frames batched for it.
+ *
+ * The bufferevent is not freed. Streams attached to the session stay
+ * attached and must be released by the caller.
+ *
+ * @param session Pointer to the tmux_session structure.
+ */
+void tmux_session_reset(struct tmux_session *session);
+
+/**
+ * @brief Finds the mux session running on a bufferevent.
+ *
+ * @param bev The bufferevent to look up.
+ * @return The session, or NULL if @p bev carries no registered session.
+ */
+struct tmux_session *tmux_session_of(struct bufferevent *bev);
+
+/**
+ * @brief Attaches a stream to the session that will carry it.
+ *
+ * @param stream  Pointer to the tmux_stream structure.
+ * @param session Pointer to the tmux_session structure.
+ */
+void tmux_stream_attach(struct tmux_stream *stream, struct tmux_session *session);
+
+/**
+ * @brief Returns the load of a mux session.
+ *
+ * @param session Pointer to the tmux_session structure.
+ * @return Bytes queued for sending but not yet written to the socket.
+ */
+size_t tmux_session_backlog(struct tmux_session *session);
+
+/**
+ * @brief Write callback of a mux session connection.
+ *
+ * Resumes the local reads paused on the session backlog once it has
+ * drained to TX_LOW_WATERMARK. Does nothing for other connections.
+ *
+ * @param bev The bufferevent of the connection.
+ * @param ctx Unused.
+ */
+void tmux_session_write_cb(struct bufferevent *bev, void *ctx);
+
+/**
+ * @brief Sends a keepalive PING on a mux session.
+ *
+ * At most one PING is outstanding; its acknowledgment refreshes
+ * last_ack and feeds the RTT estimate used by window auto-tuning.
+ *
+ * @param session Pointer to the tmux_session structure.
+ */
+void tmux_session_ping(struct tmux_session *session);
+
+/**
+ * @brief Sends a PING to measure the round trip time of the mux session.
+ *
+ * Only sent while window auto-tuning is enabled, as the RTT is not used
+ * for anything else.
+ *
+ * @param bout The bufferevent of the mux session.
+ */
+void tcp_mux_probe_rtt(struct bufferevent *bout);
+
 /**
  * @brief Validates a TCP MUX protocol.
  * 
@@ -196,9 +409,10 @@ int handle_tcp_mux_stream(struct tcp_mux_header *tmux_hdr, handle_data_fn_t fn);
 /**
  * @brief Handles a TCP MUX ping message.
  *
+ * @param bev      The bufferevent of the session the ping arrived on.
  * @param tmux_hdr Pointer to the TCP MUX header.
  */
-void handle_tcp_mux_ping(struct tcp_mux_header *tmux_hdr);
+void handle_tcp_mux_ping(struct bufferevent *bev, struct tcp_mux_header *tmux_hdr);
 
 /**
  * @brief Handles a TCP MUX go away message.
@@ -207,18 +421,96 @@ void handle_tcp_mux_ping(struct tcp_mux_header *tmux_hdr);
  */
 void handle_tcp_mux_go_away(struct tcp_mux_header *tmux_hdr);
 
+/**
+ * @brief Starts processing of an incoming DATA frame.
+ *
+ * Decides whether the frame payload can be handed to the local connection
+ * without passing through the stream rx ring. For forwarded frames the
+ * flags and receive window are processed here, before any payload is read.
+ *
+ * @param tmux_hdr Pointer to the TCP MUX header of the DATA frame.
+ * @return One of enum tmux_frame_mode, -1 on a protocol error.
+ */
+int tmux_stream_data_begin(struct tcp_mux_header *tmux_hdr);
+
+/**
+ * @brief Moves forwarded DATA payload to the stream's local connection.
+ *
+ * The payload chains are moved from @p src with evbuffer_remove_buffer(),
+ * so no copy is made. Payload for a stream that vanished is drained.
+ *
+ * @param src       Input evbuffer of the control connection.
+ * @param stream_id Stream ID the payload belongs to.
+ * @param len       Number of payload bytes available in @p src.
+ * @return Number of bytes handed to the local connection.
+ */
+uint32_t tmux_stream_forward(struct evbuffer *src, uint32_t stream_id,
+                             uint32_t len);
+
+/**
+ * @brief Write callback of the local connection of a proxy client.
+ *
+ * Returns the receive window credit held back while forwarded payload
+ * waited in the local output, once it has drained to half the stream
+ * window. Does nothing for streams that are not established.
+ *
+ * @param bev The local bufferevent of the proxy client.
+ * @param ctx Pointer to the proxy client.
+ */
+void tmux_stream_local_write_cb(struct bufferevent *bev, void *ctx);
+
+/**
+ * @brief Writes the content of an evbuffer to a tmux stream.
+ *
+ * Like tmux_stream_write(), but the chains of @p src are moved instead of
+ * copied. @p src is always drained.
+ *
+ * @param bev    The bufferevent of the control connection.
+ * @param src    Evbuffer holding the data to send.
+ * @param stream Pointer to the tmux_stream structure.
+ * @return Number of bytes sent or queued.
+ */
+uint32_t tmux_stream_write_buffer(struct bufferevent *bev, struct evbuffer *src,
+                                  struct tmux_stream *stream);
+
 /**
  * @brief Writes data to a tmux stream.
  *
+ * Data goes out at once while the session is idle and the send window
+ * covers it. Otherwise it waits in the send queue of the stream for the
+ * transmit scheduler; nothing is dropped.
+ *
  * @param bev    The bufferevent to write data to.
  * @param data   Pointer to the data buffer to write.
  * @param length Length of the data to write.
  * @param stream Pointer to the tmux_stream structure.
- * @return Number of bytes written.
+ * @return Number of bytes sent or queued, 0 if the stream is closed or the
+ *         send queue cannot be allocated.
  */
 uint32_t tmux_stream_write(struct bufferevent *bev, uint8_t *data,
                            uint32_t length, struct tmux_stream *stream);
 
+/**
+ * @brief Tells whether the producer of a tmux stream has to pause.
+ *
+ * @param stream Pointer to the tmux_stream structure.
+ * @return true if the send queue is above WBUF_SIZE, the send window is
+ *         exhausted or the session backlog reached TX_HIGH_WATERMARK.
+ */
+bool tmux_stream_blocked(struct tmux_stream *stream);
+
+/**
+ * @brief Pauses reading from the local connection of a tmux stream.
+ *
+ * Reading resumes by itself once tmux_stream_blocked() clears, through a
+ * window update or the session draining.
+ *
+ * @param stream Pointer to the tmux_stream structure.
+ * @param bev    The local connection feeding the stream, NULL if the caller
+ *               stops reading itself.
+ */
+void tmux_stream_pause(struct tmux_stream *stream, struct bufferevent *bev);
+
 /**
  * @brief Reads data from a tmux stream.
  *
@@ -236,37 +528,47 @@ uint32_t tmux_stream_read(struct bufferevent *bev, struct tmux_stream *stream,
 void reset_session_id();
 
 /**
- * @brief Retrieves the current tmux stream.
+ * @brief Adds a tmux stream to the stream table.
  *
- * @return Pointer to the current tmux_stream.
+ * @param stream Pointer to the tmux_stream to add.
  */
-struct tmux_stream *get_cur_stream();
+void add_stream(struct tmux_stream *stream);
 
 /**
- * @brief Sets the current tmux stream.
+ * @brief Deletes a tmux stream by its ID.
  *
- * @param stream Pointer to the tmux_stream to set as current.
+ * @param stream_id ID of the tmux_stream to delete.
+ */
+void del_stream(uint32_t stream_id);
+
+/**
+ * @brief Clears all tmux streams from the stream table.
  */
-void set_cur_stream(struct tmux_stream *stream);
+void clear_stream();
 
 /**
- * @brief Adds a tmux stream to the stream list.
+ * @brief Records the owner of a tmux stream, looked up with get_stream_owner().
  *
- * @param stream Pointer to the tmux_stream to add.
+ * @param stream Pointer to a tmux_stream already in the stream table.
+ * @param owner  Owner of the stream.
  */
-void add_stream(struct tmux_stream *stream);
+void set_stream_owner(struct tmux_stream *stream, void *owner);
 
 /**
- * @brief Deletes a tmux stream by its ID.
+ * @brief Retrieves the owner of a tmux stream by its ID.
  *
- * @param stream_id ID of the tmux_stream to delete.
+ * @param id ID of the tmux_stream.
+ * @return The owner if the stream is in the table, NULL otherwise.
  */
-void del_stream(uint32_t stream_id);
+void *get_stream_owner(uint32_t id);
 
 /**
- * @brief Clears all tmux streams from the stream list.
+ * @brief Calls fn for the owner of every owned tmux stream.
+ *
+ * @param fn  Callback; may delete the stream it is called for, no other.
+ * @param arg Argument passed to fn.
  */
-void clear_stream();
+void foreach_stream_owner(void (*fn)(void *owner, void *arg), void *arg);
 
 /**
  * @brief Retrieves a tmux stream by its ID.
@@ -0,0 +1,209 @@
+// Round trip of the AEAD records of the control connection
+//
+// gcc -I. test_aead_records.c crypto.c fastpbkdf2.c debug.c -lcrypto -levent
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <event2/buffer.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "crypto.h"
+#include "config.h"
+
+#define TAG_SIZE 16
+#define NONCE_SIZE 12
+#define MAX_RECORD 16384
+#define PAYLOAD_LEN 40000
+
+static int failures;
+
+#define CHECK(cond, what) do { \
+    if (!(cond)) { \
+        printf("FAIL %s: %s\n", cipher_name, what); \
+        failures++; \
+    } \
+} while (0)
+
+static const char *cipher_name;
+
+// crypto.c only asks for the config when it sets up the main coders
+struct common_conf *get_common_config(void) {
+    return NULL;
+}
+
+static const EVP_CIPHER *evp_cipher(int cipher) {
+    return cipher == CIPHER_AES_128_GCM ? EVP_aes_128_gcm() : EVP_chacha20_poly1305();
+}
+
+// Keys a context the way the peer does, independently of crypto.c
+static EVP_CIPHER_CTX *peer_ctx(const struct frp_coder *coder, const char *label, int enc) {
+    uint8_t info[16 + 13];
+    uint8_t key[EVP_MAX_MD_SIZE];
+    unsigned int key_len = 0;
+
+    memcpy(info, coder->iv, 16);
+    memcpy(info + 16, label, 13);
+    HMAC(EVP_sha256(), coder->key, sizeof(coder->key), info, sizeof(info), key, &key_len);
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    EVP_CipherInit_ex(ctx, evp_cipher(coder->cipher), NULL, NULL, NULL, enc);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, NONCE_SIZE, NULL);
+    EVP_CipherInit_ex(ctx, NULL, NULL, key, NULL, enc);
+    return ctx;
+}
+
+static void set_nonce(EVP_CIPHER_CTX *ctx, uint64_t seq, int enc) {
+    uint8_t nonce[NONCE_SIZE] = {0};
+    for (int i = NONCE_SIZE - 1; i >= NONCE_SIZE - 8; i--) {
+        nonce[i] = seq & 0xff;
+        seq >>= 8;
+    }
+    EVP_CipherInit_ex(ctx, NULL, NULL, NULL, nonce, enc);
+}
+
+// Seals one record as frps does, returns its length on the wire
+static size_t peer_seal(EVP_CIPHER_CTX *ctx, uint64_t seq, const uint8_t *data, size_t len, uint8_t *rec) {
+    int outlen = 0;
+
+    rec[0] = len >> 8;
+    rec[1] = len & 0xff;
+    set_nonce(ctx, seq, 1);
+    EVP_EncryptUpdate(ctx, NULL, &outlen, rec, 2);
+    EVP_EncryptUpdate(ctx, rec + 2, &outlen, data, len);
+    EVP_EncryptFinal_ex(ctx, rec + 2 + outlen, &outlen);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_SIZE, rec + 2 + len);
+    return 2 + len + TAG_SIZE;
+}
+
+// Opens one record as frps does, returns its payload length or -1
+static int peer_open(EVP_CIPHER_CTX *ctx, uint64_t seq, const uint8_t *rec, uint8_t *out) {
+    size_t len = (rec[0] << 8) | rec[1];
+    int outlen = 0;
+
+    set_nonce(ctx, seq, 0);
+    if (!EVP_DecryptUpdate(ctx, NULL, &outlen, rec, 2) ||
+        !EVP_DecryptUpdate(ctx, out, &outlen, rec + 2, len) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG_SIZE, (uint8_t *)rec + 2 + len) ||
+        EVP_DecryptFinal_ex(ctx, out + outlen, &outlen) <= 0) {
+        return -1;
+    }
+    return len;
+}
+
+// A fresh coder of the same token, salt and IV as base, at nonce 0
+static struct frp_coder *coder_pair(const struct frp_coder *base) {
+    struct frp_coder *coder = new_coder(base->token, base->salt);
+    memcpy(coder->iv, base->iv, sizeof(coder->iv));
+    coder->cipher = base->cipher;
+    return coder;
+}
+
+// seal_records() splits into records no larger than MAX_RECORD and keeps
+// counting nonces across calls
+static void test_seal(struct frp_coder *base, const uint8_t *plain) {
+    struct frp_coder *encoder = coder_pair(base);
+    struct evbuffer *wire = evbuffer_new();
+    static uint8_t out[MAX_RECORD];
+
+    size_t sealed = seal_records(encoder, plain, PAYLOAD_LEN, wire);
+    sealed += seal_records(encoder, plain, 100, wire);
+    CHECK(sealed == PAYLOAD_LEN + 100 + 4 * (2 + TAG_SIZE), "sealed length");
+    CHECK(encoder->seq == 4, "nonce count after four records");
+
+    EVP_CIPHER_CTX *ctx = peer_ctx(encoder, "xfrpc client", 0);
+    const size_t lens[] = {MAX_RECORD, MAX_RECORD, PAYLOAD_LEN - 2 * MAX_RECORD, 100};
+    size_t offset = 0;
+    for (uint64_t seq = 0; seq < 4; seq++) {
+        uint8_t *rec = evbuffer_pullup(wire, 2 + lens[seq] + TAG_SIZE);
+        CHECK(rec && peer_open(ctx, seq, rec, out) == (int)lens[seq], "record opens with its sequence nonce");
+        CHECK(memcmp(out, plain + (seq < 3 ? offset : 0), lens[seq]) == 0, "sealed payload");
+        evbuffer_drain(wire, 2 + lens[seq] + TAG_SIZE);
+        offset += lens[seq];
+    }
+    CHECK(evbuffer_get_length(wire) == 0, "no trailing bytes");
+
+    EVP_CIPHER_CTX_free(ctx);
+    evbuffer_free(wire);
+}
+
+// open_records() reassembles records cut at any point across reads
+static void test_open_split(struct frp_coder *base, const uint8_t *plain) {
+    struct frp_coder *decoder = coder_pair(base);
+    struct evbuffer *out = evbuffer_new();
+    static uint8_t wire[PAYLOAD_LEN + 8 * (2 + TAG_SIZE)];
+    size_t wire_len = 0;
+
+    EVP_CIPHER_CTX *ctx = peer_ctx(decoder, "xfrpc server", 1);
+    uint64_t seq = 0;
+    for (size_t off = 0; off < PAYLOAD_LEN; off += MAX_RECORD) {
+        size_t len = PAYLOAD_LEN - off < MAX_RECORD ? PAYLOAD_LEN - off : MAX_RECORD;
+        wire_len += peer_seal(ctx, seq++, plain + off, len, wire + wire_len);
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    // Reads of 1, 2, 3, ... bytes cut through headers, payloads and tags
+    size_t fed = 0, step = 1;
+    int opened = 0;
+    while (fed < wire_len) {
+        size_t len = wire_len - fed < step ? wire_len - fed : step;
+        int n = open_records(decoder, wire + fed, len, out);
+        CHECK(n >= 0, "split record opens");
+        opened += n > 0 ? n : 0;
+        fed += len;
+        step = step * 3 + 1;
+    }
+    CHECK(opened == PAYLOAD_LEN, "opened length");
+    CHECK(evbuffer_get_length(out) == PAYLOAD_LEN &&
+          memcmp(evbuffer_pullup(out, -1), plain, PAYLOAD_LEN) == 0, "opened payload");
+    CHECK(decoder->seq == seq, "nonce count after opening");
+
+    evbuffer_free(out);
+}
+
+// A flipped tag bit, or a record out of sequence, is rejected and no
+// plaintext of it comes out
+static void test_open_reject(struct frp_coder *base, const uint8_t *plain) {
+    uint8_t rec0[2 + 64 + TAG_SIZE], rec1[2 + 64 + TAG_SIZE];
+
+    EVP_CIPHER_CTX *ctx = peer_ctx(base, "xfrpc server", 1);
+    size_t len = peer_seal(ctx, 0, plain, 64, rec0);
+    peer_seal(ctx, 1, plain, 64, rec1);
+    EVP_CIPHER_CTX_free(ctx);
+
+    struct frp_coder *decoder = coder_pair(base);
+    struct evbuffer *out = evbuffer_new();
+    rec0[len - 1] ^= 0x01;
+    CHECK(open_records(decoder, rec0, len, out) < 0, "tampered tag rejected");
+    CHECK(evbuffer_get_length(out) == 0, "tampered record yields nothing");
+    evbuffer_free(out);
+
+    decoder = coder_pair(base);
+    out = evbuffer_new();
+    CHECK(open_records(decoder, rec1, len, out) < 0, "record out of sequence rejected");
+    CHECK(evbuffer_get_length(out) == 0, "reordered record yields nothing");
+    evbuffer_free(out);
+}
+
+int main() {
+    static uint8_t plain[PAYLOAD_LEN];
+    for (size_t i = 0; i < sizeof(plain); i++) {
+        plain[i] = (i * 131 + (i >> 8)) & 0xff;
+    }
+
+    const int ciphers[] = {CIPHER_AES_128_GCM, CIPHER_CHACHA20_POLY1305};
+    const char *names[] = {"aes-128-gcm", "chacha20-poly1305"};
+    for (int i = 0; i < 2; i++) {
+        cipher_name = names[i];
+
+        struct frp_coder *base = new_coder("token", "frp");
+        base->cipher = ciphers[i];
+        test_seal(base, plain);
+        test_open_split(base, plain);
+        test_open_reject(base, plain);
+    }
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
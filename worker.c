@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * Copyright (c) 2023 Dengfeng Liu <liudf0716@gmail.com>
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <event2/thread.h>
+
+#include "debug.h"
+#include "tcpmux.h"
+#include "control.h"
+#include "worker.h"
+
+static struct xfrp_worker *workers;
+static int worker_count;
+static unsigned int next_worker;	/* round-robin start among equally loaded workers */
+
+/**
+ * @brief Thread body of a worker, runs its loop until stop_workers()
+ *
+ * @param arg The xfrp_worker structure of this thread
+ * @return Always NULL
+ */
+static void *worker_loop(void *arg)
+{
+	struct xfrp_worker *worker = arg;
+
+	if (event_base_loop(worker->base, EVLOOP_NO_EXIT_ON_EMPTY) < 0) {
+		debug(LOG_ERR, "Worker event loop failed");
+	}
+	return NULL;
+}
+
+/**
+ * @brief Frees the loop and resolver of a worker whose thread is gone
+ *
+ * @param worker Pointer to the xfrp_worker structure
+ */
+static void free_worker(struct xfrp_worker *worker)
+{
+	if (worker->dnsbase) {
+		evdns_base_free(worker->dnsbase, 0);
+		worker->dnsbase = NULL;
+	}
+	if (worker->base) {
+		event_base_free(worker->base);
+		worker->base = NULL;
+	}
+}
+
+/**
+ * @brief Starts the worker event loop threads
+ *
+ * Makes libevent thread aware first, so this must run before the main
+ * event base is created: the main loop hands connections to the workers
+ * through their bases.
+ *
+ * @param count Number of worker threads, 0 keeps everything on the main loop
+ * @return 0 on success, -1 on failure
+ */
+int start_workers(int count)
+{
+	if (count <= 0) {
+		return 0;
+	}
+
+	if (evthread_use_pthreads() != 0) {
+		debug(LOG_ERR, "libevent has no pthreads support, worker threads disabled");
+		return -1;
+	}
+
+	workers = calloc(count, sizeof(struct xfrp_worker));
+	if (!workers) {
+		debug(LOG_ERR, "Failed to allocate %d workers", count);
+		return -1;
+	}
+
+	for (worker_count = 0; worker_count < count; worker_count++) {
+		struct xfrp_worker *worker = &workers[worker_count];
+
+		worker->base = event_base_new();
+		if (!worker->base) {
+			debug(LOG_ERR, "Failed to create event base of worker %d", worker_count);
+			break;
+		}
+
+		worker->dnsbase = create_dns_base(worker->base);
+		if (pthread_create(&worker->tid, NULL, worker_loop, worker) != 0) {
+			debug(LOG_ERR, "Failed to start worker thread %d", worker_count);
+			free_worker(worker);
+			break;
+		}
+	}
+
+	if (worker_count < count) {
+		stop_workers();
+		return -1;
+	}
+
+	debug(LOG_INFO, "Started %d worker threads", worker_count);
+	return 0;
+}
+
+/**
+ * @brief Stops all worker threads and frees their loops
+ *
+ * Connections still owned by a worker are abandoned with its loop.
+ */
+void stop_workers(void)
+{
+	for (int i = 0; i < worker_count; i++) {
+		event_base_loopbreak(workers[i].base);
+		pthread_join(workers[i].tid, NULL);
+		free_worker(&workers[i]);
+	}
+
+	free(workers);
+	workers = NULL;
+	worker_count = 0;
+}
+
+/**
+ * @brief Picks the least loaded worker for a new work connection
+ *
+ * The connection is counted against the worker right away, so a burst of
+ * requests spreads out even before the workers have run. Ties go to the
+ * workers round-robin.
+ *
+ * @return The chosen worker, NULL when no worker threads are running
+ */
+struct xfrp_worker *pick_worker(void)
+{
+	if (worker_count == 0) {
+		return NULL;
+	}
+
+	struct xfrp_worker *best = NULL;
+	int best_load = 0;
+	unsigned int start = next_worker++;
+
+	for (int i = 0; i < worker_count; i++) {
+		struct xfrp_worker *worker = &workers[(start + i) % worker_count];
+		int load = __atomic_load_n(&worker->nconns, __ATOMIC_RELAXED);
+
+		if (!best || load < best_load) {
+			best = worker;
+			best_load = load;
+		}
+	}
+
+	__atomic_add_fetch(&best->nconns, 1, __ATOMIC_RELAXED);
+	return best;
+}
+
+/**
+ * @brief Drops the work connection counted by pick_worker()
+ *
+ * @param worker The worker that owned the connection
+ */
+void worker_release(struct xfrp_worker *worker)
+{
+	if (worker) {
+		__atomic_sub_fetch(&worker->nconns, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @brief Runs a function once on the thread of a worker
+ *
+ * @param worker The worker to run on
+ * @param fn     Callback, invoked with fd -1 and EV_TIMEOUT
+ * @param arg    Argument passed to fn
+ * @return 0 on success, -1 on failure
+ */
+int worker_dispatch(struct xfrp_worker *worker, event_callback_fn fn, void *arg)
+{
+	if (!worker || !worker->base) {
+		return -1;
+	}
+
+	if (event_base_once(worker->base, -1, EV_TIMEOUT, fn, arg, NULL) < 0) {
+		debug(LOG_ERR, "Failed to hand work to worker thread");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Returns the resolver of the worker running an event base
+ *
+ * @param base Event base of a connection
+ * @return The worker's resolver, NULL if base does not belong to a worker
+ */
+struct evdns_base *worker_dns_base(struct event_base *base)
+{
+	for (int i = 0; i < worker_count; i++) {
+		if (workers[i].base == base) {
+			return workers[i].dnsbase;
+		}
+	}
+	return NULL;
+}
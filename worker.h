@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * Copyright (c) 2023 Dengfeng Liu <liudf0716@gmail.com>
+ */
+
+#ifndef XFRPC_WORKER_H
+#define XFRPC_WORKER_H
+
+#include <pthread.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+
+/**
+ * @brief Event loop thread carrying direct work connections
+ *
+ * A work connection and its local connection live on one worker for their
+ * whole life, so nothing a worker touches is shared with another loop
+ * except the read-only configuration.
+ */
+struct xfrp_worker {
+	pthread_t           tid;
+	struct event_base   *base;      /* loop of this thread */
+	struct evdns_base   *dnsbase;   /* resolver bound to base */
+	int                 nconns;     /* work connections owned, updated atomically */
+};
+
+/* Worker lifecycle, called from the main thread */
+int start_workers(int count);
+void stop_workers(void);
+
+/* Work connection placement */
+struct xfrp_worker *pick_worker(void);
+void worker_release(struct xfrp_worker *worker);
+int worker_dispatch(struct xfrp_worker *worker, event_callback_fn fn, void *arg);
+
+struct evdns_base *worker_dns_base(struct event_base *base);
+
+#endif // XFRPC_WORKER_H
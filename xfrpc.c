@@ -73,13 +73,15 @@ static void start_xfrpc_local_service(void)
  * @brief Main event loop for xfrpc
  * 
  * Initializes and runs the main control loop:
- * 1. Starts all configured local services
- * 2. Initializes main control
- * 3. Runs the control loop
- * 4. Cleans up on exit
+ * 1. Starts deriving the encryption key in the background
+ * 2. Starts all configured local services
+ * 3. Initializes main control
+ * 4. Runs the control loop
+ * 5. Cleans up on exit
  */
 void xfrpc_loop(void)
 {
+	start_key_precompute();
 	start_xfrpc_local_service();
 	init_main_control();
 	run_control();
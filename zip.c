@@ -6,7 +6,10 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
 #include <zlib.h>
+#include <event2/buffer.h>
 
 #include "zip.h"
 
@@ -119,3 +122,563 @@ int inflate_read(uint8_t *source, int len, uint8_t **dest, int *rlen, int gzip)
 	*rlen = totalsize;
 	return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;  
 }
+
+/*
+ * Snappy framed streams
+ *
+ * frp compresses work connections of proxies with use_compression through
+ * github.com/golang/snappy, whose stream format is a sequence of chunks:
+ * a 1 byte type, a 3 byte little endian length and the chunk data. The
+ * stream starts with the identifier chunk; data chunks carry the masked
+ * CRC-32C of their uncompressed content followed by a snappy block or by
+ * the raw data, at most SNAPPY_MAX_BLOCK bytes of it per chunk.
+ */
+
+static const uint8_t snappy_stream_id[] = {
+	SNAPPY_CHUNK_STREAM_ID, 0x06, 0x00, 0x00, 's', 'N', 'a', 'P', 'p', 'Y'
+};
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Fills the CRC-32C (Castagnoli) lookup table
+ */
+static void crc32c_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		}
+		crc32c_table[i] = c;
+	}
+}
+
+/**
+ * @brief Computes the masked CRC-32C snappy chunks carry
+ *
+ * @param data Uncompressed chunk content
+ * @param len Length of the content
+ * @return The masked checksum
+ */
+static uint32_t snappy_crc(const uint8_t *data, size_t len)
+{
+	uint32_t c = 0xffffffff;
+
+	pthread_once(&crc32c_once, crc32c_init);
+	while (len--) {
+		c = crc32c_table[(c ^ *data++) & 0xff] ^ (c >> 8);
+	}
+	c = ~c;
+	return ((c >> 15) | (c << 17)) + 0xa282ead8;
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void put_le24(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le24(p, v);
+	p[3] = v >> 24;
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @brief Worst case size of a snappy block of n input bytes
+ */
+static size_t snappy_max_compressed(size_t n)
+{
+	return 32 + n + n / 6;
+}
+
+static uint8_t *snappy_emit_literal(uint8_t *op, const uint8_t *lit, size_t len)
+{
+	size_t n = len - 1;
+
+	if (n < 60) {
+		*op++ = n << 2;
+	} else if (n < 256) {
+		*op++ = 60 << 2;
+		*op++ = n;
+	} else {
+		*op++ = 61 << 2;
+		*op++ = n & 0xff;
+		*op++ = n >> 8;
+	}
+	memcpy(op, lit, len);
+	return op + len;
+}
+
+static uint8_t *snappy_emit_copy_upto64(uint8_t *op, size_t offset, size_t len)
+{
+	if (len < 12 && offset < 2048) {
+		*op++ = 1 | ((len - 4) << 2) | ((offset >> 8) << 5);
+		*op++ = offset & 0xff;
+	} else {
+		*op++ = 2 | ((len - 1) << 2);
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+	}
+	return op;
+}
+
+static uint8_t *snappy_emit_copy(uint8_t *op, size_t offset, size_t len)
+{
+	while (len >= 68) {
+		op = snappy_emit_copy_upto64(op, offset, 64);
+		len -= 64;
+	}
+	if (len > 64) {
+		op = snappy_emit_copy_upto64(op, offset, 60);
+		len -= 60;
+	}
+	return snappy_emit_copy_upto64(op, offset, len);
+}
+
+/**
+ * @brief Compresses one block of at most SNAPPY_MAX_BLOCK bytes
+ *
+ * Greedy matching through a hash table of recent positions, sized to the
+ * input and kept per thread, as in the reference compressor.
+ *
+ * @param src Input
+ * @param n Input length
+ * @param dst Output, snappy_max_compressed(n) bytes
+ * @return Length of the compressed block
+ */
+static size_t snappy_compress_block(const uint8_t *src, size_t n, uint8_t *dst)
+{
+	static __thread uint16_t table[SNAPPY_HASH_SIZE];
+	uint8_t *op = dst;
+	size_t v = n;
+
+	// Preamble: uncompressed length as a varint
+	while (v >= 0x80) {
+		*op++ = v | 0x80;
+		v >>= 7;
+	}
+	*op++ = v;
+
+	if (n < SNAPPY_MIN_MATCH_INPUT) {
+		return n ? snappy_emit_literal(op, src, n) - dst : (size_t)(op - dst);
+	}
+
+	int shift = 32 - 8;
+	size_t table_size = 256;
+	while (table_size < SNAPPY_HASH_SIZE && table_size < n) {
+		table_size <<= 1;
+		shift--;
+	}
+	memset(table, 0, table_size * sizeof(table[0]));
+
+	// Leave room at the end so 4 byte loads stay inside the input
+	size_t limit = n - SNAPPY_INPUT_MARGIN;
+	size_t next_emit = 0;
+	size_t s = 1;
+
+	while (s < limit) {
+		uint32_t h = (load32(src + s) * 0x1e35a7bd) >> shift;
+		size_t candidate = table[h];
+		table[h] = s;
+
+		if (load32(src + candidate) != load32(src + s)) {
+			s += 1 + ((s - next_emit) >> 5);
+			continue;
+		}
+
+		if (s > next_emit) {
+			op = snappy_emit_literal(op, src + next_emit, s - next_emit);
+		}
+
+		size_t base = s;
+		s += 4;
+		candidate += 4;
+		while (s < n && src[s] == src[candidate]) {
+			s++;
+			candidate++;
+		}
+
+		op = snappy_emit_copy(op, base - (candidate - (s - base)), s - base);
+		next_emit = s;
+
+		if (s < limit) {
+			table[(load32(src + s - 1) * 0x1e35a7bd) >> shift] = s - 1;
+		}
+	}
+
+	if (next_emit < n) {
+		op = snappy_emit_literal(op, src + next_emit, n - next_emit);
+	}
+	return op - dst;
+}
+
+/**
+ * @brief Decompresses one snappy block
+ *
+ * @param src Compressed block
+ * @param len Length of the block
+ * @param dst Output, at least dst_len bytes
+ * @param dst_len Uncompressed length announced by the block preamble
+ * @return 0 on success, -1 if the block is corrupt
+ */
+static int snappy_decompress_block(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len)
+{
+	const uint8_t *end = src + len;
+	size_t d = 0;
+
+	// Skip the preamble, already parsed by snappy_block_length()
+	while (src < end && (*src & 0x80)) {
+		src++;
+	}
+	src++;
+
+	while (src < end) {
+		uint8_t tag = *src++;
+		size_t length, offset;
+
+		switch (tag & 3) {
+		case 0:
+			length = tag >> 2;
+			if (length >= 60) {
+				size_t extra = length - 59;
+				if (extra > 2 || (size_t)(end - src) < extra) return -1;
+				length = src[0] | (extra == 2 ? src[1] << 8 : 0);
+				src += extra;
+			}
+			length++;
+			if ((size_t)(end - src) < length || dst_len - d < length) return -1;
+			memcpy(dst + d, src, length);
+			src += length;
+			d += length;
+			continue;
+		case 1:
+			if (end - src < 1) return -1;
+			length = 4 + ((tag >> 2) & 7);
+			offset = ((tag & 0xe0) << 3) | src[0];
+			src += 1;
+			break;
+		case 2:
+			if (end - src < 2) return -1;
+			length = 1 + (tag >> 2);
+			offset = src[0] | (src[1] << 8);
+			src += 2;
+			break;
+		default:
+			if (end - src < 4) return -1;
+			length = 1 + (tag >> 2);
+			offset = get_le32(src);
+			src += 4;
+			break;
+		}
+
+		if (offset == 0 || offset > d || dst_len - d < length) return -1;
+
+		// Copies may overlap their own output
+		if (offset >= length) {
+			memcpy(dst + d, dst + d - offset, length);
+			d += length;
+		} else {
+			while (length--) {
+				dst[d] = dst[d - offset];
+				d++;
+			}
+		}
+	}
+
+	return d == dst_len ? 0 : -1;
+}
+
+/**
+ * @brief Parses the uncompressed length preamble of a snappy block
+ *
+ * @param src Compressed block
+ * @param len Length of the block
+ * @return The uncompressed length, or -1 if it is invalid or too large
+ */
+static long snappy_block_length(const uint8_t *src, size_t len)
+{
+	unsigned long v = 0;
+
+	for (size_t i = 0; i < len && i < 5; i++) {
+		v |= (unsigned long)(src[i] & 0x7f) << (7 * i);
+		if (!(src[i] & 0x80)) {
+			return v <= SNAPPY_MAX_BLOCK ? (long)v : -1;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Creates the state of one direction of a compressed stream
+ *
+ * @param min_gain Percent a sampled window has to save for the stream to
+ *                 keep compressing, 0 compresses everything
+ * @param stats Counters the sending side adds to, may be NULL
+ * @return The new stream, NULL on allocation failure
+ */
+struct zip_stream *zip_stream_new(int min_gain, struct zip_stats *stats)
+{
+	struct zip_stream *z = calloc(1, sizeof(struct zip_stream));
+	if (z) {
+		z->min_gain = min_gain;
+		z->stats = stats;
+	}
+	return z;
+}
+
+/**
+ * @brief Closes a sampled window and picks the mode of the stream
+ *
+ * @param z The compressing stream
+ * @param delta Counters of the current zip_compress() call
+ */
+static void zip_sample_done(struct zip_stream *z, struct zip_stats *delta)
+{
+	uint64_t saved = z->sample_in > z->sample_out ? z->sample_in - z->sample_out : 0;
+
+	delta->samples++;
+	if (saved * 100 < (uint64_t)z->sample_in * z->min_gain) {
+		z->raw_left = ZIP_REPROBE_SIZE;
+		delta->bypasses++;
+	}
+	z->sample_in = 0;
+	z->sample_out = 0;
+}
+
+/**
+ * @brief Adds the counters of one zip_compress() call to the proxy
+ */
+static void zip_stats_add(struct zip_stats *stats, const struct zip_stats *delta)
+{
+	__atomic_add_fetch(&stats->bytes_in, delta->bytes_in, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->bytes_out, delta->bytes_out, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->bytes_raw, delta->bytes_raw, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->compress_ns, delta->compress_ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->samples, delta->samples, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->bypasses, delta->bypasses, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Frees a compressed stream
+ *
+ * @param z The stream, may be NULL
+ */
+void zip_stream_free(struct zip_stream *z)
+{
+	if (!z) return;
+	if (z->pending) {
+		evbuffer_free(z->pending);
+	}
+	free(z);
+}
+
+/**
+ * @brief Compresses all data of src into snappy chunks appended to dst
+ *
+ * Whatever is available is compressed at once, in blocks of up to
+ * SNAPPY_MAX_BLOCK bytes, and every block goes out as a complete chunk:
+ * the peer can decode everything sent so far, as with Z_SYNC_FLUSH. Each
+ * chunk is compressed straight into space reserved in dst; blocks that do
+ * not shrink by an eighth are sent raw.
+ *
+ * Compression is adaptive: every ZIP_PROBE_SIZE bytes compressed form a
+ * sample, and a sample saving less than min_gain percent switches the
+ * stream to raw chunks for the next ZIP_REPROBE_SIZE bytes, after which
+ * it samples again. TLS, video and other incompressible flows so cost
+ * little more than the checksum.
+ *
+ * @param z The compressing stream
+ * @param src Uncompressed data, drained
+ * @param dst Evbuffer the chunks are appended to
+ * @return Number of bytes appended to dst, -1 on failure
+ */
+long zip_compress(struct zip_stream *z, struct evbuffer *src, struct evbuffer *dst)
+{
+	struct zip_stats delta = {0};
+	long total = 0;
+
+	if (!z->started) {
+		if (evbuffer_add(dst, snappy_stream_id, sizeof(snappy_stream_id)) < 0) {
+			return -1;
+		}
+		z->started = 1;
+		total += sizeof(snappy_stream_id);
+	}
+
+	size_t avail;
+	while ((avail = evbuffer_get_length(src)) > 0) {
+		size_t n = avail < SNAPPY_MAX_BLOCK ? avail : SNAPPY_MAX_BLOCK;
+		int bypass = z->raw_left > 0;
+		if (bypass && n > z->raw_left) {
+			n = z->raw_left;
+		}
+
+		const uint8_t *in = evbuffer_pullup(src, n);
+		struct evbuffer_iovec vec;
+		size_t room = bypass ? n : snappy_max_compressed(n);
+
+		if (!in || evbuffer_reserve_space(dst, 8 + room, &vec, 1) != 1) {
+			total = -1;
+			break;
+		}
+
+		uint8_t *chunk = vec.iov_base;
+		size_t clen = n;
+		if (!bypass) {
+			uint64_t start = now_ns();
+			clen = snappy_compress_block(in, n, chunk + 8);
+			delta.compress_ns += now_ns() - start;
+		}
+		if (clen >= n - n / 8) {
+			chunk[0] = SNAPPY_CHUNK_RAW;
+			memcpy(chunk + 8, in, n);
+			clen = n;
+		} else {
+			chunk[0] = SNAPPY_CHUNK_COMPRESSED;
+		}
+		put_le24(chunk + 1, clen + 4);
+		put_le32(chunk + 4, snappy_crc(in, n));
+
+		vec.iov_len = 8 + clen;
+		if (evbuffer_commit_space(dst, &vec, 1) < 0) {
+			total = -1;
+			break;
+		}
+		evbuffer_drain(src, n);
+		total += vec.iov_len;
+
+		if (bypass) {
+			z->raw_left -= n;
+			delta.bytes_raw += n;
+			continue;
+		}
+
+		delta.bytes_in += n;
+		delta.bytes_out += vec.iov_len;
+		z->sample_in += n;
+		z->sample_out += vec.iov_len;
+		if (z->min_gain > 0 && z->sample_in >= ZIP_PROBE_SIZE) {
+			zip_sample_done(z, &delta);
+		}
+	}
+
+	if (z->stats) {
+		zip_stats_add(z->stats, &delta);
+	}
+	return total;
+}
+
+/**
+ * @brief Decodes the complete snappy chunks of a stream into dst
+ *
+ * A partial chunk stays in the stream until the rest arrives. Blocks are
+ * decompressed straight into space reserved in dst.
+ *
+ * @param z The decompressing stream
+ * @param src Compressed data, drained
+ * @param dst Evbuffer the uncompressed data is appended to
+ * @return Number of bytes appended to dst, -1 if the stream is corrupt
+ */
+long zip_decompress(struct zip_stream *z, struct evbuffer *src, struct evbuffer *dst)
+{
+	if (!z->pending && !(z->pending = evbuffer_new())) {
+		return -1;
+	}
+	evbuffer_add_buffer(z->pending, src);
+
+	long total = 0;
+	for (;;) {
+		size_t avail = evbuffer_get_length(z->pending);
+		uint8_t hdr[4];
+
+		if (avail < sizeof(hdr)) {
+			break;
+		}
+		evbuffer_copyout(z->pending, hdr, sizeof(hdr));
+
+		size_t len = hdr[1] | (hdr[2] << 8) | (hdr[3] << 16);
+		if (avail < sizeof(hdr) + len) {
+			break;
+		}
+
+		uint8_t type = hdr[0];
+		if (!z->started && type != SNAPPY_CHUNK_STREAM_ID) {
+			return -1;
+		}
+
+		if (type == SNAPPY_CHUNK_COMPRESSED || type == SNAPPY_CHUNK_RAW) {
+			if (len < 4 || len > 4 + snappy_max_compressed(SNAPPY_MAX_BLOCK)) {
+				return -1;
+			}
+
+			const uint8_t *chunk = evbuffer_pullup(z->pending, sizeof(hdr) + len);
+			const uint8_t *body = chunk + 8;
+			size_t body_len = len - 4;
+			long n = type == SNAPPY_CHUNK_RAW ? (long)body_len :
+				snappy_block_length(body, body_len);
+			struct evbuffer_iovec vec;
+
+			if (n < 0 || n > SNAPPY_MAX_BLOCK) {
+				return -1;
+			}
+			if (n > 0) {
+				if (evbuffer_reserve_space(dst, n, &vec, 1) != 1) {
+					return -1;
+				}
+				if (type == SNAPPY_CHUNK_RAW) {
+					memcpy(vec.iov_base, body, n);
+				} else if (snappy_decompress_block(body, body_len, vec.iov_base, n) < 0) {
+					return -1;
+				}
+				// Uncommitted, corrupt data never reaches dst
+				if (snappy_crc(vec.iov_base, n) != get_le32(chunk + 4)) {
+					return -1;
+				}
+				vec.iov_len = n;
+				if (evbuffer_commit_space(dst, &vec, 1) < 0) {
+					return -1;
+				}
+				total += n;
+			}
+		} else if (type == SNAPPY_CHUNK_STREAM_ID) {
+			uint8_t id[sizeof(snappy_stream_id)];
+			if (len != sizeof(snappy_stream_id) - 4) {
+				return -1;
+			}
+			evbuffer_copyout(z->pending, id, sizeof(id));
+			if (memcmp(id, snappy_stream_id, sizeof(id)) != 0) {
+				return -1;
+			}
+			z->started = 1;
+		} else if (type < 0x80) {
+			// Reserved unskippable chunk
+			return -1;
+		}
+
+		evbuffer_drain(z->pending, sizeof(hdr) + len);
+	}
+	return total;
+}
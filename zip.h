@@ -13,8 +13,52 @@
 
 #include <stdint.h>
 
+#define SNAPPY_MAX_BLOCK        65536   /* uncompressed bytes per chunk */
+#define SNAPPY_HASH_SIZE        (1 << 14)
+#define SNAPPY_MIN_MATCH_INPUT  17      /* shorter blocks are sent as one literal */
+#define SNAPPY_INPUT_MARGIN     15
+
+#define SNAPPY_CHUNK_COMPRESSED 0x00
+#define SNAPPY_CHUNK_RAW        0x01
+#define SNAPPY_CHUNK_STREAM_ID  0xff
+
+/* Adaptive compression: sample a window, bypass when it saves too little */
+#define ZIP_PROBE_SIZE          (64 * 1024)         /* bytes compressed per sample */
+#define ZIP_REPROBE_SIZE        (8 * 1024 * 1024)   /* bytes sent raw before sampling again */
+#define ZIP_MIN_GAIN            10                  /* default percent saved to keep compressing */
+
+struct evbuffer;
+
+/* Compression counters of a proxy, shared by its streams and updated atomically */
+struct zip_stats {
+	uint64_t    bytes_in;       /* data sent through the compressor */
+	uint64_t    bytes_out;      /* wire bytes it produced */
+	uint64_t    bytes_raw;      /* data sent raw while bypassing */
+	uint64_t    compress_ns;    /* time spent compressing */
+	uint32_t    samples;        /* sampled windows */
+	uint32_t    bypasses;       /* samples that switched a stream to bypass */
+};
+
+/* One direction of a snappy framed stream, as frp's use_compression speaks it */
+struct zip_stream {
+	int             started;    /* stream identifier sent or seen */
+	struct evbuffer *pending;   /* partial chunk received */
+
+	/* Sending side of adaptive compression */
+	int             min_gain;   /* percent, 0 always compresses */
+	uint32_t        raw_left;   /* bytes to send raw before the next sample */
+	uint32_t        sample_in;  /* data compressed in the current window */
+	uint32_t        sample_out; /* wire bytes of the current window */
+	struct zip_stats *stats;    /* counters of the proxy, may be NULL */
+};
+
 int deflate_write(uint8_t *source, int len, uint8_t **dest, int *wlen, int gzip);
 
 int inflate_read(uint8_t *source, int len, uint8_t **dest, int *rlen, int gzip);
 
+struct zip_stream *zip_stream_new(int min_gain, struct zip_stats *stats);
+void zip_stream_free(struct zip_stream *z);
+long zip_compress(struct zip_stream *z, struct evbuffer *src, struct evbuffer *dst);
+long zip_decompress(struct zip_stream *z, struct evbuffer *src, struct evbuffer *dst);
+
 #endif